@@ -0,0 +1,41 @@
+#-------------------------------------------------
+#
+# Rendering benchmark for the QGen layout engine.
+# Runs headless on the offscreen QPA platform.
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent
+LIBS     += -lgiac -lgmp
+
+TARGET = ample-benchmark
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += ..
+DEPENDPATH += ..
+
+SOURCES += \
+        main.cpp \
+    ../qgen.cpp \
+    ../mathglyphs.cpp \
+    ../fontmetricstable.cpp \
+    ../rendercontext.cpp \
+    ../hittestindex.cpp \
+    ../session.cpp \
+    ../sessionpool.cpp
+
+HEADERS += \
+    ../qgen.h \
+    ../mathglyphs.h \
+    ../fontmetricstable.h \
+    ../rendercontext.h \
+    ../hittestindex.h \
+    ../session.h \
+    ../sessionpool.h
+
+RESOURCES += \
+    ../resources.qrc
@@ -0,0 +1,563 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Rendering benchmark for the QGen layout engine. A fixed corpus is rendered through
+ * QGen::render(int) on the offscreen platform; for every expression the time per render
+ * with a cold and a warm render cache, the allocation counters and the size of the picture
+ * are reported, together with the number of paint operations recorded in it. The last
+ * sections compare serial and parallel layout of a large matrix, time the conversion of
+ * identifier names to math letters against the former linear implementation and measure the
+ * latency of a burst of trivial evaluations, from submission to the jobFinished signal.
+ *
+ * Usage: ample-benchmark [--iterations N] [--evaluations N] [--json] [--output FILE] */
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QFontDatabase>
+#include <QFile>
+#include <QTextStream>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QPaintEngine>
+#include <QPaintDevice>
+#include <QThreadPool>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+#include <climits>
+#include "qgen.h"
+#include "session.h"
+
+struct PaintOperations
+{
+    int textItems;
+    int paths;
+    int images;
+    int lines;
+    int rects;
+    int polygons;
+    int stateChanges;
+
+    int total() const { return textItems + paths + images + lines + rects + polygons; }
+};
+
+class PaintOperationCounter : public QPaintEngine
+{
+    PaintOperations m_operations;
+
+public:
+    PaintOperationCounter() : QPaintEngine(AllFeatures) { m_operations = PaintOperations(); }
+
+    const PaintOperations &operations() const { return m_operations; }
+
+    using QPaintEngine::drawLines;
+    using QPaintEngine::drawRects;
+    using QPaintEngine::drawPolygon;
+
+    bool begin(QPaintDevice *) { return true; }
+    bool end() { return true; }
+    void updateState(const QPaintEngineState &) { ++m_operations.stateChanges; }
+    void drawTextItem(const QPointF &, const QTextItem &) { ++m_operations.textItems; }
+    void drawPath(const QPainterPath &) { ++m_operations.paths; }
+    void drawPixmap(const QRectF &, const QPixmap &, const QRectF &) { ++m_operations.images; }
+    void drawImage(const QRectF &, const QImage &, const QRectF &, Qt::ImageConversionFlags) { ++m_operations.images; }
+    void drawLines(const QLineF *, int lineCount) { m_operations.lines += lineCount; }
+    void drawRects(const QRectF *, int rectCount) { m_operations.rects += rectCount; }
+    void drawPolygon(const QPointF *, int, PolygonDrawMode) { ++m_operations.polygons; }
+    Type type() const { return User; }
+};
+
+// A paint device which only counts what is painted on it; pictures are replayed onto it.
+class PaintOperationDevice : public QPaintDevice
+{
+    mutable PaintOperationCounter m_engine;
+
+public:
+    QPaintEngine *paintEngine() const { return &m_engine; }
+    const PaintOperations &operations() const { return m_engine.operations(); }
+
+protected:
+    int metric(PaintDeviceMetric metric) const
+    {
+        switch (metric)
+        {
+        case PdmWidth:
+        case PdmHeight:
+            return 100000;
+        case PdmWidthMM:
+        case PdmHeightMM:
+            return 100000 * 254 / 960;
+        case PdmNumColors:
+            return INT_MAX;
+        case PdmDepth:
+            return 32;
+        case PdmDpiX:
+        case PdmDpiY:
+        case PdmPhysicalDpiX:
+        case PdmPhysicalDpiY:
+            return 96;
+        case PdmDevicePixelRatio:
+            return 1;
+        case PdmDevicePixelRatioScaled:
+            return int(devicePixelRatioFScale());
+        default:
+            return QPaintDevice::metric(metric);
+        }
+    }
+};
+
+struct CorpusEntry
+{
+    QString name;
+    QGen expression;
+};
+
+struct Timing
+{
+    qint64 median;
+    qint64 minimum;
+};
+
+struct Measurement
+{
+    QString name;
+    Timing cold;
+    Timing warm;
+    int expressionCopies;
+    int layoutNodes;
+    int pictureBytes;
+    QRect boundingRect;
+    PaintOperations operations;
+};
+
+static const int alignment = QGen::AlignLeft | QGen::AlignBaseline;
+
+static QString deepFraction(int depth)
+{
+    QString text = "x";
+    for (int i = depth; i > 0; --i)
+        text = QString("%1/(%2+%3)").arg(i).arg(i + 1).arg(text);
+    return text;
+}
+
+static QString powerTower(int height)
+{
+    QString text = "z";
+    for (int i = 0; i < height; ++i)
+        text = QString("(a_%1+1)^(%2)").arg(i).arg(text);
+    return text;
+}
+
+static QString largeSum(int termCount)
+{
+    QStringList terms;
+    for (int i = 1; i <= termCount; ++i)
+        terms << QString("%1*x^%2*y_%3").arg(i % 7 + 2).arg(i % 5 + 1).arg(i);
+    return terms.join("+");
+}
+
+static QString symbolicMatrix(int size)
+{
+    QStringList rows;
+    for (int i = 0; i < size; ++i)
+    {
+        QStringList entries;
+        for (int j = 0; j < size; ++j)
+            entries << QString("sin(x)^%1/(y+%2)").arg(i + 1).arg(j + 1);
+        rows << "[" + entries.join(",") + "]";
+    }
+    return "[" + rows.join(",") + "]";
+}
+
+static QString longIdentifiers(int count)
+{
+    static const char *names[] = { "alpha", "beta", "Gamma", "delta", "epsilon", "theta",
+                                   "lambda", "mu", "Sigma", "phi", "psi", "Omega" };
+    QStringList factors;
+    for (int i = 0; i < count; ++i)
+        factors << QString("%1_%2%3").arg(names[i % 12]).arg(names[(i * 5 + 1) % 12]).arg(i);
+    return factors.join("*");
+}
+
+static QString mapTable(int entryCount)
+{
+    QStringList pairs;
+    for (int i = 1; i <= entryCount; ++i)
+        pairs << QString("%1=x^%1+%2").arg(i).arg(i * 3);
+    return "table(" + pairs.join(",") + ")";
+}
+
+static QGen parsed(const QString &text, const context *ct)
+{
+    return QGen(text, ct);
+}
+
+static QGen evaluated(const QString &text, const context *ct)
+{
+    return QGen(QGen(text, ct).expression().eval(1, ct), ct);
+}
+
+static QVector<CorpusEntry> buildCorpus(const context *ct)
+{
+    QVector<CorpusEntry> corpus;
+    corpus.append({ "deep-fraction", parsed(deepFraction(24), ct) });
+    corpus.append({ "power-tower", parsed(powerTower(8), ct) });
+    corpus.append({ "large-sum", parsed(largeSum(500), ct) });
+    corpus.append({ "symbolic-matrix", parsed(symbolicMatrix(12), ct) });
+    // over 35000 digits, above the threshold of the parallel digit conversion
+    corpus.append({ "huge-integer", evaluated("factorial(10000)", ct) });
+    corpus.append({ "long-identifiers", parsed(longIdentifiers(60), ct) });
+    corpus.append({ "map", evaluated(mapTable(300), ct) });
+    return corpus;
+}
+
+static Timing summarize(QVector<qint64> &samples)
+{
+    std::sort(samples.begin(), samples.end());
+    Timing timing;
+    timing.median = samples.at(samples.size() / 2);
+    timing.minimum = samples.first();
+    return timing;
+}
+
+static Timing timeRendering(const QGen &g, int iterations, bool coldCache)
+{
+    QVector<qint64> samples;
+    QElapsedTimer timer;
+    g.render(alignment);
+    for (int i = 0; i < iterations; ++i)
+    {
+        if (coldCache)
+            QGen::clearRenderCache();
+        timer.start();
+        QPicture picture = g.render(alignment);
+        samples.append(timer.nsecsElapsed());
+    }
+    return summarize(samples);
+}
+
+static Measurement measure(const CorpusEntry &entry, int iterations)
+{
+    Measurement m;
+    m.name = entry.name;
+    QGen::clearRenderCache();
+    QGen::resetAllocationCounters();
+    QPicture picture = entry.expression.render(alignment);
+    m.expressionCopies = QGen::expressionCopies();
+    m.layoutNodes = QGen::layoutNodes();
+    m.pictureBytes = int(picture.size());
+    m.boundingRect = picture.boundingRect();
+    PaintOperationDevice device;
+    QPainter painter(&device);
+    picture.play(&painter);
+    painter.end();
+    m.operations = device.operations();
+    m.cold = timeRendering(entry.expression, iterations, true);
+    m.warm = timeRendering(entry.expression, iterations, false);
+    return m;
+}
+
+static QJsonObject timingToJson(const Timing &timing)
+{
+    QJsonObject object;
+    object["medianNs"] = double(timing.median);
+    object["minimumNs"] = double(timing.minimum);
+    return object;
+}
+
+static QJsonObject measurementToJson(const Measurement &m)
+{
+    QJsonObject object, operations;
+    object["name"] = m.name;
+    object["cold"] = timingToJson(m.cold);
+    object["warm"] = timingToJson(m.warm);
+    object["expressionCopies"] = m.expressionCopies;
+    object["layoutNodes"] = m.layoutNodes;
+    object["pictureBytes"] = m.pictureBytes;
+    object["width"] = m.boundingRect.width();
+    object["height"] = m.boundingRect.height();
+    operations["textItems"] = m.operations.textItems;
+    operations["paths"] = m.operations.paths;
+    operations["images"] = m.operations.images;
+    operations["lines"] = m.operations.lines;
+    operations["rects"] = m.operations.rects;
+    operations["polygons"] = m.operations.polygons;
+    operations["stateChanges"] = m.operations.stateChanges;
+    operations["total"] = m.operations.total();
+    object["operations"] = operations;
+    return object;
+}
+
+// The linear name search and per-letter arithmetic which MathGlyphs used before its lookup
+// tables, kept as the baseline of the identifier conversion benchmark.
+static bool referenceGreekLetter(const QString &name, QChar &letter)
+{
+    static const QStringList smallNames = QStringList()
+            << "alpha" << "beta" << "gamma" << "delta" << "epsilon" << "zeta" << "eta" << "theta"
+            << "iota" << "kappa" << "lambda" << "mu" << "nu" << "xi" << "omicron" << "pi" << "rho"
+            << "sigma" << "tau" << "upsilon" << "phi" << "chi" << "psi" << "omega";
+    static const QStringList capitalNames = QStringList()
+            << "Alpha" << "Beta" << "Gamma" << "Delta" << "Epsilon" << "Zeta" << "Eta" << "Theta"
+            << "Iota" << "Kappa" << "Lambda" << "Mu" << "Nu" << "Xi" << "Omicron" << "Pi" << "Rho"
+            << "Sigma" << "Tau" << "Upsilon" << "Phi" << "Chi" << "Psi" << "Omega";
+    for (ushort i = 0; i < 24; ++i)
+    {
+        ushort offset = i > 16 ? i + 1 : i;
+        if (name == smallNames.at(i))
+        {
+            letter = QChar(offset + 945);
+            return true;
+        }
+        if (name == capitalNames.at(i))
+        {
+            letter = QChar(offset + 913);
+            return true;
+        }
+    }
+    return false;
+}
+
+static QString referenceLetterToMath(QChar letter, bool greek, bool italic)
+{
+    bool isCapital = letter.isUpper();
+    uint code = letter.unicode() - (greek ? (isCapital ? 913 : 945) : (isCapital ? 65 : 97));
+    if (!italic)
+        return letter;
+    if (greek)
+        code += isCapital ? 120546 : 120572;
+    else if (letter == 'h')
+        code = 8462;
+    else
+        code += isCapital ? 119860 : 119886;
+    return MathGlyphs::encodeUcs4(code);
+}
+
+static QStringList identifierNames()
+{
+    QStringList names;
+    names << "x" << "y" << "z" << "t" << "h" << "alpha" << "beta" << "Gamma" << "delta" << "epsilon"
+          << "theta" << "lambda" << "mu" << "Sigma" << "phi" << "psi" << "Omega" << "omega" << "rate"
+          << "velocity" << "n" << "k" << "Pi" << "xi" << "upsilon" << "Chi" << "tau" << "force";
+    return names;
+}
+
+// Converts every name the way identifierStringToUnicode does, in italic, and returns the median
+// time per name in nanoseconds.
+static qint64 timeIdentifierConversion(bool reference, int iterations)
+{
+    QStringList names = identifierNames();
+    QVector<qint64> samples;
+    QElapsedTimer timer;
+    int sink = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        timer.start();
+        for (int repeat = 0; repeat < 1000; ++repeat)
+        {
+            foreach (const QString &name, names)
+            {
+                QChar greek;
+                QString symbol;
+                if (reference ? referenceGreekLetter(name, greek) : MathGlyphs::getGreekLetter(name, greek))
+                    symbol = reference ? referenceLetterToMath(greek, true, true)
+                                       : MathGlyphs::letterToMath(greek, MathGlyphs::Greek, false, true);
+                else
+                {
+                    foreach (const QChar &c, name)
+                        symbol.append(reference ? referenceLetterToMath(c, false, true)
+                                                : MathGlyphs::letterToMath(c, MathGlyphs::Serif, false, true));
+                }
+                sink += symbol.length();
+            }
+        }
+        samples.append(timer.nsecsElapsed() / (1000 * names.size()));
+    }
+    if (sink == 0)
+        qWarning("Identifier conversion produced no output");
+    return summarize(samples).median;
+}
+
+struct Latency
+{
+    qint64 p50;
+    qint64 p99;
+};
+
+// Trivial expressions are submitted back to back, each one as soon as the previous result has
+// arrived; a sample is the time from Session::evaluate to the jobFinished signal. The memo is
+// turned off, so every sample goes through an evaluation thread.
+static Latency evaluationLatency(int count)
+{
+    Session session;
+    session.setMemoEnabled(false);
+    QVector<qint64> samples;
+    QElapsedTimer timer;
+    QEventLoop loop;
+    gen expression = gen("1+1", session.getContext());
+    QObject::connect(&session, &Session::jobFinished, [&](int jobId) {
+        samples.append(timer.nsecsElapsed());
+        Session::JobResult result;
+        session.takeResult(jobId, result);
+        timer.start();
+        if (samples.size() < count)
+            session.evaluate(expression);
+        else
+            loop.quit();
+    });
+    timer.start();
+    if (count > 0)
+    {
+        session.evaluate(expression);
+        loop.exec();
+    }
+    Latency latency;
+    latency.p50 = latency.p99 = 0;
+    if (!samples.isEmpty())
+    {
+        std::sort(samples.begin(), samples.end());
+        latency.p50 = samples.at(samples.size() / 2);
+        latency.p99 = samples.at(qMin(samples.size() - 1, samples.size() * 99 / 100));
+    }
+    return latency;
+}
+
+static QString microseconds(qint64 nsecs)
+{
+    return QString::number(double(nsecs) / 1000.0, 'f', 1);
+}
+
+static void loadFonts()
+{
+    QStringList fonts;
+    fonts << "FreeSerif.ttf" << "FreeSerifBold.ttf" << "FreeSerifBoldItalic.ttf" << "FreeSerifItalic.ttf";
+    foreach (const QString fontName, fonts)
+    {
+        QFile res(":/fonts/" + fontName);
+        if (!res.open(QIODevice::ReadOnly) || QFontDatabase::addApplicationFontFromData(res.readAll()) == -1)
+            qWarning("Failed to load font %s", qPrintable(fontName));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    QCoreApplication::setApplicationName("ample-benchmark");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Rendering benchmark for the QGen layout engine.");
+    parser.addHelpOption();
+    QCommandLineOption iterationsOption("iterations", "Number of timed renders per expression.", "count", "25");
+    QCommandLineOption jsonOption("json", "Write the results as JSON.");
+    QCommandLineOption outputOption("output", "Write the results to a file instead of stdout.", "file");
+    QCommandLineOption evaluationsOption("evaluations", "Number of trivial evaluations in the latency burst.", "count", "200");
+    QCommandLineOption thresholdOption("parallel-threshold", "Entry count above which layout runs in parallel.", "count", "256");
+    parser.addOption(iterationsOption);
+    parser.addOption(jsonOption);
+    parser.addOption(outputOption);
+    parser.addOption(thresholdOption);
+    parser.addOption(evaluationsOption);
+    parser.process(a);
+    int iterations = qMax(1, parser.value(iterationsOption).toInt());
+    int evaluations = qMax(1, parser.value(evaluationsOption).toInt());
+    int parallelThreshold = qMax(1, parser.value(thresholdOption).toInt());
+
+    loadFonts();
+    QGen::setRenderingFont("FreeSerif", 12);
+    context ct;
+
+    QGen::setParallelRenderingThreshold(parallelThreshold);
+    QVector<Measurement> measurements;
+    foreach (const CorpusEntry &entry, buildCorpus(&ct))
+        measurements.append(measure(entry, iterations));
+
+    // The same matrix is laid out serially and on the thread pool, both with a cold cache.
+    QGen matrix = parsed(symbolicMatrix(40), &ct);
+    QGen::setParallelRenderingThreshold(INT_MAX);
+    Timing serial = timeRendering(matrix, iterations, true);
+    QGen::setParallelRenderingThreshold(parallelThreshold);
+    Timing parallel = timeRendering(matrix, iterations, true);
+    double speedup = parallel.median > 0 ? double(serial.median) / double(parallel.median) : 0.0;
+
+    qint64 referenceIdentifierTime = timeIdentifierConversion(true, iterations);
+    qint64 identifierTime = timeIdentifierConversion(false, iterations);
+    Latency latency = evaluationLatency(evaluations);
+
+    QFile output;
+    if (parser.isSet(outputOption))
+    {
+        output.setFileName(parser.value(outputOption));
+        if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            qCritical("Cannot open %s for writing", qPrintable(output.fileName()));
+            return 1;
+        }
+    }
+    else
+        output.open(stdout, QIODevice::WriteOnly);
+    QTextStream out(&output);
+
+    if (parser.isSet(jsonOption))
+    {
+        QJsonObject root, parallelMatrix, identifiers, evaluation;
+        QJsonArray expressions;
+        root["qtVersion"] = QString(qVersion());
+        root["threads"] = QThreadPool::globalInstance()->maxThreadCount();
+        root["iterations"] = iterations;
+        foreach (const Measurement &m, measurements)
+            expressions.append(measurementToJson(m));
+        root["expressions"] = expressions;
+        parallelMatrix["entries"] = 40 * 40;
+        parallelMatrix["threshold"] = parallelThreshold;
+        parallelMatrix["serial"] = timingToJson(serial);
+        parallelMatrix["parallel"] = timingToJson(parallel);
+        parallelMatrix["speedup"] = speedup;
+        root["parallelMatrix"] = parallelMatrix;
+        identifiers["referenceNsPerName"] = double(referenceIdentifierTime);
+        identifiers["tableNsPerName"] = double(identifierTime);
+        root["identifierConversion"] = identifiers;
+        evaluation["count"] = evaluations;
+        evaluation["p50Ns"] = double(latency.p50);
+        evaluation["p99Ns"] = double(latency.p99);
+        root["evaluationLatency"] = evaluation;
+        out << QJsonDocument(root).toJson(QJsonDocument::Indented);
+        return 0;
+    }
+
+    out << "Qt " << qVersion() << ", " << QThreadPool::globalInstance()->maxThreadCount() << " threads, "
+        << iterations << " iterations, times are medians in microseconds\n\n";
+    out << QString("expression").leftJustified(18) << QString("cold").rightJustified(12)
+        << QString("warm").rightJustified(12) << QString("nodes").rightJustified(12)
+        << QString("copies").rightJustified(12) << QString("bytes").rightJustified(12)
+        << QString("ops").rightJustified(12) << "\n";
+    foreach (const Measurement &m, measurements)
+    {
+        out << m.name.leftJustified(18) << microseconds(m.cold.median).rightJustified(12)
+            << microseconds(m.warm.median).rightJustified(12) << QString::number(m.layoutNodes).rightJustified(12)
+            << QString::number(m.expressionCopies).rightJustified(12) << QString::number(m.pictureBytes).rightJustified(12)
+            << QString::number(m.operations.total()).rightJustified(12) << "\n";
+    }
+    out << "\n40x40 matrix: serial " << microseconds(serial.median) << ", parallel " << microseconds(parallel.median)
+        << " (threshold " << parallelThreshold << "), speedup " << QString::number(speedup, 'f', 2) << "x\n";
+    out << "identifier conversion: linear search " << referenceIdentifierTime << " ns, lookup tables "
+        << identifierTime << " ns per name\n";
+    out << "evaluation latency of " << evaluations << " trivial expressions: p50 " << microseconds(latency.p50)
+        << ", p99 " << microseconds(latency.p99) << " microseconds\n";
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QHash>
+#include <algorithm>
+#include "dependencygraph.h"
+#include "qgen.h"
+
+void DependencyGraph::addNames(const QGen &g, QSet<QString> &names)
+{
+    gen identifiers = _lname(g.expression(), g.contextPtr());
+    if (identifiers.type != _VECT)
+        return;
+    const_iterateur it;
+    for (it = identifiers._VECTptr->begin(); it != identifiers._VECTptr->end(); ++it)
+        names.insert(QString(it->print(g.contextPtr()).data()));
+}
+
+// The targets of assignments are assigned, everything else is read. An indexed assignment or an
+// increment modifies its target, so the target is read as well. Subexpressions which contain no
+// assignment are handed to _lname as a whole.
+void DependencyGraph::collectIdentifiers(const QGen &g, QSet<QString> &assigned, QSet<QString> &read)
+{
+    if (g.isAssignmentOperator() || g.isArrayAssignmentOperator())
+    {
+        QGen value = g.firstOperand(), target = g.secondOperand();
+        collectIdentifiers(value, assigned, read);
+        if (target.isAtOperator())
+        {
+            addNames(target.firstOperand(), assigned);
+            addNames(target.firstOperand(), read);
+            addNames(target.secondOperand(), read);
+        }
+        else
+            addNames(target, assigned);
+    }
+    else if (g.isIncrementOperator() || g.isDecrementOperator())
+    {
+        addNames(g.firstOperand(), assigned);
+        addNames(g.firstOperand(), read);
+        addNames(g.secondOperand(), read);
+    }
+    else if (!g.containsAssignment())
+        addNames(g, read);
+    else if (g.isVector())
+    {
+        vecteur &statements = *g.expression()._VECTptr;
+        for (iterateur it = statements.begin(); it != statements.end(); ++it)
+            collectIdentifiers(QGen(&(*it), g.contextPtr()), assigned, read);
+    }
+    else if (g.isSymbolic())
+        collectIdentifiers(g.unaryFunctionArgument(), assigned, read);
+}
+
+int DependencyGraph::addCell(const QGen &input)
+{
+    QSet<QString> assigned, read;
+    collectIdentifiers(input, assigned, read);
+    return addCell(assigned, read);
+}
+
+int DependencyGraph::addCell(const QSet<QString> &assigned, const QSet<QString> &read)
+{
+    Cell cell;
+    cell.assigned = assigned;
+    cell.read = read;
+    m_cells.append(cell);
+    return m_cells.size() - 1;
+}
+
+// One pass in document order, keeping the last assigning cell of every identifier.
+void DependencyGraph::build()
+{
+    QHash<QString, int> lastAssignment;
+    for (int i = 0; i < m_cells.size(); ++i)
+    {
+        Cell &cell = m_cells[i];
+        cell.dependencies.clear();
+        cell.dependents.clear();
+        QSet<int> dependencies;
+        foreach (const QString &name, cell.read)
+        {
+            QHash<QString, int>::const_iterator it = lastAssignment.constFind(name);
+            if (it != lastAssignment.constEnd())
+                dependencies.insert(it.value());
+        }
+        cell.dependencies = dependencies.toList().toVector();
+        std::sort(cell.dependencies.begin(), cell.dependencies.end());
+        foreach (int dependency, cell.dependencies)
+            m_cells[dependency].dependents.append(i);
+        foreach (const QString &name, cell.assigned)
+            lastAssignment.insert(name, i);
+    }
+}
+
+// Returns the modified cells and all cells depending on them, in topological order.
+QVector<int> DependencyGraph::staleCells(const QVector<bool> &modified) const
+{
+    Q_ASSERT(modified.size() == m_cells.size());
+    QVector<bool> stale(modified);
+    QVector<int> result;
+    for (int i = 0; i < m_cells.size(); ++i)
+    {
+        if (!stale.at(i))
+            continue;
+        result.append(i);
+        foreach (int dependent, m_cells.at(i).dependents)
+            stale[dependent] = true;
+    }
+    return result;
+}
+
+// Returns the given cells and the cells whose definitions reach them, directly or transitively,
+// in document order; evaluating them in a new context reproduces the state the cells see.
+QVector<int> DependencyGraph::requiredCells(const QVector<int> &cells) const
+{
+    QVector<bool> required(m_cells.size(), false);
+    foreach (int cell, cells)
+        required[cell] = true;
+    QVector<int> result;
+    for (int i = m_cells.size() - 1; i >= 0; --i)
+    {
+        if (!required.at(i))
+            continue;
+        foreach (int dependency, m_cells.at(i).dependencies)
+            required[dependency] = true;
+    }
+    for (int i = 0; i < m_cells.size(); ++i)
+    {
+        if (required.at(i))
+            result.append(i);
+    }
+    return result;
+}
+
+// Cells connected by dependencies in either direction form a component; components share no
+// identifiers and can be evaluated independently of each other.
+QVector<int> DependencyGraph::components(int &componentCount) const
+{
+    QVector<int> component(m_cells.size(), -1);
+    componentCount = 0;
+    for (int i = 0; i < m_cells.size(); ++i)
+    {
+        if (component.at(i) >= 0)
+            continue;
+        QVector<int> stack;
+        stack.append(i);
+        component[i] = componentCount;
+        while (!stack.isEmpty())
+        {
+            const Cell &cell = m_cells.at(stack.takeLast());
+            foreach (int next, cell.dependencies + cell.dependents)
+            {
+                if (component.at(next) < 0)
+                {
+                    component[next] = componentCount;
+                    stack.append(next);
+                }
+            }
+        }
+        ++componentCount;
+    }
+    return component;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEPENDENCYGRAPH_H
+#define DEPENDENCYGRAPH_H
+
+#include <QVector>
+#include <QSet>
+#include <QString>
+
+class QGen;
+
+// DependencyGraph relates the cells of a worksheet, added in document order, by the identifiers
+// they assign and read. A cell depends on the last cell before it which assigns an identifier it
+// reads; since dependencies only point backwards, document order is a topological order.
+class DependencyGraph
+{
+    struct Cell
+    {
+        QSet<QString> assigned;
+        QSet<QString> read;
+        QVector<int> dependencies;
+        QVector<int> dependents;
+    };
+
+    QVector<Cell> m_cells;
+
+    static void addNames(const QGen &g, QSet<QString> &names);
+    static void collectIdentifiers(const QGen &g, QSet<QString> &assigned, QSet<QString> &read);
+
+public:
+    void clear() { m_cells.clear(); }
+    int addCell(const QGen &input);
+    int addCell(const QSet<QString> &assigned, const QSet<QString> &read);
+    void build();
+
+    int count() const { return m_cells.size(); }
+    const QSet<QString> &assigned(int cell) const { return m_cells.at(cell).assigned; }
+    const QSet<QString> &read(int cell) const { return m_cells.at(cell).read; }
+    const QVector<int> &dependencies(int cell) const { return m_cells.at(cell).dependencies; }
+    const QVector<int> &dependents(int cell) const { return m_cells.at(cell).dependents; }
+
+    QVector<int> staleCells(const QVector<bool> &modified) const;
+    QVector<int> requiredCells(const QVector<int> &cells) const;
+    QVector<int> components(int &componentCount) const;
+};
+
+#endif // DEPENDENCYGRAPH_H
@@ -0,0 +1,175 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fontmetricstable.h"
+#include "mathglyphs.h"
+
+// Unicode blocks from which MathGlyphs draws its symbols. Advances of the code points in these
+// blocks are kept in flat arrays which are filled the first time a code point is measured.
+// Since the tables are shared by renderers running on worker threads, lazily filled data is
+// guarded by a mutex; ASCII advances are computed up front and read without locking.
+const FontMetricsTable::CodePointBlock FontMetricsTable::mathBlocks[] = {
+    { 0x00a0, 0x024f },     // Latin-1 Supplement, Latin Extended-A and -B
+    { 0x0300, 0x03ff },     // combining diacritical marks, Greek
+    { 0x2000, 0x214f },     // general punctuation, super- and subscripts, letterlike symbols
+    { 0x2190, 0x23ff },     // arrows, mathematical operators, miscellaneous technical
+    { 0x25a0, 0x25ff },     // geometric shapes
+    { 0x27c0, 0x27ff },     // miscellaneous mathematical symbols A
+    { 0x2980, 0x2aff },     // miscellaneous mathematical symbols B, supplemental operators
+    { 0x1d400, 0x1d7ff }    // mathematical alphanumeric symbols
+};
+
+const int FontMetricsTable::mathBlockCount = sizeof(mathBlocks) / sizeof(CodePointBlock);
+
+// Only short strings (identifiers, numbers, operator symbols) are kept as shaped glyph runs.
+const int FontMetricsTable::maximumGlyphRunLength = 32;
+const int FontMetricsTable::maximumGlyphRunCount = 8192;
+
+FontMetricsTable::FontMetricsTable(const QFont &font)
+    : m_font(font)
+    , m_fontMetrics(font)
+    , m_rawFontLoaded(false)
+{
+    m_ascent = m_fontMetrics.ascent();
+    m_descent = m_fontMetrics.descent();
+    m_height = m_fontMetrics.height();
+    m_leading = m_fontMetrics.leading();
+    m_xHeight = m_fontMetrics.xHeight();
+    m_midLine = (m_xHeight / 2 + m_fontMetrics.strikeOutPos()) / 2;
+    m_lineWidth = m_fontMetrics.tightBoundingRect(MathGlyphs::horizontalLineExtension()).height();
+    m_linePadding = m_fontMetrics.width(MathGlyphs::thinSpace());
+    for (uint c = 0; c < 128; ++c)
+        m_asciiAdvances[c] = m_fontMetrics.width(QChar(c));
+    m_blockAdvances.resize(mathBlockCount);
+    for (int i = 0; i < mathBlockCount; ++i)
+        m_blockAdvances[i].fill(-1.0, int(mathBlocks[i].last - mathBlocks[i].first + 1));
+}
+
+qreal FontMetricsTable::measureAdvance(uint ucs4) const
+{
+    if (QChar::requiresSurrogates(ucs4))
+        return m_fontMetrics.width(MathGlyphs::encodeUcs4(ucs4));
+    return m_fontMetrics.width(QChar(ucs4));
+}
+
+qreal FontMetricsTable::advance(uint ucs4)
+{
+    if (ucs4 < 128)
+        return m_asciiAdvances[ucs4];
+    QMutexLocker locker(&m_mutex);
+    for (int i = 0; i < mathBlockCount; ++i)
+    {
+        if (ucs4 < mathBlocks[i].first)
+            break;
+        if (ucs4 <= mathBlocks[i].last)
+        {
+            qreal &value = m_blockAdvances[i][int(ucs4 - mathBlocks[i].first)];
+            if (value < 0)
+                value = measureAdvance(ucs4);
+            return value;
+        }
+    }
+    QHash<uint, qreal>::const_iterator it = m_otherAdvances.constFind(ucs4);
+    if (it != m_otherAdvances.constEnd())
+        return *it;
+    qreal value = measureAdvance(ucs4);
+    m_otherAdvances.insert(ucs4, value);
+    return value;
+}
+
+qreal FontMetricsTable::width(const QString &text)
+{
+    qreal w = 0.0;
+    int n = text.length();
+    for (int i = 0; i < n; ++i)
+    {
+        uint ucs4 = text.at(i).unicode();
+        if (text.at(i).isHighSurrogate() && i + 1 < n && text.at(i + 1).isLowSurrogate())
+            ucs4 = QChar::surrogateToUcs4(text.at(i), text.at(++i));
+        w += advance(ucs4);
+    }
+    return w;
+}
+
+QRectF FontMetricsTable::tightBoundingRect(const QString &text)
+{
+    QMutexLocker locker(&m_mutex);
+    QHash<QString, QRectF>::const_iterator it = m_tightBoundingRects.constFind(text);
+    if (it != m_tightBoundingRects.constEnd())
+        return *it;
+    QRectF rect = m_fontMetrics.tightBoundingRect(text);
+    m_tightBoundingRects.insert(text, rect);
+    return rect;
+}
+
+// Glyphs are placed with the advances used for layout, so that a painted run matches the
+// measured width. An empty run is returned when the font lacks a glyph, in which case the
+// text must be drawn with font fallback.
+QGlyphRun FontMetricsTable::shape(const QString &text)
+{
+    QRawFont rawFont;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_rawFontLoaded)
+        {
+            m_rawFont = QRawFont::fromFont(m_font);
+            m_rawFontLoaded = true;
+        }
+        rawFont = m_rawFont;
+    }
+    if (!rawFont.isValid())
+        return QGlyphRun();
+    QVector<quint32> glyphIndexes = rawFont.glyphIndexesForString(text);
+    if (glyphIndexes.isEmpty() || glyphIndexes.contains(0))
+        return QGlyphRun();
+    QVector<QPointF> positions;
+    positions.reserve(glyphIndexes.size());
+    qreal x = 0.0;
+    int n = text.length();
+    for (int i = 0; i < n; ++i)
+    {
+        uint ucs4 = text.at(i).unicode();
+        if (text.at(i).isHighSurrogate() && i + 1 < n && text.at(i + 1).isLowSurrogate())
+            ucs4 = QChar::surrogateToUcs4(text.at(i), text.at(++i));
+        positions.append(QPointF(x, 0.0));
+        x += advance(ucs4);
+    }
+    if (positions.size() != glyphIndexes.size())
+        return QGlyphRun();
+    QGlyphRun run;
+    run.setRawFont(rawFont);
+    run.setGlyphIndexes(glyphIndexes);
+    run.setPositions(positions);
+    return run;
+}
+
+QGlyphRun FontMetricsTable::glyphRun(const QString &text)
+{
+    if (text.isEmpty() || text.length() > maximumGlyphRunLength)
+        return QGlyphRun();
+    {
+        QMutexLocker locker(&m_mutex);
+        QHash<QString, QGlyphRun>::const_iterator it = m_glyphRuns.constFind(text);
+        if (it != m_glyphRuns.constEnd())
+            return *it;
+    }
+    QGlyphRun run = shape(text);
+    QMutexLocker locker(&m_mutex);
+    if (m_glyphRuns.size() < maximumGlyphRunCount)
+        m_glyphRuns.insert(text, run);
+    return run;
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FONTMETRICSTABLE_H
+#define FONTMETRICSTABLE_H
+
+#include <QFont>
+#include <QFontMetricsF>
+#include <QRawFont>
+#include <QGlyphRun>
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QRectF>
+#include <QMutex>
+#include <QSharedPointer>
+
+// Tables are owned by shared pointers, so that displays can keep the table of their text items.
+class FontMetricsTable : public QEnableSharedFromThis<FontMetricsTable>
+{
+    struct CodePointBlock
+    {
+        uint first;
+        uint last;
+    };
+
+    static const CodePointBlock mathBlocks[];
+    static const int mathBlockCount;
+
+    QFont m_font;
+    QFontMetricsF m_fontMetrics;
+    qreal m_ascent;
+    qreal m_descent;
+    qreal m_height;
+    qreal m_leading;
+    qreal m_xHeight;
+    qreal m_midLine;
+    qreal m_lineWidth;
+    qreal m_linePadding;
+    qreal m_asciiAdvances[128];
+    QVector<QVector<qreal> > m_blockAdvances;
+    QHash<uint, qreal> m_otherAdvances;
+    QHash<QString, QRectF> m_tightBoundingRects;
+    QRawFont m_rawFont;
+    bool m_rawFontLoaded;
+    QHash<QString, QGlyphRun> m_glyphRuns;
+    QMutex m_mutex;
+
+    static const int maximumGlyphRunLength;
+    static const int maximumGlyphRunCount;
+
+    qreal measureAdvance(uint ucs4) const;
+    QGlyphRun shape(const QString &text);
+
+public:
+    FontMetricsTable(const QFont &font);
+
+    const QFont &font() const { return m_font; }
+    qreal ascent() const { return m_ascent; }
+    qreal descent() const { return m_descent; }
+    qreal height() const { return m_height; }
+    qreal leading() const { return m_leading; }
+    qreal xHeight() const { return m_xHeight; }
+    qreal midLine() const { return m_midLine; }
+    qreal lineWidth() const { return m_lineWidth; }
+    qreal linePadding() const { return m_linePadding; }
+
+    qreal advance(uint ucs4);
+    qreal width(const QString &text);
+    QRectF tightBoundingRect(const QString &text);
+    QGlyphRun glyphRun(const QString &text);
+};
+
+#endif // FONTMETRICSTABLE_H
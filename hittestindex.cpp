@@ -0,0 +1,136 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <qmath.h>
+#include "hittestindex.h"
+
+// Orders the ids so that consecutive runs of nodeCapacity items form compact tiles: the items are
+// sorted into vertical slices by the x coordinate of their centers and each slice by y.
+void HitTestIndex::sortTileRecursive(QVector<int> &ids, const QVector<QRectF> &rects)
+{
+    int leafCount = (ids.size() + nodeCapacity - 1) / nodeCapacity;
+    int sliceSize = qCeil(qSqrt(leafCount)) * nodeCapacity;
+    std::sort(ids.begin(), ids.end(), [&rects](int a, int b) {
+        return rects.at(a).center().x() < rects.at(b).center().x();
+    });
+    for (int i = 0; i < ids.size(); i += sliceSize)
+    {
+        std::sort(ids.begin() + i, ids.begin() + qMin(i + sliceSize, ids.size()), [&rects](int a, int b) {
+            return rects.at(a).center().y() < rects.at(b).center().y();
+        });
+    }
+}
+
+QVector<HitTestIndex::Node> HitTestIndex::pack(const QVector<int> &ids, const QVector<QRectF> &rects)
+{
+    QVector<Node> nodes;
+    nodes.reserve((ids.size() + nodeCapacity - 1) / nodeCapacity);
+    for (int i = 0; i < ids.size(); i += nodeCapacity)
+    {
+        Node node;
+        node.first = i;
+        node.count = qMin(nodeCapacity, ids.size() - i);
+        node.rect = rects.at(ids.at(i));
+        for (int j = 1; j < node.count; ++j)
+            node.rect |= rects.at(ids.at(i + j));
+        nodes.append(node);
+    }
+    return nodes;
+}
+
+void HitTestIndex::build(const QVector<QRectF> &rects)
+{
+    clear();
+    m_rects = rects;
+    if (rects.isEmpty())
+        return;
+    m_items.resize(rects.size());
+    for (int i = 0; i < rects.size(); ++i)
+        m_items[i] = i;
+    sortTileRecursive(m_items, m_rects);
+    m_levels.append(pack(m_items, m_rects));
+    // Each level is reordered by its own tiling before the parent level is packed on top of it;
+    // the nodes keep referring to their children, so only the parent ranges depend on the order.
+    while (m_levels.last().size() > 1)
+    {
+        QVector<Node> &level = m_levels.last();
+        QVector<QRectF> nodeRects(level.size());
+        QVector<int> ids(level.size());
+        for (int i = 0; i < level.size(); ++i)
+        {
+            nodeRects[i] = level.at(i).rect;
+            ids[i] = i;
+        }
+        sortTileRecursive(ids, nodeRects);
+        QVector<Node> sorted(level.size());
+        for (int i = 0; i < ids.size(); ++i)
+        {
+            sorted[i] = level.at(ids.at(i));
+            nodeRects[i] = sorted.at(i).rect;
+            ids[i] = i;
+        }
+        level = sorted;
+        m_levels.append(pack(ids, nodeRects));
+    }
+}
+
+void HitTestIndex::clear()
+{
+    m_rects.clear();
+    m_items.clear();
+    m_levels.clear();
+}
+
+template <typename Predicate>
+void HitTestIndex::query(int level, int first, int count, const Predicate &hit, QVector<int> &result) const
+{
+    const QVector<Node> &nodes = m_levels.at(level);
+    for (int i = first; i < first + count; ++i)
+    {
+        const Node &node = nodes.at(i);
+        if (!hit(node.rect))
+            continue;
+        if (level > 0)
+            query(level - 1, node.first, node.count, hit, result);
+        else
+        {
+            for (int j = node.first; j < node.first + node.count; ++j)
+            {
+                int id = m_items.at(j);
+                if (hit(m_rects.at(id)))
+                    result.append(id);
+            }
+        }
+    }
+}
+
+QVector<int> HitTestIndex::itemsAt(const QPointF &point) const
+{
+    QVector<int> result;
+    if (!m_levels.isEmpty())
+        query(m_levels.size() - 1, 0, m_levels.last().size(), [&point](const QRectF &r) { return r.contains(point); }, result);
+    return result;
+}
+
+QVector<int> HitTestIndex::itemsIntersecting(const QRectF &rect) const
+{
+    QVector<int> result;
+    if (!m_levels.isEmpty())
+        query(m_levels.size() - 1, 0, m_levels.last().size(), [&rect](const QRectF &r) { return r.intersects(rect); }, result);
+    return result;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HITTESTINDEX_H
+#define HITTESTINDEX_H
+
+#include <QRectF>
+#include <QPointF>
+#include <QVector>
+
+// HitTestIndex is a static R-tree over a set of rectangles, bulk loaded with the sort-tile-recursive
+// method. Items are identified by their position in the vector passed to build. Point and rectangle
+// queries visit O(log n) nodes plus the reported items.
+class HitTestIndex
+{
+    struct Node
+    {
+        QRectF rect;
+        int first;
+        int count;
+    };
+
+    static const int nodeCapacity = 16;
+
+    QVector<QRectF> m_rects;
+    QVector<int> m_items;
+    QVector<QVector<Node> > m_levels;
+
+    static void sortTileRecursive(QVector<int> &ids, const QVector<QRectF> &rects);
+    static QVector<Node> pack(const QVector<int> &ids, const QVector<QRectF> &rects);
+    template <typename Predicate>
+    void query(int level, int first, int count, const Predicate &hit, QVector<int> &result) const;
+
+public:
+    HitTestIndex() { }
+
+    void build(const QVector<QRectF> &rects);
+    void clear();
+    bool isEmpty() const { return m_rects.isEmpty(); }
+    int count() const { return m_rects.size(); }
+    QRectF rect(int id) const { return m_rects.at(id); }
+    QRectF boundingRect() const { return m_levels.isEmpty() ? QRectF() : m_levels.last().first().rect; }
+
+    QVector<int> itemsAt(const QPointF &point) const;
+    QVector<int> itemsIntersecting(const QRectF &rect) const;
+};
+
+#endif // HITTESTINDEX_H
@@ -22,6 +22,7 @@
 #include <QString>
 #include <QStringList>
 #include <QMessageBox>
+#include <QStatusBar>
 #include <qmath.h>
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
@@ -88,10 +89,17 @@ MainWindow::MainWindow(QWidget *parent) :
     commandIndexDialog->raise();
     commandIndexDialog->activateWindow();
 
-    session = new Session(this);
+    // every worksheet gets its own context from the pool, the input line above evaluates in the one of the window
+    sessionPool = new SessionPool(this);
+    busyContextsLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(busyContextsLabel);
+    connect(sessionPool, SIGNAL(busyChanged(QObject*,bool)), this, SLOT(sessionBusyChanged(QObject*,bool)));
+    connect(sessionPool, SIGNAL(busyCountChanged(int,int)), this, SLOT(busyContextCountChanged(int,int)));
+    session = sessionPool->session(this);
+    interactiveJobId = 0;
+    ui->stopButton->setEnabled(false);
     connect(session, SIGNAL(processingStarted()), this, SLOT(giacProcessingStarted()));
-    connect(session, SIGNAL(processingFinished(const gen &,const QStringList &)),
-            this, SLOT(giacProcessingFinished(const gen &,const QStringList &)));
+    connect(session, SIGNAL(jobFinished(int)), this, SLOT(giacJobFinished(int)));
     ui->messagesTextBrowser->setFont(QFont("FreeSerif", 12));
     ui->messagesTextBrowser->setText(QString("<html><style>radicand{text-decoration:overline;}</style>") +
                                      "<body>Επιστρέφει το μιγαδικό αριθμό ίσο με ∣<i>AC</i>∣&sdot;∣<i>BD</i>∣&sdot;∣<i>AD</i>∣<sup>&minus;1</sup>∣<i>BC</i>∣<sup>&minus;1</sup>.</body></html>");
@@ -168,14 +176,66 @@ QString giacToStr(const gen &g)
     return ss.str().data();
 }
 
-void MainWindow::giacProcessingFinished(const gen &g, const QStringList &messages)
+// Documents which are evaluating are shown in italics in the list of active documents. The cells
+// of a worksheet may be evaluated in several contexts, owned by the worksheet's cell groups.
+void MainWindow::sessionBusyChanged(QObject *owner, bool busy)
 {
-    ui->outputLineEdit->setText(giacToStr(g));
-    ui->messagesTextBrowser->setText(messages.join('\n'));
+    foreach (QAction *action, activeDocumentsGroup->actions())
+    {
+        TextEditor *editor = qobject_cast<TextEditor*>(action->parent());
+        if (editor == nullptr || (editor->worksheet() != owner && owner->parent() != editor->worksheet()))
+            continue;
+        bool worksheetBusy = sessionPool->isBusy(editor->worksheet());
+        foreach (QObject *group, editor->worksheet()->children())
+            worksheetBusy = worksheetBusy || sessionPool->isBusy(group);
+        QFont font = action->font();
+        font.setItalic(worksheetBusy);
+        action->setFont(font);
+    }
+    if (owner == this)
+        ui->stopButton->setEnabled(busy);
+}
+
+void MainWindow::busyContextCountChanged(int busyCount, int sessionCount)
+{
+    busyContextsLabel->setText(tr("%1 of %2 contexts busy, at most %3 at a time")
+                               .arg(busyCount).arg(sessionCount).arg(sessionPool->maximumConcurrency()));
+}
+
+void MainWindow::giacJobFinished(int jobId)
+{
+    Session::JobResult result;
+    if (jobId != interactiveJobId || !session->takeResult(jobId, result))
+        return;
+    ui->outputLineEdit->setText(giacToStr(result.result));
+    ui->messagesTextBrowser->setText(result.messages.join('\n'));
 }
 
+// A new command replaces the one still waiting in the queue, if any.
 void MainWindow::on_evaluateButton_clicked()
 {
     QString command = ui->inputLineEdit->text();
-    session->evaluate(strToGiac(command));
+    if (session->isPending(interactiveJobId))
+        session->cancel(interactiveJobId);
+    interactiveJobId = session->submit(strToGiac(command), Session::InteractivePriority);
+}
+
+void MainWindow::on_actionRecompute_triggered()
+{
+    QAction *action = activeDocumentsGroup->checkedAction();
+    TextEditor *editor = action != nullptr ? qobject_cast<TextEditor*>(action->parent()) : nullptr;
+    if (editor == nullptr)
+        return;
+    if (editor->worksheet()->sessionPool() == nullptr)
+    {
+        editor->worksheet()->setSessionPool(sessionPool);
+        connect(editor->worksheet(), SIGNAL(recomputeFinished(int,int)), this, SLOT(worksheetRecomputed(int,int)));
+    }
+    editor->worksheet()->recompute();
+}
+
+void MainWindow::worksheetRecomputed(int evaluatedCount, int memoizedCount)
+{
+    statusBar()->showMessage(tr("Recomputed %1 cells, %2 evaluated and %3 taken from the memo")
+                             .arg(evaluatedCount + memoizedCount).arg(evaluatedCount).arg(memoizedCount), 5000);
 }
@@ -24,9 +24,11 @@
 #include <QFontComboBox>
 #include <QSpinBox>
 #include <QGridLayout>
+#include <QLabel>
 #include "texteditor.h"
 #include "mathdisplaywidget.h"
 #include "session.h"
+#include "sessionpool.h"
 #include "commandindex.h"
 #include "commandindexdialog.h"
 #include <sstream>
@@ -45,7 +47,10 @@ public:
     ~MainWindow();
 
 private:
+    SessionPool *sessionPool;
     Session *session;
+    QLabel *busyContextsLabel;
+    int interactiveJobId;
     Ui::MainWindow *ui;
     QFontComboBox *fontFamilyChooser;
     QSpinBox *fontSizeChooser;
@@ -63,11 +68,15 @@ private:
 
 private slots:
     void giacProcessingStarted();
-    void giacProcessingFinished(const gen &g, const QStringList &messages);
+    void giacJobFinished(int jobId);
+    void sessionBusyChanged(QObject *owner, bool busy);
+    void busyContextCountChanged(int busyCount, int sessionCount);
     void textAlignChanged(QAction* action);
     void clipboardDataChanged();
     void copyAvailableChanged(bool yes);
     void on_evaluateButton_clicked();
+    void on_actionRecompute_triggered();
+    void worksheetRecomputed(int evaluatedCount, int memoizedCount);
 };
 
 #endif // MAINWINDOW_H
@@ -17,15 +17,170 @@
 
 #include "mathglyphs.h"
 
-QStringList MathGlyphs::smallGreekLetterNames = QStringList()
-        << "alpha" << "beta" << "gamma" << "delta" << "epsilon" << "zeta" << "eta" << "theta"
-        << "iota" << "kappa" << "lambda" << "mu" << "nu" << "xi" << "omicron" << "pi" << "rho"
-        << "sigma" << "tau" << "upsilon" << "phi" << "chi" << "psi" << "omega";
+// Greek letter names are found with a perfect hash of the length and the first, second and
+// last characters; the table below places every name in the slot given by its hash, which
+// is verified at compile time.
+struct GreekLetterName
+{
+    const char *name;
+    ushort code;
+};
+
+static const int greekLetterTableSize = 128;
+
+static constexpr GreekLetterName greekLetterNames[greekLetterTableSize] = {
+    { "", 0 }, { "Gamma", 0x0393 }, { "", 0 }, { "", 0 },
+    { "Phi", 0x03a6 }, { "Kappa", 0x039a }, { "", 0 }, { "Lambda", 0x039b },
+    { "psi", 0x03c8 }, { "", 0 }, { "iota", 0x03b9 }, { "", 0 },
+    { "", 0 }, { "sigma", 0x03c3 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "chi", 0x03c7 },
+    { "", 0 }, { "Omega", 0x03a9 }, { "", 0 }, { "", 0 },
+    { "rho", 0x03c1 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "gamma", 0x03b3 }, { "", 0 }, { "", 0 },
+    { "phi", 0x03c6 }, { "kappa", 0x03ba }, { "", 0 }, { "lambda", 0x03bb },
+    { "Mu", 0x039c }, { "Nu", 0x039d }, { "Epsilon", 0x0395 }, { "Beta", 0x0392 },
+    { "", 0 }, { "", 0 }, { "Delta", 0x0394 }, { "Pi", 0x03a0 },
+    { "Omicron", 0x039f }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "Xi", 0x039e },
+    { "", 0 }, { "omega", 0x03c9 }, { "Upsilon", 0x03a5 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "Tau", 0x03a4 }, { "Eta", 0x0397 }, { "Theta", 0x0398 }, { "Zeta", 0x0396 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "mu", 0x03bc }, { "nu", 0x03bd }, { "epsilon", 0x03b5 }, { "beta", 0x03b2 },
+    { "", 0 }, { "", 0 }, { "delta", 0x03b4 }, { "pi", 0x03c0 },
+    { "omicron", 0x03bf }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "xi", 0x03be },
+    { "", 0 }, { "", 0 }, { "upsilon", 0x03c5 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "Alpha", 0x0391 },
+    { "tau", 0x03c4 }, { "eta", 0x03b7 }, { "theta", 0x03b8 }, { "zeta", 0x03b6 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "Psi", 0x03a8 }, { "", 0 }, { "Iota", 0x0399 }, { "", 0 },
+    { "", 0 }, { "Sigma", 0x03a3 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "Chi", 0x03a7 },
+    { "", 0 }, { "", 0 }, { "", 0 }, { "", 0 },
+    { "Rho", 0x03a1 }, { "", 0 }, { "", 0 }, { "alpha", 0x03b1 }
+};
+
+static constexpr int nameLength(const char *name, int n = 0)
+{
+    return name[n] == 0 ? n : nameLength(name, n + 1);
+}
+
+static constexpr uint greekNameHash(int length, uint first, uint second, uint last)
+{
+    return (uint(length) + first + 44 * second + 41 * last) % greekLetterTableSize;
+}
+
+static constexpr uint greekNameHash(const char *name)
+{
+    return greekNameHash(nameLength(name), uchar(name[0]), uchar(name[1]), uchar(name[nameLength(name) - 1]));
+}
+
+static constexpr int greekLetterCount(int slot = 0)
+{
+    return slot == greekLetterTableSize ? 0 :
+           (greekLetterNames[slot].code != 0 ? 1 : 0) + greekLetterCount(slot + 1);
+}
+
+static constexpr bool greekLettersArePlaced(int slot = 0)
+{
+    return slot == greekLetterTableSize ||
+            ((greekLetterNames[slot].code == 0 || greekNameHash(greekLetterNames[slot].name) == uint(slot)) &&
+             greekLettersArePlaced(slot + 1));
+}
+
+static_assert(greekLetterCount() == 48, "every Greek letter name must be in the table");
+static_assert(greekLettersArePlaced(), "every Greek letter name must be in the slot of its hash");
+
+// Code points of the styled letters, indexed by letter type, style (2 for bold plus 1 for
+// italic), case and the index of the letter in its alphabet. Letters which have no styled
+// form in the mathematical alphanumeric block are mapped to their letterlike symbols.
+static constexpr uint plainLetter(int type, bool capital, int index)
+{
+    return uint(type == MathGlyphs::Greek ? (capital ? 913 : 945) + index : (capital ? 'A' : 'a') + index);
+}
+
+static constexpr uint scriptException(uint c)
+{
+    return c == 'B' ? 8492 : c == 'E' ? 8496 : c == 'F' ? 8497 : c == 'H' ? 8459 : c == 'I' ? 8464 :
+           c == 'L' ? 8466 : c == 'M' ? 8499 : c == 'R' ? 8475 : c == 'e' ? 8495 : c == 'g' ? 8458 :
+           c == 'o' ? 8500 : 0;
+}
+
+static constexpr uint frakturException(uint c)
+{
+    return c == 'C' ? 8493 : c == 'H' ? 8460 : c == 'I' ? 8465 : c == 'R' ? 8476 : c == 'Z' ? 8488 : 0;
+}
+
+static constexpr uint doubleStruckException(uint c)
+{
+    return c == 'C' ? 8450 : c == 'H' ? 8461 : c == 'N' ? 8469 : c == 'P' ? 8473 : c == 'Q' ? 8474 :
+           c == 'R' ? 8477 : c == 'Z' ? 8484 : 0;
+}
+
+static constexpr uint exceptionOr(uint exception, uint code)
+{
+    return exception != 0 ? exception : code;
+}
+
+static constexpr uint styledLetter(uint capitalBase, uint smallBase, bool capital, int index)
+{
+    return (capital ? capitalBase : smallBase) + uint(index);
+}
+
+static constexpr uint mathLetter(int type, int style, bool capital, int index)
+{
+    return type == MathGlyphs::Serif ?
+                (style == 3 ? styledLetter(119912, 119938, capital, index) :
+                 style == 2 ? styledLetter(119808, 119834, capital, index) :
+                 style == 1 ? (!capital && index == 'h' - 'a' ? 8462 : styledLetter(119860, 119886, capital, index)) :
+                 plainLetter(type, capital, index)) :
+           type == MathGlyphs::Sans ?
+                (style == 3 ? styledLetter(120380, 120406, capital, index) :
+                 style == 2 ? styledLetter(120276, 120302, capital, index) :
+                 style == 1 ? styledLetter(120328, 120354, capital, index) :
+                 styledLetter(120224, 120250, capital, index)) :
+           type == MathGlyphs::Mono ? styledLetter(120432, 120458, capital, index) :
+           type == MathGlyphs::Script ?
+                ((style & 2) != 0 ? styledLetter(120016, 120042, capital, index) :
+                 exceptionOr(scriptException(plainLetter(type, capital, index)), styledLetter(119964, 119990, capital, index))) :
+           type == MathGlyphs::Fraktur ?
+                ((style & 2) != 0 ? styledLetter(120172, 120198, capital, index) :
+                 exceptionOr(frakturException(plainLetter(type, capital, index)), styledLetter(120068, 120094, capital, index))) :
+           type == MathGlyphs::DoubleStruck ?
+                exceptionOr(doubleStruckException(plainLetter(type, capital, index)), styledLetter(120120, 120146, capital, index)) :
+                (style == 3 ? styledLetter(120604, 120630, capital, index) :
+                 style == 2 ? styledLetter(120488, 120514, capital, index) :
+                 style == 1 ? styledLetter(120546, 120572, capital, index) :
+                 plainLetter(type, capital, index));
+}
+
+#define MATH_LETTER_ROW(t, s, c) { \
+    mathLetter(t, s, c, 0), mathLetter(t, s, c, 1), mathLetter(t, s, c, 2), mathLetter(t, s, c, 3), \
+    mathLetter(t, s, c, 4), mathLetter(t, s, c, 5), mathLetter(t, s, c, 6), mathLetter(t, s, c, 7), \
+    mathLetter(t, s, c, 8), mathLetter(t, s, c, 9), mathLetter(t, s, c, 10), mathLetter(t, s, c, 11), \
+    mathLetter(t, s, c, 12), mathLetter(t, s, c, 13), mathLetter(t, s, c, 14), mathLetter(t, s, c, 15), \
+    mathLetter(t, s, c, 16), mathLetter(t, s, c, 17), mathLetter(t, s, c, 18), mathLetter(t, s, c, 19), \
+    mathLetter(t, s, c, 20), mathLetter(t, s, c, 21), mathLetter(t, s, c, 22), mathLetter(t, s, c, 23), \
+    mathLetter(t, s, c, 24), mathLetter(t, s, c, 25) }
+#define MATH_LETTER_CASES(t, s) { MATH_LETTER_ROW(t, s, false), MATH_LETTER_ROW(t, s, true) }
+#define MATH_LETTER_STYLES(t) { MATH_LETTER_CASES(t, 0), MATH_LETTER_CASES(t, 1), MATH_LETTER_CASES(t, 2), MATH_LETTER_CASES(t, 3) }
+
+static constexpr uint mathLetters[7][4][2][26] = {
+    MATH_LETTER_STYLES(MathGlyphs::Serif),
+    MATH_LETTER_STYLES(MathGlyphs::Sans),
+    MATH_LETTER_STYLES(MathGlyphs::Mono),
+    MATH_LETTER_STYLES(MathGlyphs::Script),
+    MATH_LETTER_STYLES(MathGlyphs::Fraktur),
+    MATH_LETTER_STYLES(MathGlyphs::DoubleStruck),
+    MATH_LETTER_STYLES(MathGlyphs::Greek)
+};
 
-QStringList MathGlyphs::capitalGreekLetterNames = QStringList()
-        << "Alpha" << "Beta" << "Gamma" << "Delta" << "Epsilon" << "Zeta" << "Eta" << "Theta"
-        << "Iota" << "Kappa" << "Lambda" << "Mu" << "Nu" << "Xi" << "Omicron" << "Pi" << "Rho"
-        << "Sigma" << "Tau" << "Upsilon" << "Phi" << "Chi" << "Psi" << "Omega";
+#undef MATH_LETTER_STYLES
+#undef MATH_LETTER_CASES
+#undef MATH_LETTER_ROW
 
 QString MathGlyphs::encodeUcs4(uint ucs4)
 {
@@ -41,171 +196,24 @@ QString MathGlyphs::encodeUcs4(uint ucs4)
 
 bool MathGlyphs::getGreekLetter(const QString &name, QChar &letter)
 {
-    for (ushort i = 0; i < 24; ++i)
-    {
-        if (name == smallGreekLetterNames.at(i))
-        {
-            if (i > 16)
-                ++i;
-            letter = QChar(i + 945);
-            return true;
-        }
-        if (name == capitalGreekLetterNames.at(i))
-        {
-            if (i > 16)
-                ++i;
-            letter = QChar(i + 913);
-            return true;
-        }
-    }
-    return false;
+    int length = name.length();
+    if (length < 2 || length > 7)
+        return false;
+    const GreekLetterName &entry = greekLetterNames[greekNameHash(length, name.at(0).unicode(), name.at(1).unicode(),
+                                                                  name.at(length - 1).unicode())];
+    if (entry.code == 0 || name != QLatin1String(entry.name))
+        return false;
+    letter = QChar(entry.code);
+    return true;
 }
 
 QString MathGlyphs::letterToMath(QChar letter, LetterType letterType, bool bold, bool italic)
 {
-    uint code, letterCode = letter.unicode();
     bool isCapital = letter.isUpper();
-    if (letterType == Greek)
-        letterCode -= isCapital ? 913 : 945;
-    else
-        letterCode -= isCapital ? 65 : 97;
-    code = letterCode;
-    switch (letterType)
-    {
-    case Serif:
-        if (bold && italic)
-            code += isCapital ? 119912 : 119938;
-        else if (bold)
-            code += isCapital ? 119808 : 119834;
-        else if (italic)
-        {
-            if (letter == 'h')
-                code = 8462;
-            else
-                code += isCapital ? 119860 : 119886;
-        }
-        else
-            return letter;
-        break;
-    case Sans:
-        if (bold && italic)
-            code += isCapital ? 120380 : 120406;
-        if (bold)
-            code += isCapital ? 120276 : 120302;
-        if (italic)
-            code += isCapital ? 120328 : 120354;
-        else
-            code += isCapital ? 120224 : 120250;
-        break;
-    case Mono:
-        code += isCapital ? 120432 : 120458;
-        break;
-    case Script:
-        if (bold)
-            code += isCapital ? 120016 : 120042;
-        else switch (letter.unicode())
-        {
-        case 'B':
-            code = 8492;
-            break;
-        case 'E':
-            code = 8496;
-            break;
-        case 'F':
-            code = 8497;
-            break;
-        case 'H':
-            code = 8459;
-            break;
-        case 'I':
-            code = 8464;
-            break;
-        case 'L':
-            code = 8466;
-            break;
-        case 'M':
-            code = 8499;
-            break;
-        case 'R':
-            code = 8475;
-            break;
-        case 'e':
-            code = 8495;
-            break;
-        case 'g':
-            code = 8458;
-            break;
-        case 'o':
-            code = 8500;
-            break;
-        default:
-            code += isCapital ? 119964 : 119990;
-        }
-        break;
-    case Fraktur:
-        if (bold)
-            code += isCapital ? 120172 : 120198;
-        else switch (letter.unicode())
-        {
-        case 'C':
-            code = 8493;
-            break;
-        case 'H':
-            code = 8460;
-            break;
-        case 'I':
-            code = 8465;
-            break;
-        case 'R':
-            code = 8476;
-            break;
-        case 'Z':
-            code = 8488;
-            break;
-        default:
-            code += isCapital ? 120068 : 120094;
-        }
-        break;
-    case DoubleStruck:
-        switch (letter.unicode())
-        {
-        case 'C':
-            code = 8450;
-            break;
-        case 'H':
-            code = 8461;
-            break;
-        case 'N':
-            code = 8469;
-            break;
-        case 'P':
-            code = 8473;
-            break;
-        case 'Q':
-            code = 8474;
-            break;
-        case 'R':
-            code = 8477;
-            break;
-        case 'Z':
-            code = 8484;
-            break;
-        default:
-            code += isCapital ? 120120 : 120146;
-        }
-        break;
-    case Greek:
-        if (bold && italic)
-            code += isCapital ? 120604 : 120630;
-        if (bold)
-            code += isCapital ? 120488 : 120514;
-        if (italic)
-            code += isCapital ? 120546 : 120572;
-        else
-            return letter;
-        break;
-    }
-    return encodeUcs4(code);
+    int index = int(letter.unicode()) - int(plainLetter(letterType, isCapital, 0));
+    if (index < 0 || index >= (letterType == Greek ? 25 : 26))
+        return letter;
+    return encodeUcs4(mathLetters[letterType][(bold ? 2 : 0) + (italic ? 1 : 0)][isCapital ? 1 : 0][index]);
 }
 
 QString MathGlyphs::digitsToSuperscript(const QString &digits)
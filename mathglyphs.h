@@ -25,9 +25,6 @@
 
 class MathGlyphs
 {
-    static QStringList smallGreekLetterNames;
-    static QStringList capitalGreekLetterNames;
-
 public:
     enum LetterType { Serif, Sans, Mono, Script, Fraktur, DoubleStruck, Greek };
 
@@ -285,6 +282,8 @@ public:
     static QChar emptySet()                         { return QChar(0x2205); }
     static QChar infinity()                         { return QChar(0x221e); }
     static QChar midlineHorizontalEllipsis()        { return QChar(0x22ef); }
+    static QChar verticalEllipsis()                 { return QChar(0x22ee); }
+    static QChar downRightDiagonalEllipsis()        { return QChar(0x22f1); }
     static QChar twoDotLeader()                     { return QChar(0x2025); }
     static QChar leftwardsArrow()                   { return QChar(0x2190); }
     static QChar rightwardsArrow()                  { return QChar(0x2192); }
@@ -15,15 +15,51 @@
  * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QCoreApplication>
+#include <QPainter>
+#include <qmath.h>
 #include "mathtextobject.h"
 
+TileCache MathTextObject::tileCache;
+qint64 MathTextObject::keyCounter = 0;
+
+MathTextObject::MathTextObject(QObject *parent) : QObject(parent)
+{
+    if (QCoreApplication::instance() != nullptr)
+        connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(releaseTileCache()));
+}
+
+// Pictures drawn after this point are replayed instead of being rasterized into tiles.
+void MathTextObject::releaseTileCache()
+{
+    tileCache.setBudget(0);
+    tileCache.clear();
+}
+
 QSizeF MathTextObject::intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format)
 {
-    return QSizeF(1,1);
+    Q_UNUSED(doc)
+    Q_UNUSED(posInDocument)
+    QPicture picture = format.property(Data).value<QPicture>();
+    return picture.isNull() ? QSizeF(1, 1) : QSizeF(picture.boundingRect().size());
 }
 
 void MathTextObject::drawObject(QPainter *painter, const QRectF &rect, QTextDocument *doc,
                                 int posInDocument, const QTextFormat &format)
 {
-
+    Q_UNUSED(doc)
+    Q_UNUSED(posInDocument)
+    QPicture picture = format.property(Data).value<QPicture>();
+    if (picture.isNull())
+        return;
+    // outputs are blitted from pixmaps rasterized at the device pixel ratio and zoom factor
+    // of the painter; pictures which do not fit into the tile cache budget are replayed
+    qreal scale = painter->device()->devicePixelRatioF() * qSqrt(qAbs(painter->transform().determinant()));
+    QPixmap tile;
+    if (format.hasProperty(Key))
+        tile = tileCache.tile(format.property(Key).toLongLong(), picture, scale);
+    if (tile.isNull())
+        painter->drawPicture(rect.topLeft() - picture.boundingRect().topLeft(), picture);
+    else
+        painter->drawPixmap(rect.topLeft(), tile);
 }
@@ -20,18 +20,37 @@
 
 #include <QObject>
 #include <QTextObjectInterface>
+#include <QPicture>
+#include "tilecache.h"
 
 class MathTextObject : public QObject, public QTextObjectInterface
 {
     Q_OBJECT
     Q_INTERFACES(QTextObjectInterface)
 
+    // the tiles are pixmaps, which must not outlive the application object; the cache is emptied
+    // and disabled when the application is about to quit
+    static TileCache tileCache;
+    static qint64 keyCounter;
+
+private slots:
+    void releaseTileCache();
+
 public:
+    MathTextObject(QObject *parent = 0);
+
     enum { Id = QTextFormat::UserObject + 1 };
-    enum { Data = 1 };
+    enum { Data = 1, Key = 2 };
+
+    static qint64 nextKey() { return ++keyCounter; }
+    static void setTileCacheBudget(qint64 bytes) { tileCache.setBudget(bytes); }
+    static void setTileCacheEvictionPolicy(TileCache::EvictionPolicy policy) { tileCache.setEvictionPolicy(policy); }
+    static void clearTileCache() { tileCache.clear(); }
     QSizeF intrinsicSize(QTextDocument *doc, int posInDocument, const QTextFormat &format);
     void drawObject(QPainter *painter, const QRectF &rect, QTextDocument *doc,
                     int posInDocument, const QTextFormat &format);
 };
 
+Q_DECLARE_METATYPE(QPicture)
+
 #endif // MATHTEXTOBJECT_H
@@ -15,56 +15,130 @@
  * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <QtConcurrentMap>
+#include <QtConcurrentRun>
+#include <QThreadPool>
+#include <QLocale>
+#include <QGuiApplication>
+#include <QScreen>
+#include <QPdfWriter>
+#include <QPageSize>
 #include "qgen.h"
 
 using namespace giac;
 
-QString QGen::fontFamily = "FreeSerif";
-QList<QFont> QGen::fonts = QList<QFont>();
-QList<int> QGen::fontSizes = QList<int>();
+QScopedPointer<RenderContext> QGen::defaultRenderContext;
+QMutex QGen::defaultRenderContextMutex;
+QCache<QGen::RenderCacheKey, QGen::RenderCacheEntry> QGen::renderCache(20000);
+QMutex QGen::renderCacheMutex;
+thread_local QGen::PendingRenderCache *QGen::PendingRenderCache::collecting = Q_NULLPTR;
+int QGen::renderCacheHitCount = 0;
+int QGen::renderCacheMissCount = 0;
+int QGen::parallelRenderingThreshold = 256;
+const int QGen::lazyRenderingBatchSize = 32;
+QCache<QGen::StretchyDelimiterKey, QGen::StretchyDelimiter> QGen::stretchyDelimiterCache(2000);
+QMutex QGen::stretchyDelimiterCacheMutex;
+QHash<QPair<QString, int>, QString> QGen::identifierSymbols;
+QMutex QGen::identifierSymbolsMutex;
+QCache<const void*, QGen::IntegerDigits> QGen::integerDigitsCache(32 * 1024);
+QMutex QGen::integerDigitsCacheMutex;
+const int QGen::parallelDigitConversionThreshold = 20000;
+const qreal QGen::defaultNumberLineWidth = 640.0;
+
+static inline uint hashCombine(uint seed, uint value)
+{
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
 
 QGen::QGen(const gen &e, GIAC_CONTEXT)
-    : expr(new gen(e))
+    : value(e)
+    , expr(&value)
     , ct(contextptr)
-    , owns(true) { }
+{
+    expressionCopyCount.ref();
+}
 
 QGen::QGen(gen *e, GIAC_CONTEXT)
     : expr(e)
-    , ct(contextptr)
-    , owns(false) { }
+    , ct(contextptr) { }
 
 QGen::QGen(const QGen &e)
-    : expr(new gen(e.expression()))
+    : value(e.expression())
+    , expr(&value)
     , ct(e.contextPtr())
-    , owns(true) { }
+{
+    expressionCopyCount.ref();
+}
+
+QGen::QGen(QGen &&e)
+    : expr(&value)
+    , ct(e.contextPtr())
+{
+    if (e.ownsExpression())
+        swapgen(value, e.value);
+    else
+        expr = e.expr;
+}
+
+QGen::QGen(const QGenView &view)
+    : expr(const_cast<gen*>(&view.expression()))
+    , ct(view.contextPtr()) { }
 
 QGen::QGen(GIAC_CONTEXT)
-    : expr(new gen(0))
-    , ct(contextptr)
-    , owns(true) { }
+    : value(0)
+    , expr(&value)
+    , ct(contextptr) { }
 
 QGen::QGen(const QString &text, GIAC_CONTEXT)
-    : expr(new gen(text.toStdString().data(), contextptr))
-    , ct(contextptr)
-    , owns(true) { }
+    : value(text.toStdString().data(), contextptr)
+    , expr(&value)
+    , ct(contextptr) { }
 
-QGen::QGen(int value, GIAC_CONTEXT)
-    : expr(new gen(value))
-    , ct(contextptr)
-    , owns(true) { }
+QGen::QGen(int integer, GIAC_CONTEXT)
+    : value(integer)
+    , expr(&value)
+    , ct(contextptr) { }
 
-QGen::QGen(qreal value, GIAC_CONTEXT)
-    : expr(new gen(value))
-    , ct(contextptr)
-    , owns(true) { }
+QGen::QGen(qreal real, GIAC_CONTEXT)
+    : value(real)
+    , expr(&value)
+    , ct(contextptr) { }
 
-QGen::~QGen()
+// The expression being assigned may be a subexpression of this one, so it is copied before
+// the old value is released.
+QGen &QGen::operator =(const QGen &other)
 {
-    if (owns)
-        delete expr;
+    if (this != &other)
+    {
+        gen copy(other.expression());
+        swapgen(value, copy);
+        expr = &value;
+        ct = other.contextPtr();
+        expressionCopyCount.ref();
+    }
+    return *this;
+}
+
+QGen &QGen::operator =(QGen &&other)
+{
+    if (this != &other)
+    {
+        if (other.ownsExpression())
+        {
+            swapgen(value, other.value);
+            expr = &value;
+        }
+        else
+            expr = other.expr;
+        ct = other.contextPtr();
+    }
+    return *this;
 }
 
+QAtomicInt QGen::expressionCopyCount;
+QAtomicInt QGen::layoutNodeCount;
 QMap<QString, QGen::UserOperator> QGen::userOperators = QMap<QString, QGen::UserOperator>();
+QMutex QGen::userOperatorsMutex;
 
 QGen QGen::makeSymb(const unary_function_ptr *p, const gen &args) const
 {
@@ -73,6 +147,9 @@ QGen QGen::makeSymb(const unary_function_ptr *p, const gen &args) const
 
 bool QGen::isNegativeConstant() const
 {
+    // the val field of a big integer does not hold its value
+    if (type() == _ZINT)
+        return mpz_sgn(*expr->_ZINTptr) < 0;
     return  (isInteger() && integerValue() < 0) ||
             (isFloatingPointNumber() && doubleValue() < 0) ||
             (isRational() && expr->_FRACptr->num.val > 0 && expr->_FRACptr->den.val > 0);
@@ -125,8 +202,7 @@ QGen QGen::nthOperand(int n) const
 {
     if (!isSymbolic() || operandCount() <= qAbs(n))
         return undefined();
-    const vecteur &vect = *feuilleVector();
-    return QGen(vect.at(n >= 0 ? n : int(vect.size()) + n), ct);
+    return QGen(view().operand(n));
 }
 
 QGen QGen::valueForKey(const QGen &key) const
@@ -136,15 +212,31 @@ QGen QGen::valueForKey(const QGen &key) const
 
 bool QGen::nthMapEntry(int n, QGen &key, QGen &value) const
 {
-    if (!isMap() || mapEntriesCount() <= n)
+    if (!isMap() || n < 0 || mapEntriesCount() <= n)
         return false;
-    gen_map::iterator it;
-    for (int i = 0; i < n; ++i, ++it);
+    gen_map::const_iterator it = expr->_MAPptr->begin();
+    std::advance(it, n);
     key = QGen(it->first, ct);
     value = QGen(it->second, ct);
     return true;
 }
 
+QGen::MapEntryIterator::MapEntryIterator(const QGen &g)
+    : m_ct(g.contextPtr())
+    , m_started(false)
+{
+    Q_ASSERT(g.isMap());
+    m_current = m_next = g.expression()._MAPptr->begin();
+    m_end = g.expression()._MAPptr->end();
+}
+
+void QGen::MapEntryIterator::next()
+{
+    Q_ASSERT(hasNext());
+    m_current = m_next++;
+    m_started = true;
+}
+
 bool QGen::isUnitApplicationOperator(bool &hasConstant) const
 {
     if (!isUnitApplicationOperator())
@@ -166,10 +258,8 @@ bool QGen::isFunctionApplicationOperator(QString &functionName, QGen &arguments)
 {
     if (!isFunctionApplicationOperator())
         return false;
-    vecteur &args = *feuilleVector();
-    functionName = QString(args.front().print(ct).data());
-    args.erase(args.begin());
-    arguments = QGen(args, ct);
+    functionName = QString(feuilleVector()->front().print(ct).data());
+    arguments = secondOperand();
     return true;
 }
 
@@ -177,10 +267,8 @@ bool QGen::isMappingOperator(QGen &variables, QGen &expression) const
 {
     if (!isMappingOperator())
         return false;
-    vecteur vect(*feuilleVector());
-    expression = QGen(vect.back(), ct);
-    vect.pop_back();
-    variables = QGen(vect, ct);
+    variables = firstOperand();
+    expression = lastOperand();
     return true;
 }
 
@@ -188,8 +276,8 @@ bool QGen::isIntervalOperator(QGen &lowerBound, QGen &upperBound) const
 {
     if (!isIntervalOperator())
         return false;
-    lowerBound = QGen(feuilleVector()->front(), ct);
-    upperBound = QGen(feuilleVector()->back(), ct);
+    lowerBound = firstOperand();
+    upperBound = lastOperand();
     return true;
 }
 
@@ -221,14 +309,14 @@ bool QGen::isRationalExpression(QGen &numerator, QGen &denominator) const
     if (!isProductOperator())
         return false;
     vecteur &factors = *feuilleVector();
-    gen num, den;
+    gen num(1), den(1);
     const_iterateur it;
     for (it = factors.begin(); it != factors.end(); ++it)
     {
         if (it->is_symb_of_sommet(at_inv))
             den = den * it->_SYMBptr->feuille;
         else
-            num = *it * num;
+            num = num * *it;
     }
     numerator = QGen(num, ct);
     denominator = QGen(den, ct);
@@ -271,54 +359,119 @@ int QGen::isInequation(QGen &leftHandSide, QGen &rightHandSide) const
 
 int QGen::operatorType(int &priority) const
 {
-    if (isSumOperator() || isHadamardSumOperator()) {
-        priority = AdditionPriority; return OperatorType::Associative; }
-    if (isProductOperator() || isAmpersandProductOperator() || isHadamardProductOperator() || isComposeOperator()) {
-        priority = MultiplicationPriority; return OperatorType::Associative; }
-    if (isConjunctionOperator() || isDisjunctionOperator() || isExclusiveOrOperator()) {
-        priority = LogicalPriority; return OperatorType::Associative; }
-    if (isBitwiseAndOperator() || isBitwiseOrOperator() || isBitwiseXorOperator()) {
-        priority = BitwisePriority; return OperatorType::Associative; }
-    if (isUnionOperator() || isIntersectionOperator()) {
-        priority = SetPriority; return OperatorType::Associative; }
-    if (isMinusOperator() || isIncrementOperator() || isDecrementOperator()) {
-        priority = AdditionPriority; return OperatorType::Unary; }
-    if (isNegationOperator() || isRealPartOperator() || isImaginaryPartOperator() || isTraceOperator()) {
-        priority = UnaryPriority; return OperatorType::Unary; }
-    if (isComplexConjugateOperator() || isFactorialOperator() ||
-            isTranspositionOperator() || isDerivativeOperator(true)) {
-        priority = ExponentiationPriority; return OperatorType::Unary; }
-    if (isReciprocalOperator()) {
-        priority = DivisionPriority; return OperatorType::Unary; }
-    if (isUnitApplicationOperator()) {
-        priority = MultiplicationPriority; return OperatorType::Binary; }
-    if (isPowerOperator() || isHadamardPowerOperator() || isFunctionalPowerOperator()) {
-        priority = ExponentiationPriority; return OperatorType::Binary; }
-    if (isHadamardDifferenceOperator()) {
-        priority = DifferencePriority; return OperatorType::Binary; }
-    if (isHadamardDivisionOperator()) {
-        priority = MultiplicationPriority; return OperatorType::Binary; }
-    if (isCrossProductOperator()) {
-        priority = MultiplicationPriority; return OperatorType::Binary; }
-    if (isSetDifferenceOperator()) {
-        priority = SetPriority; return OperatorType::Binary; }
-    if (isIntervalOperator()) {
-        priority = IntervalPriority; return OperatorType::Binary; }
-    if (isInequation()) {
-        priority = InequationPriority; return OperatorType::Binary; }
-    if (isElementOperator() || isEqualOperator() || isNotEqualOperator()) {
-        priority = ComparisonPriority; return OperatorType::Binary; }
-    if (isEquation()) {
-        priority = EquationPriority; return OperatorType::Binary; }
-    if (isFunctionApplicationOperator() || isAtOperator()) {
-        priority = ApplicationPriority; return OperatorType::Binary; }
-    if (isMappingOperator()) {
-        priority = EquationPriority; return OperatorType::Binary; }
-    if (isAssignmentOperator() || isArrayAssignmentOperator()) {
-        priority = AssignmentPriority; return OperatorType::Binary; }
-    if (isConditionalOperator() || isIfThenElseOperator()) {
-        priority = ConditionalPriority; return OperatorType::Ternary; }
-    return 0;
+    OperatorInfo info;
+    if (!findOperatorInfo(info))
+        return 0;
+    priority = info.priority;
+    return info.type;
+}
+
+// Operators are classified by a single lookup of the node's sommet in a table which is built
+// once; user-defined operators are looked up by name.
+bool QGen::findOperatorInfo(OperatorInfo &info) const
+{
+    if (!isSymbolic())
+        return false;
+    const OperatorTable &table = operatorTable();
+    OperatorTable::const_iterator it = table.constFind(sommet().ptr());
+    if (it != table.constEnd())
+    {
+        if (it->simpleArgumentOnly && feuille().type == _VECT)
+            return false;
+        info = *it;
+        return true;
+    }
+    QString name;
+    UserOperator op;
+    if (!isUserOperator(name) || !findUserOperator(name, op))
+        return false;
+    info.type = OperatorType::Binary;
+    info.priority = op.priority;
+    info.glyph = op.symbol;
+    info.handler = renderBinary;
+    info.simpleArgumentOnly = false;
+    return true;
+}
+
+const QGen::OperatorTable &QGen::operatorTable()
+{
+    static const OperatorTable table = buildOperatorTable();
+    return table;
+}
+
+void QGen::insertOperator(OperatorTable &table, const unary_function_ptr *f, int type, OperatorPriority priority,
+                          const QString &glyph, RenderHandler handler, bool simpleArgumentOnly)
+{
+    OperatorInfo info;
+    info.type = type;
+    info.priority = priority;
+    info.glyph = glyph;
+    info.handler = handler;
+    info.simpleArgumentOnly = simpleArgumentOnly;
+    table.insert(f->ptr(), info);
+}
+
+QGen::OperatorTable QGen::buildOperatorTable()
+{
+    OperatorTable table;
+    QString applicationSpace(MathGlyphs::functionApplicationSpace());
+    // associative operators
+    insertOperator(table, at_plus, Associative, AdditionPriority, "+", renderAssociative);
+    insertOperator(table, at_pointplus, Associative, AdditionPriority, "+", renderAssociative);
+    insertOperator(table, at_prod, Associative, MultiplicationPriority, MathGlyphs::multiplicationDot(), renderAssociative);
+    insertOperator(table, at_ampersand_times, Associative, MultiplicationPriority, MathGlyphs::multiplicationDot(), renderAssociative);
+    insertOperator(table, at_pointprod, Associative, MultiplicationPriority, MathGlyphs::ringOperator(), renderAssociative);
+    insertOperator(table, at_compose, Associative, MultiplicationPriority, MathGlyphs::ringOperator(), renderAssociative);
+    insertOperator(table, at_and, Associative, LogicalPriority, MathGlyphs::logicalAnd(), renderAssociative);
+    insertOperator(table, at_ou, Associative, LogicalPriority, MathGlyphs::logicalOr(), renderAssociative);
+    insertOperator(table, at_xor, Associative, LogicalPriority, MathGlyphs::logicalXor(), renderAssociative);
+    insertOperator(table, at_bitand, Associative, BitwisePriority, "&", renderAssociative);
+    insertOperator(table, at_bitor, Associative, BitwisePriority, "|", renderAssociative);
+    insertOperator(table, at_bitxor, Associative, BitwisePriority, "XOR", renderAssociative);
+    insertOperator(table, at_union, Associative, SetPriority, MathGlyphs::setUnion(), renderAssociative);
+    insertOperator(table, at_intersect, Associative, SetPriority, MathGlyphs::setIntersection(), renderAssociative);
+    // unary operators
+    insertOperator(table, at_neg, Unary, AdditionPriority, MathGlyphs::minus(), renderUnary);
+    insertOperator(table, at_increment, Unary, AdditionPriority, "++", renderUnary);
+    insertOperator(table, at_decrement, Unary, AdditionPriority, "--", renderUnary);
+    insertOperator(table, at_not, Unary, UnaryPriority, MathGlyphs::notSign(), renderUnary);
+    insertOperator(table, at_re, Unary, UnaryPriority,
+                   MathGlyphs::letterToMath('R', MathGlyphs::Fraktur, false, false) + applicationSpace, renderUnary);
+    insertOperator(table, at_im, Unary, UnaryPriority,
+                   MathGlyphs::letterToMath('I', MathGlyphs::Fraktur, false, false) + applicationSpace, renderUnary);
+    insertOperator(table, at_trace, Unary, UnaryPriority, "tr" + applicationSpace, renderUnary);
+    insertOperator(table, at_conj, Unary, ExponentiationPriority, QString(), renderUnary);
+    insertOperator(table, at_factorial, Unary, ExponentiationPriority, "!", renderUnary);
+    insertOperator(table, at_tran, Unary, ExponentiationPriority, "T", renderUnary);
+    insertOperator(table, at_derive, Unary, ExponentiationPriority, MathGlyphs::prime(), renderUnary, true);
+    insertOperator(table, at_inv, Unary, DivisionPriority, QString(), renderUnary);
+    // binary operators
+    insertOperator(table, at_unit, Binary, MultiplicationPriority, MathGlyphs::thickSpace(), renderBinary);
+    insertOperator(table, at_pow, Binary, ExponentiationPriority, QString(), renderBinary);
+    insertOperator(table, at_pointpow, Binary, ExponentiationPriority, QString(), renderBinary);
+    insertOperator(table, at_composepow, Binary, ExponentiationPriority, QString(), renderBinary);
+    insertOperator(table, at_pointminus, Binary, DifferencePriority, MathGlyphs::minus(), renderBinary);
+    insertOperator(table, at_pointdivision, Binary, MultiplicationPriority, MathGlyphs::circledDivisionSlash(), renderBinary);
+    insertOperator(table, at_cross, Binary, MultiplicationPriority, MathGlyphs::vectorOrCrossProduct(), renderBinary);
+    insertOperator(table, at_minus, Binary, SetPriority, MathGlyphs::setMinus(), renderBinary);
+    insertOperator(table, at_interval, Binary, IntervalPriority, MathGlyphs::twoDotLeader(), renderBinary);
+    insertOperator(table, at_inferieur_strict, Binary, InequationPriority, "<", renderBinary);
+    insertOperator(table, at_superieur_strict, Binary, InequationPriority, ">", renderBinary);
+    insertOperator(table, at_inferieur_egal, Binary, InequationPriority, MathGlyphs::lessThanOrEqualTo(), renderBinary);
+    insertOperator(table, at_superieur_egal, Binary, InequationPriority, MathGlyphs::greaterThanOrEqualTo(), renderBinary);
+    insertOperator(table, at_contains, Binary, ComparisonPriority, MathGlyphs::elementOf(), renderBinary);
+    insertOperator(table, at_same, Binary, ComparisonPriority, MathGlyphs::questionedEqualTo(), renderBinary);
+    insertOperator(table, at_different, Binary, ComparisonPriority, MathGlyphs::notEqualTo(), renderBinary);
+    insertOperator(table, at_equal, Binary, EquationPriority, "=", renderBinary);
+    insertOperator(table, at_of, Binary, ApplicationPriority, applicationSpace, renderBinary);
+    insertOperator(table, at_at, Binary, ApplicationPriority, QString(), renderBinary);
+    insertOperator(table, at_program, Binary, EquationPriority, MathGlyphs::rightwardsArrowFromBar(), renderBinary);
+    insertOperator(table, at_sto, Binary, AssignmentPriority, MathGlyphs::equalToByDefinition(), renderBinary);
+    insertOperator(table, at_array_sto, Binary, AssignmentPriority, MathGlyphs::leftwardsArrow(), renderBinary);
+    // ternary operators
+    insertOperator(table, at_when, Ternary, ConditionalPriority, QString(), Q_NULLPTR);
+    insertOperator(table, at_ifte, Ternary, ConditionalPriority, QString(), Q_NULLPTR);
+    return table;
 }
 
 bool QGen::isOperator(int &type) const
@@ -336,12 +489,13 @@ bool QGen::isOperator() const
     return isOperator(t);
 }
 
-bool QGen::isAssociativeOperator(vecteur &operands) const
+bool QGen::isAssociativeOperator(QVector<QGenView> &operands) const
 {
     int t;
     if (!isOperator(t) || t != OperatorType::Associative)
         return false;
-    operands = flattenOperands();
+    operands.clear();
+    flattenOperands(view(), operands);
     return true;
 }
 
@@ -425,28 +579,23 @@ bool QGen::isDefiniteIntegral(QGen &expression, QGen &variable, QGen &lowerBound
     return true;
 }
 
-vecteur QGen::flattenOperands() const
+void QGen::flattenOperands(const QGenView &g, QVector<QGenView> &operands)
 {
-    Q_ASSERT(isSymbolic());
-    vecteur operands;
-    gen argument = feuille();
-    if (argument.type != _VECT)
-        operands.push_back(argument);
-    else
+    Q_ASSERT(g.isSymbolic());
+    int count = g.operandCount();
+    if (count < 0)
     {
-        vecteur &argumentVector = *argument._VECTptr;
-        const_iterateur it;
-        for (int i = 0 ; i < int(argumentVector.size()); ++i) {
-            QGen operand(&(argumentVector.at(i)), ct);
-            if (isSymbolic() && operand.sommet() == this->sommet()) {
-                vecteur subOperands = operand.flattenOperands();
-                for (it = subOperands.begin(); it != subOperands.end(); ++it)
-                    operands.push_back(*it);
-            }
-            else operands.push_back(operand.expression());
-        }
+        operands.append(g.argument());
+        return;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        QGenView operand = g.operand(i);
+        if (operand.isTheSameOperatorAs(g))
+            flattenOperands(operand, operands);
+        else
+            operands.append(operand);
     }
-    return operands;
 }
 
 bool QGen::resizeVector(int n)
@@ -501,6 +650,17 @@ bool QGen::isModular(QGen &value, QGen &modulus) const
 
 QPicture QGen::toPicture(const QString &family, int size) const
 {
+    RenderContext rc(family, size, ct);
+    return render(rc);
+}
+
+// Huge integers are printed from the cached parallel conversion instead of giac's printer.
+QString QGen::toFullString() const
+{
+    if (type() != _ZINT)
+        return toString();
+    QString text = QString::fromLatin1(integerDigits(*expr));
+    return mpz_sgn(*expr->_ZINTptr) < 0 ? "-" + text : text;
 }
 
 QString QGen::toLaTeX() const
@@ -622,6 +782,8 @@ bool QGen::defineBinaryOperator(const QString &name, OperatorPriority priority,
         op.isAssociative = false;
         op.isCommutative = false;
     }
+    QMutexLocker locker(&userOperatorsMutex);
+    userOperators.insert(name, op);
     return true;
 }
 
@@ -639,11 +801,14 @@ bool QGen::defineBinaryRelation(const QString &name, OperatorPriority priority,
     op.isRelation = true;
     op.isAssociative = false;
     op.isCommutative = false;
+    QMutexLocker locker(&userOperatorsMutex);
+    userOperators.insert(name, op);
     return true;
 }
 
 bool QGen::findUserOperator(const QString &name, UserOperator &properties)
 {
+    QMutexLocker locker(&userOperatorsMutex);
     QMap<QString, UserOperator>::const_iterator it = userOperators.constFind(name);
     if (it == userOperators.constEnd())
         return false;
@@ -653,11 +818,459 @@ bool QGen::findUserOperator(const QString &name, UserOperator &properties)
 
 // RENDERING
 
+void QGen::Display::appendItem(const Item &item, const QRectF &itemRect)
+{
+    m_items.append(item);
+    if (!item.display.isNull())
+        m_elidedCount += item.display->elidedCount();
+    m_boundingRect = m_boundingRect.isNull() ? itemRect : m_boundingRect.united(itemRect);
+}
+
+// Text items are painted as glyph runs shaped by the metrics table of their font, except on a
+// QPicture, where glyph runs would be recorded as outlines; the runs are only looked up here, so
+// layouts which end up in pictures never pay for them.
+void QGen::Display::paint(QPainter &painter, const QPointF &where) const
+{
+    bool useGlyphRuns = painter.device() == Q_NULLPTR || painter.device()->devType() != QInternal::Picture;
+    painter.save();
+    painter.translate(where);
+    QTransform base = painter.transform();
+    QVector<Item>::const_iterator it;
+    for (it = m_items.begin(); it != m_items.end(); ++it)
+    {
+        painter.setTransform(it->transform * base);
+        if (!it->display.isNull())
+            it->display->paint(painter, it->position);
+        else if (!it->path.isNull())
+        {
+            painter.translate(it->position);
+            painter.fillPath(*it->path, painter.pen().brush());
+        }
+        else
+        {
+            QGlyphRun glyphs;
+            if (useGlyphRuns && !it->metrics.isNull())
+                glyphs = it->metrics->glyphRun(it->text);
+            if (!glyphs.isEmpty())
+                painter.drawGlyphRun(it->position, glyphs);
+            else
+            {
+                painter.setFont(it->font);
+                painter.drawText(it->position, it->text);
+            }
+        }
+    }
+    painter.restore();
+}
+
+static QString svgNumber(qreal value)
+{
+    return QString::number(qAbs(value) < 1e-9 ? 0.0 : value, 'g', 6);
+}
+
+static QString svgMatrix(const QTransform &t)
+{
+    return QString("matrix(%1 %2 %3 %4 %5 %6)").arg(svgNumber(t.m11()), svgNumber(t.m12()), svgNumber(t.m21()),
+                                                    svgNumber(t.m22()), svgNumber(t.dx()), svgNumber(t.dy()));
+}
+
+static QString svgPathData(const QPainterPath &path)
+{
+    QStringList data;
+    for (int i = 0; i < path.elementCount(); ++i)
+    {
+        const QPainterPath::Element &e = path.elementAt(i);
+        switch (e.type)
+        {
+        case QPainterPath::MoveToElement:
+            data << "M" + svgNumber(e.x) << svgNumber(e.y);
+            break;
+        case QPainterPath::LineToElement:
+            data << "L" + svgNumber(e.x) << svgNumber(e.y);
+            break;
+        case QPainterPath::CurveToElement:
+            data << "C" + svgNumber(e.x) << svgNumber(e.y);
+            break;
+        case QPainterPath::CurveToDataElement:
+            data << svgNumber(e.x) << svgNumber(e.y);
+            break;
+        }
+    }
+    return data.join(' ');
+}
+
+// Writes the same items as paint, one element at a time; subdisplays become nested groups.
+void QGen::Display::writeSvg(QXmlStreamWriter &xml, const QPointF &where, qreal dpi) const
+{
+    xml.writeStartElement("g");
+    xml.writeAttribute("transform", QString("translate(%1 %2)").arg(svgNumber(where.x()), svgNumber(where.y())));
+    QVector<Item>::const_iterator it;
+    for (it = m_items.begin(); it != m_items.end(); ++it)
+    {
+        bool transformed = !it->transform.isIdentity();
+        if (transformed)
+        {
+            xml.writeStartElement("g");
+            xml.writeAttribute("transform", svgMatrix(it->transform));
+        }
+        if (!it->display.isNull())
+            it->display->writeSvg(xml, it->position, dpi);
+        else if (!it->path.isNull())
+        {
+            xml.writeStartElement("path");
+            if (!it->position.isNull())
+                xml.writeAttribute("transform", QString("translate(%1 %2)").arg(svgNumber(it->position.x()),
+                                                                                svgNumber(it->position.y())));
+            if (it->path->fillRule() == Qt::OddEvenFill)
+                xml.writeAttribute("fill-rule", "evenodd");
+            xml.writeAttribute("d", svgPathData(*it->path));
+            xml.writeEndElement();
+        }
+        else
+        {
+            const QFont &font = it->font;
+            qreal pixelSize = font.pixelSize() > 0 ? font.pixelSize() : font.pointSizeF() * dpi / 72.0;
+            xml.writeStartElement("text");
+            xml.writeAttribute("x", svgNumber(it->position.x()));
+            xml.writeAttribute("y", svgNumber(it->position.y()));
+            xml.writeAttribute("font-family", font.family());
+            xml.writeAttribute("font-size", svgNumber(pixelSize));
+            if (font.bold())
+                xml.writeAttribute("font-weight", "bold");
+            if (font.italic())
+                xml.writeAttribute("font-style", "italic");
+            xml.writeCharacters(it->text);
+            xml.writeEndElement();
+        }
+        if (transformed)
+            xml.writeEndElement();
+    }
+    xml.writeEndElement();
+}
+
+void QGen::LayoutPainter::drawText(const QPointF &position, const QString &text)
+{
+    FontMetricsTable &metrics = *m_state.fontMetrics;
+    QRectF rect(position.x(), position.y() - metrics.ascent(),
+                metrics.width(text), metrics.ascent() + metrics.descent());
+    if (m_path != Q_NULLPTR)
+    {
+        QPainterPath glyphs;
+        glyphs.addText(position, metrics.font(), text);
+        m_path->addPath(m_state.transform.map(glyphs));
+        QRectF mapped = m_state.transform.mapRect(rect);
+        m_pathRect = m_pathRect.isNull() ? mapped : m_pathRect.united(mapped);
+        return;
+    }
+    Display::Item item;
+    item.transform = m_state.transform;
+    item.position = position;
+    item.font = metrics.font();
+    item.text = text;
+    item.metrics = metrics.sharedFromThis();
+    m_display->appendItem(item, m_state.transform.mapRect(rect));
+}
+
+void QGen::LayoutPainter::drawDisplay(const QPointF &position, const Display &display)
+{
+    if (display.isEmpty())
+        return;
+    Display::Item item;
+    item.transform = m_state.transform;
+    item.position = position;
+    item.display = QSharedPointer<const Display>(new Display(display));
+    layoutNodeCount.ref();
+    m_display->appendItem(item, m_state.transform.mapRect(display.boundingRect().translated(position)));
+}
+
+void QGen::LayoutPainter::drawPath(const QPointF &position, const QSharedPointer<const QPainterPath> &path, const QRectF &rect)
+{
+    Display::Item item;
+    item.transform = m_state.transform;
+    item.position = position;
+    item.path = path;
+    m_display->appendItem(item, m_state.transform.mapRect(rect.translated(position)));
+}
+
 void QGen::setRenderingFont(const QString &family, int basePointSize)
 {
-    fontFamily = family;
-    for (int i = -2; i < 2; ++i)
-        fontSizes << qRound(basePointSize * pow(2.0, (qreal)i / 2.0));
+    QMutexLocker locker(&defaultRenderContextMutex);
+    if (defaultRenderContext.isNull())
+        defaultRenderContext.reset(new RenderContext(family, basePointSize));
+    else
+        defaultRenderContext->setFont(family, basePointSize);
+    locker.unlock();
+    clearRenderCache();
+}
+
+RenderContext QGen::renderingContext()
+{
+    QMutexLocker locker(&defaultRenderContextMutex);
+    if (defaultRenderContext.isNull())
+        defaultRenderContext.reset(new RenderContext);
+    return *defaultRenderContext;
+}
+
+void QGen::setRenderCacheCapacity(int maximumItemCount)
+{
+    QMutexLocker locker(&renderCacheMutex);
+    renderCache.setMaxCost(maximumItemCount);
+}
+
+void QGen::clearRenderCache()
+{
+    QMutexLocker locker(&renderCacheMutex);
+    renderCache.clear();
+    renderCacheHitCount = 0;
+    renderCacheMissCount = 0;
+    locker.unlock();
+    QMutexLocker delimiterLocker(&stretchyDelimiterCacheMutex);
+    stretchyDelimiterCache.clear();
+}
+
+int QGen::renderCacheHits()
+{
+    QMutexLocker locker(&renderCacheMutex);
+    return renderCacheHitCount;
+}
+
+int QGen::renderCacheMisses()
+{
+    QMutexLocker locker(&renderCacheMutex);
+    return renderCacheMissCount;
+}
+
+// Hashes of shared subtrees are memoized for the duration of a single render, so that hashing every
+// node on the way down costs linear time. A stale memo entry can only cause a cache miss, because
+// findCachedDisplay compares the expressions before reusing a display.
+uint QGen::structuralHash(const gen &g, QHash<const void*, uint> &memo, const context *contextptr)
+{
+    const void *node = NULL;
+    if (g.type == _SYMB)
+        node = g._SYMBptr;
+    else if (g.type == _VECT)
+        node = g._VECTptr;
+    if (node != NULL)
+    {
+        QHash<const void*, uint>::const_iterator it = memo.constFind(node);
+        if (it != memo.constEnd())
+            return *it;
+    }
+    uint h = hashCombine(uint(g.type), uint(g.subtype));
+    switch (g.type)
+    {
+    case _INT_:
+        h = hashCombine(h, qHash(g.val));
+        break;
+    case _DOUBLE_:
+        h = hashCombine(h, qHash(g.DOUBLE_val()));
+        break;
+    case _IDNT:
+        h = hashCombine(h, qHash(QLatin1String(g._IDNTptr->id_name)));
+        break;
+    case _STRNG:
+        h = hashCombine(h, qHash(QByteArray::fromStdString(*g._STRNGptr)));
+        break;
+    case _FRAC:
+        h = hashCombine(h, structuralHash(g._FRACptr->num, memo, contextptr));
+        h = hashCombine(h, structuralHash(g._FRACptr->den, memo, contextptr));
+        break;
+    case _CPLX:
+        h = hashCombine(h, structuralHash(*g._CPLXptr, memo, contextptr));
+        h = hashCombine(h, structuralHash(*(g._CPLXptr + 1), memo, contextptr));
+        break;
+    case _MOD:
+        h = hashCombine(h, structuralHash(*g._MODptr, memo, contextptr));
+        h = hashCombine(h, structuralHash(*(g._MODptr + 1), memo, contextptr));
+        break;
+    case _SYMB:
+        h = hashCombine(h, qHash(g._SYMBptr->sommet.ptr()));
+        h = hashCombine(h, structuralHash(g._SYMBptr->feuille, memo, contextptr));
+        break;
+    case _VECT:
+    {
+        const_iterateur it;
+        for (it = g._VECTptr->begin(); it != g._VECTptr->end(); ++it)
+            h = hashCombine(h, structuralHash(*it, memo, contextptr));
+        break;
+    }
+    default:
+        h = hashCombine(h, qHash(QByteArray::fromStdString(g.print(contextptr))));
+        break;
+    }
+    if (node != NULL)
+        memo.insert(node, h);
+    return h;
+}
+
+uint QGen::structuralHash(RenderContext &rc, const gen &g)
+{
+    return structuralHash(g, rc.structuralHashes(), rc.giacContext());
+}
+
+uint QGen::structuralHash(const gen &g, GIAC_CONTEXT)
+{
+    QHash<const void*, uint> memo;
+    return structuralHash(g, memo, contextptr);
+}
+
+bool QGen::findCachedDisplay(const RenderCacheKey &key, const gen &g, Display &display)
+{
+    QMutexLocker locker(&renderCacheMutex);
+    RenderCacheEntry *entry = renderCache.object(key);
+    if (entry == Q_NULLPTR || !(entry->expression == g))
+    {
+        ++renderCacheMissCount;
+        return false;
+    }
+    ++renderCacheHitCount;
+    display = entry->display;
+    return true;
+}
+
+void QGen::insertCachedDisplay(const RenderCacheKey &key, const gen &g, const Display &display)
+{
+    QMutexLocker locker(&renderCacheMutex);
+    RenderCacheEntry *entry = new RenderCacheEntry;
+    entry->expression = g;
+    entry->display = display;
+    renderCache.insert(key, entry, display.items().size() + 1);
+}
+
+// Only the thread owning the expression inserts into the render cache, other threads collect.
+void QGen::cacheDisplay(const RenderCacheKey &key, const QGen &g, const Display &display)
+{
+    if (PendingRenderCache::collecting == Q_NULLPTR)
+    {
+        insertCachedDisplay(key, g.expression(), display);
+        return;
+    }
+    PendingRenderCache::Entry entry;
+    entry.key = key;
+    entry.expression = &g.expression();
+    entry.display = display;
+    PendingRenderCache::collecting->m_entries.append(entry);
+}
+
+// Records the address of every gen in the expression tree, visiting shared nodes once.
+void QGen::collectSubexpressions(const gen &g, QSet<const void*> &nodes, QSet<const gen*> &gens)
+{
+    gens.insert(&g);
+    switch (g.type)
+    {
+    case _VECT:
+    {
+        if (nodes.contains(g._VECTptr))
+            return;
+        nodes.insert(g._VECTptr);
+        const_iterateur it;
+        for (it = g._VECTptr->begin(); it != g._VECTptr->end(); ++it)
+            collectSubexpressions(*it, nodes, gens);
+        break;
+    }
+    case _SYMB:
+        if (nodes.contains(g._SYMBptr))
+            return;
+        nodes.insert(g._SYMBptr);
+        collectSubexpressions(g._SYMBptr->feuille, nodes, gens);
+        break;
+    case _FRAC:
+        collectSubexpressions(g._FRACptr->num, nodes, gens);
+        collectSubexpressions(g._FRACptr->den, nodes, gens);
+        break;
+    case _CPLX:
+        collectSubexpressions(*g._CPLXptr, nodes, gens);
+        collectSubexpressions(*(g._CPLXptr + 1), nodes, gens);
+        break;
+    case _MAP:
+    {
+        if (nodes.contains(g._MAPptr))
+            return;
+        nodes.insert(g._MAPptr);
+        gen_map::const_iterator it;
+        for (it = g._MAPptr->begin(); it != g._MAPptr->end(); ++it)
+        {
+            collectSubexpressions(it->first, nodes, gens);
+            collectSubexpressions(it->second, nodes, gens);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void QGen::PendingRenderCache::beginCollecting()
+{
+    m_previous = collecting;
+    collecting = this;
+}
+
+void QGen::PendingRenderCache::endCollecting()
+{
+    Q_ASSERT(collecting == this);
+    collecting = m_previous;
+    m_previous = Q_NULLPTR;
+}
+
+// On a thread which is collecting itself, the displays are handed on to its collector, which is
+// committed with an enclosing expression later.
+void QGen::PendingRenderCache::commit(const QVector<const gen*> &roots)
+{
+    if (collecting != Q_NULLPTR)
+    {
+        collecting->m_entries += m_entries;
+        m_entries.clear();
+        return;
+    }
+    QSet<const void*> nodes;
+    QSet<const gen*> gens;
+    foreach (const gen *root, roots)
+        collectSubexpressions(*root, nodes, gens);
+    foreach (const Entry &entry, m_entries)
+    {
+        if (gens.contains(entry.expression))
+            insertCachedDisplay(entry.key, *entry.expression, entry.display);
+    }
+    m_entries.clear();
+}
+
+// A negative number negated without sharing any node with it, so that it can be built on a worker
+// thread; the denominator of a fraction is copied deeply.
+gen QGen::negatedConstant(const gen &g)
+{
+    if (g.type != _FRAC)
+        return -g;
+    const gen &den = g._FRACptr->den;
+    return fraction(-g._FRACptr->num, den.type == _ZINT ? gen(*den._ZINTptr) : den);
+}
+
+QGen::StretchyDelimiterKey QGen::stretchyDelimiterKey(RenderContext &rc, int shape, qreal extent)
+{
+    StretchyDelimiterKey key;
+    key.fontKey = rc.fontKey();
+    key.fontFamily = rc.fontFamily();
+    key.basePointSize = rc.basePointSize();
+    key.fontIndex = rc.fontIndex(rc.fontSizeLevel());
+    key.shape = shape;
+    key.bucket = qCeil(extent * 2.0);
+    return key;
+}
+
+bool QGen::findStretchyDelimiter(const StretchyDelimiterKey &key, StretchyDelimiter &delimiter)
+{
+    QMutexLocker locker(&stretchyDelimiterCacheMutex);
+    StretchyDelimiter *cached = stretchyDelimiterCache.object(key);
+    if (cached == Q_NULLPTR)
+        return false;
+    delimiter = *cached;
+    return true;
+}
+
+void QGen::insertStretchyDelimiter(const StretchyDelimiterKey &key, const StretchyDelimiter &delimiter)
+{
+    QMutexLocker locker(&stretchyDelimiterCacheMutex);
+    stretchyDelimiterCache.insert(key, new StretchyDelimiter(delimiter));
 }
 
 QString QGen::paddedText(const QString &text, MathPadding padding, bool padLeft, bool padRight)
@@ -724,8 +1337,15 @@ QString QGen::numberToSubscriptText(int integer, bool parens)
     return raised;
 }
 
+// Conversions are memoized per identifier name and style; worksheets use few distinct names.
 QString QGen::identifierStringToUnicode(const QString &text, bool bold, bool italic)
 {
+    QPair<QString, int> key(text, int(bold) << 1 | int(italic));
+    QMutexLocker locker(&identifierSymbolsMutex);
+    QHash<QPair<QString, int>, QString>::const_iterator cached = identifierSymbols.constFind(key);
+    if (cached != identifierSymbols.constEnd())
+        return *cached;
+    locker.unlock();
     QString symbol;
     QChar greekLetter;
     if (MathGlyphs::getGreekLetter(text, greekLetter))
@@ -741,74 +1361,84 @@ QString QGen::identifierStringToUnicode(const QString &text, bool bold, bool ita
                 symbol.append(*it);
         }
     }
+    locker.relock();
+    if (identifierSymbols.size() < 8192)
+        identifierSymbols.insert(key, symbol);
     return symbol;
 }
 
-const QFont &QGen::getFont(int fontSizeLevel)
-{
-    int level = 2 + (int)qMin(qMax(fontSizeLevel, -2), 1);
-    QFont::Weight weight = renderFontBold ? QFont::Bold : QFont::Normal;
-    int pointSize = fontSizes.at(level);
-    for (QList<QFont>::const_iterator it = fonts.begin(); it != fonts.end(); ++it)
-    {
-        if (it->pointSize() == pointSize && it->weight() == weight && it->italic() == renderFontItalic)
-            return *it;
-    }
-    fonts.append(QFont(fontFamily, pointSize, weight, renderFontItalic));
-    return fonts.back();
-}
-
-void QGen::render(Display &dest, const QGen &g, int sizeLevel)
-{
-    fontSizeLevelStack.push(sizeLevel);
+void QGen::render(RenderContext &rc, Display &dest, const QGen &g, int sizeLevel)
+{
+    RenderCacheKey key;
+    key.hash = structuralHash(rc, g.expression());
+    key.fontSizeLevel = sizeLevel;
+    key.fontKey = rc.fontKey();
+    key.elisionKey = rc.elisionKey();
+    key.bold = rc.isBold();
+    key.italic = rc.isItalic();
+    key.fontFamily = rc.fontFamily();
+    key.basePointSize = rc.basePointSize();
+    key.viewport = rc.viewport();
+    key.lineWidth = rc.nestingDepth() == 0 ? rc.maximumLineWidth() : 0.0;
+    key.lazyRenderingThreshold = rc.lazyRenderingThreshold();
+    key.mapEntryLimit = rc.mapEntryLimit();
+    key.numberDigitThreshold = rc.numberDigitThreshold();
+    bool cacheable = dest.isEmpty() && !rc.isIndexing();
+    if (cacheable && findCachedDisplay(key, g.expression(), dest))
+        return;
+    rc.pushFontSizeLevel(sizeLevel);
     QPointF origin(0.0, 0.0);
     QGen realPart, imaginaryPart;
     if (g.isString())
-        renderText(dest, quotedText(g.stringValue()));
+        renderText(rc, dest, quotedText(g.stringValue()));
     else if (g.isRealConstant())
-        renderRealNumber(dest, g, origin);
+        renderRealNumber(rc, dest, g, origin);
     else if (g.isComplex(realPart, imaginaryPart))
-        renderComplexNumber(dest, realPart, imaginaryPart, origin);
+        renderComplexNumber(rc, dest, realPart, imaginaryPart, origin);
     else if (g.isIdentifier())
-        renderIdentifier(dest, g, origin);
+        renderIdentifier(rc, dest, g, origin);
     else if (g.isModular())
-        renderModular(dest, g, origin);
+        renderModular(rc, dest, g, origin);
     else if (g.isMap())
-        renderMap(dest, g, origin);
+        renderMap(rc, dest, g, origin);
     else if (g.isVector())
-        renderVector(dest, g, origin);
+        renderVector(rc, dest, g, origin);
     else if (g.isSymbolic())
-        renderSymbolic(dest, g, origin);
+        renderSymbolic(rc, dest, g, origin);
     else
-        renderText(dest, g.toString());
-    fontSizeLevelStack.pop();
+        renderText(rc, dest, g.toString());
+    rc.popFontSizeLevel();
+    if (rc.isIndexing())
+        dest.linkWithExpression(g);
+    if (cacheable)
+        cacheDisplay(key, g, dest);
 }
 
-QGen::Display QGen::renderNormal(const QGen &g)
+QGen::Display QGen::renderNormal(RenderContext &rc, const QGen &g)
 {
     Display display;
-    render(display, g, fontSizeLevel());
+    render(rc, display, g, rc.fontSizeLevel());
     return display;
 }
 
-QGen::Display QGen::renderSmaller(const QGen &g)
+QGen::Display QGen::renderSmaller(RenderContext &rc, const QGen &g)
 {
     Display display;
-    render(display, g, smallerFontSizeLevel());
+    render(rc, display, g, rc.smallerFontSizeLevel());
     return display;
 }
 
-QGen::Display QGen::renderLarger(const QGen &g)
+QGen::Display QGen::renderLarger(RenderContext &rc, const QGen &g)
 {
     Display display;
-    render(display, g, largerFontSizeLevel());
+    render(rc, display, g, rc.largerFontSizeLevel());
     return display;
 }
 
 void QGen::renderDisplay(Display &dest, const Display &source, QPointF where)
 {
-    QPainter painter(&dest);
-    painter.drawPicture(where, source);
+    LayoutPainter painter(&dest);
+    painter.drawDisplay(where, source);
 }
 
 void QGen::renderDisplayAndAdvance(Display &dest, const Display &source, QPointF &penPoint)
@@ -817,95 +1447,140 @@ void QGen::renderDisplayAndAdvance(Display &dest, const Display &source, QPointF
     movePenPointX(penPoint, source.advance());
 }
 
-qreal QGen::renderText(Display &dest, const QString &text,
-                              int relativeFontSizeLevel, QPointF where, QRectF *boundingRect)
+// Follows the packing of renderLines while the terms are laid out, so that lazy rendering in line
+// breaking mode stops once the packed lines are taller than the viewport.
+struct LinePacker
 {
-    QPainter painter(&dest);
-    QFont font = getFont(fontSizeLevel() + relativeFontSizeLevel);
-    QFontMetricsF fontMetrics(font);
-    painter.setFont(font);
+    qreal lineWidth, indent, lineSkip, x, lineHeight;
+    int lineCount;
+
+    LinePacker(qreal width, qreal indentation, qreal skip)
+        : lineWidth(width), indent(indentation), lineSkip(skip), x(0.0), lineHeight(0.0), lineCount(0) { }
+    void add(const QGen::Display &term)
+    {
+        if (lineCount == 0)
+            lineCount = 1;
+        else if (x + term.advance() > lineWidth)
+        {
+            ++lineCount;
+            x = indent;
+        }
+        x += term.advance();
+        lineHeight = qMax(lineHeight, term.ascent() + term.descent() + lineSkip);
+    }
+    qreal height() const { return lineCount * lineHeight; }
+};
+
+// Terms are packed greedily into lines not wider than lineWidth, a term which does not fit starts a
+// new, indented line. Only the terms are cached, so reflowing to another width is a single pass.
+void QGen::renderLines(RenderContext &rc, Display &dest, const QVector<Display> &terms, qreal lineWidth, QPointF where)
+{
+    qreal indent = 2.0 * textWidth(rc, MathGlyphs::emQuadSpace());
+    QVector<Display> lines(1);
+    QPointF penPoint(0.0, 0.0);
+    bool lineIsEmpty = true;
+    QVector<Display>::const_iterator it;
+    for (it = terms.begin(); it != terms.end(); ++it)
+    {
+        if (!lineIsEmpty && penPoint.x() + it->advance() > lineWidth)
+        {
+            lines.append(Display());
+            penPoint = QPointF(indent, 0.0);
+        }
+        renderDisplayAndAdvance(lines.last(), *it, penPoint);
+        lineIsEmpty = false;
+    }
+    QPointF linePoint(where);
+    for (int i = 0; i < lines.size(); ++i)
+    {
+        if (i > 0)
+            movePenPointY(linePoint, lines.at(i - 1).descent() + fontLeading(rc) + linePadding(rc) + lines.at(i).ascent());
+        renderDisplay(dest, lines.at(i), linePoint);
+    }
+}
+
+qreal QGen::renderText(RenderContext &rc, Display &dest, const QString &text,
+                       int relativeFontSizeLevel, QPointF where, QRectF *boundingRect)
+{
+    LayoutPainter painter(&dest);
+    FontMetricsTable &metrics = rc.fontMetrics(relativeFontSizeLevel);
+    painter.setFont(metrics);
     painter.drawText(where, text);
     if (boundingRect != Q_NULLPTR)
     {
-        *boundingRect = fontMetrics.tightBoundingRect(text);
+        *boundingRect = metrics.tightBoundingRect(text);
         boundingRect->translate(where);
     }
-    return textWidth(text);
+    return metrics.width(text);
 }
 
-void QGen::renderTextAndAdvance(Display &dest, const QString &text, QPointF &penPoint)
+void QGen::renderTextAndAdvance(RenderContext &rc, Display &dest, const QString &text, QPointF &penPoint)
 {
-    movePenPointX(penPoint, renderText(dest, text, 0, penPoint));
+    movePenPointX(penPoint, renderText(rc, dest, text, 0, penPoint));
 }
 
-qreal QGen::textWidth(const QString &text, int relativeFontSizeLevel)
+qreal QGen::textWidth(RenderContext &rc, const QString &text, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.width(text);
+    return rc.fontMetrics(relativeFontSizeLevel).width(text);
 }
 
-QRectF QGen::textTightBoundingRect(const QString &text, int relativeFontSizeLevel)
+QRectF QGen::textTightBoundingRect(RenderContext &rc, const QString &text, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.tightBoundingRect(text);
+    return rc.fontMetrics(relativeFontSizeLevel).tightBoundingRect(text);
 }
 
-qreal QGen::fontHeight(int relativeFontSizeLevel)
+qreal QGen::fontHeight(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.height();
+    return rc.fontMetrics(relativeFontSizeLevel).height();
 }
 
-qreal QGen::fontAscent(int relativeFontSizeLevel)
+qreal QGen::fontAscent(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.ascent();
+    return rc.fontMetrics(relativeFontSizeLevel).ascent();
 }
 
-qreal QGen::fontDescent(int relativeFontSizeLevel)
+qreal QGen::fontDescent(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.descent();
+    return rc.fontMetrics(relativeFontSizeLevel).descent();
 }
 
-qreal QGen::fontXHeight(int relativeFontSizeLevel)
+qreal QGen::fontXHeight(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.xHeight();
+    return rc.fontMetrics(relativeFontSizeLevel).xHeight();
 }
 
-qreal QGen::fontMidLine(int relativeFontSizeLevel)
+qreal QGen::fontMidLine(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return (fontMetrics.xHeight() / 2 + fontMetrics.strikeOutPos()) / 2;
+    return rc.fontMetrics(relativeFontSizeLevel).midLine();
 }
 
-qreal QGen::fontLeading(int relativeFontSizeLevel)
+qreal QGen::fontLeading(RenderContext &rc, int relativeFontSizeLevel)
 {
-    QFontMetricsF fontMetrics(getFont(fontSizeLevel() + relativeFontSizeLevel));
-    return fontMetrics.leading();
+    return rc.fontMetrics(relativeFontSizeLevel).leading();
 }
 
-qreal QGen::lineWidth(int relativeFontSizeLevel)
+qreal QGen::lineWidth(RenderContext &rc, int relativeFontSizeLevel)
 {
-    return textTightBoundingRect(MathGlyphs::horizontalLineExtension(), relativeFontSizeLevel).height();
+    return rc.fontMetrics(relativeFontSizeLevel).lineWidth();
 }
 
-void QGen::renderRealNumber(Display &dest, const QGen &g, QPointF where)
+void QGen::renderRealNumber(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     QPointF penPoint(where);
     QGen gAbs(g), numerator, denominator;
     if (g.isNegativeConstant())
     {
-        renderTextAndAdvance(dest, MathGlyphs::minus(), penPoint);
+        renderTextAndAdvance(rc, dest, MathGlyphs::minus(), penPoint);
         dest.setPriority(QGen::MultiplicationPriority);
-        gAbs = QGen(-g.expression(), ct);
+        gAbs = QGen(negatedConstant(g.expression()), rc.giacContext());
     }
     if (gAbs.isFraction(numerator, denominator)) {
-        renderFraction(dest, numerator, denominator, penPoint);
+        renderFraction(rc, dest, numerator, denominator, penPoint);
         dest.setPriority(QGen::DivisionPriority);
         dest.setGrouped(true);
     }
+    else if (gAbs.type() == _ZINT && mpz_sizeinbase(*gAbs.expression()._ZINTptr, 10) > size_t(rc.numberDigitThreshold()))
+        renderDigitLines(rc, dest, QString::fromLatin1(integerDigits(gAbs.expression())), penPoint);
     else
     {
         QString text = gAbs.toString();
@@ -924,28 +1599,156 @@ void QGen::renderRealNumber(Display &dest, const QGen &g, QPointF where)
                 exponentDigits.prepend(MathGlyphs::superscriptMinus());
             text.append("10" + exponentDigits);
             dest.setPriority(QGen::MultiplicationPriority);
+            if (index > rc.numberDigitThreshold())
+            {
+                renderDigitLines(rc, dest, mantissa, penPoint);
+                text = text.mid(mantissa.length());
+            }
         }
-        renderText(dest, text, 0, penPoint);
+        else if (text.length() > rc.numberDigitThreshold())
+        {
+            renderDigitLines(rc, dest, text, penPoint);
+            return;
+        }
+        renderText(rc, dest, text, 0, penPoint);
     }
 }
 
-void QGen::renderComplexNumber(Display &dest, const QGen &realPart, const QGen &imaginaryPart, QPointF where)
+// Splits n at the middle digit by dividing by a power of ten, converts both halves in parallel
+// and pads the lower half with zeros. The sign of n is ignored.
+QByteArray QGen::convertIntegerDigits(mpz_srcptr n, int depth)
+{
+    size_t estimate = mpz_sizeinbase(n, 10);
+    if (estimate < size_t(parallelDigitConversionThreshold) || depth >= 4)
+    {
+        QByteArray digits(int(estimate) + 2, '\0');
+        mpz_get_str(digits.data(), 10, n);
+        digits.truncate(qstrlen(digits.constData()));
+        if (digits.startsWith('-'))
+            digits.remove(0, 1);
+        return digits;
+    }
+    unsigned long split = estimate / 2;
+    mpz_t power, high, low;
+    mpz_init(power);
+    mpz_init(high);
+    mpz_init(low);
+    mpz_ui_pow_ui(power, 10, split);
+    mpz_tdiv_qr(high, low, n, power);
+    mpz_abs(low, low);
+    QFuture<QByteArray> highDigits = QtConcurrent::run(convertIntegerDigits, mpz_srcptr(high), depth + 1);
+    QByteArray lowDigits = convertIntegerDigits(low, depth + 1);
+    QByteArray digits = highDigits.result();
+    digits.append(QByteArray(int(split) - lowDigits.size(), '0'));
+    digits.append(lowDigits);
+    mpz_clear(power);
+    mpz_clear(high);
+    mpz_clear(low);
+    return digits;
+}
+
+QByteArray QGen::integerDigits(const gen &g)
+{
+    Q_ASSERT(g.type == _ZINT);
+    const void *key = g._ZINTptr;
+    QMutexLocker locker(&integerDigitsCacheMutex);
+    IntegerDigits *cached = integerDigitsCache.object(key);
+    // the address may have been reused by another number since the entry was made
+    if (cached != Q_NULLPTR && mpz_cmp(cached->number, *g._ZINTptr) == 0)
+        return cached->digits;
+    locker.unlock();
+    IntegerDigits *entry = new IntegerDigits(*g._ZINTptr);
+    entry->digits = convertIntegerDigits(*g._ZINTptr, 0);
+    QByteArray digits = entry->digits;
+    locker.relock();
+    integerDigitsCache.insert(key, entry, digits.size() / 1024 + 1);
+    return digits;
+}
+
+// Digits are grouped by three around the decimal point and the groups are packed into lines
+// no wider than the viewport. When the viewport limits the layout, only the first and last
+// lines which fit are laid out and the middle is replaced by an elision marker. The pen point
+// is left at the end of the last line.
+void QGen::renderDigitLines(RenderContext &rc, Display &dest, const QString &digits, QPointF &penPoint)
+{
+    int point = digits.indexOf('.');
+    int integerEnd = point < 0 ? digits.length() : point + 1;
+    QVector<int> groupStarts;
+    groupStarts.append(0);
+    int first = (point < 0 ? integerEnd : point) % 3;
+    for (int i = first == 0 ? 3 : first; i < (point < 0 ? integerEnd : point); i += 3)
+        groupStarts.append(i);
+    for (int i = integerEnd; i < digits.length(); i += 3)
+        groupStarts.append(i);
+    groupStarts.append(digits.length());
+    FontMetricsTable &metrics = rc.fontMetrics();
+    qreal budget = rc.viewport().isValid() ? rc.viewport().width() : defaultNumberLineWidth;
+    qreal digitWidth = metrics.advance('0'), space = metrics.width(MathGlyphs::thinSpace());
+    QVector<int> lineStarts;
+    qreal lineWidth = 0.0;
+    for (int group = 0; group + 1 < groupStarts.size(); ++group)
+    {
+        qreal groupWidth = (groupStarts.at(group + 1) - groupStarts.at(group)) * digitWidth;
+        if (lineStarts.isEmpty() || lineWidth + space + groupWidth > budget)
+        {
+            lineStarts.append(group);
+            lineWidth = groupWidth;
+        }
+        else
+            lineWidth += space + groupWidth;
+    }
+    int lineCount = lineStarts.size();
+    lineStarts.append(groupStarts.size() - 1);
+    qreal lineSkip = fontHeight(rc) + fontLeading(rc);
+    int head = lineCount, tail = 0;
+    if (rc.viewport().isValid())
+    {
+        int fit = qMax(3, int(rc.viewport().height() / lineSkip));
+        if (lineCount > fit)
+        {
+            head = (fit - 1) / 2;
+            tail = fit - 1 - head;
+        }
+    }
+    QPointF lineStart(penPoint);
+    for (int line = 0; line < lineCount; ++line)
+    {
+        if (line == head && line < lineCount - tail)
+        {
+            int elided = groupStarts.at(lineStarts.at(lineCount - tail)) - groupStarts.at(lineStarts.at(head));
+            penPoint = lineStart;
+            renderElisionMarker(rc, dest, MathGlyphs::midlineHorizontalEllipsis(), elided, penPoint);
+            movePenPointY(lineStart, lineSkip);
+            line = lineCount - tail - 1;
+            continue;
+        }
+        QStringList groups;
+        for (int group = lineStarts.at(line); group < lineStarts.at(line + 1); ++group)
+            groups << digits.mid(groupStarts.at(group), groupStarts.at(group + 1) - groupStarts.at(group));
+        penPoint = lineStart;
+        renderTextAndAdvance(rc, dest, groups.join(MathGlyphs::thinSpace()), penPoint);
+        if (line + 1 < lineCount)
+            movePenPointY(lineStart, lineSkip);
+    }
+}
+
+void QGen::renderComplexNumber(RenderContext &rc, Display &dest, const QGen &realPart, const QGen &imaginaryPart, QPointF where)
 {
     QPointF penPoint(where);
-    Display realPartDisplay = renderNormal(realPart);
-    QGen imAbs = (imaginaryPart.isNegativeConstant() ? QGen(-imaginaryPart.expression(), ct) : imaginaryPart);
-    Display imAbsDisplay = renderNormal(imAbs);
+    Display realPartDisplay = renderNormal(rc, realPart);
+    QGen imAbs = (imaginaryPart.isNegativeConstant() ? QGen(negatedConstant(imaginaryPart.expression()), rc.giacContext()) : imaginaryPart);
+    Display imAbsDisplay = renderNormal(rc, imAbs);
     renderDisplayAndAdvance(dest, realPartDisplay, penPoint);
     QChar operatorChar = imaginaryPart.isNegativeConstant() ? MathGlyphs::minus() : '+';
-    renderTextAndAdvance(dest, paddedText(operatorChar), penPoint);
+    renderTextAndAdvance(rc, dest, paddedText(operatorChar), penPoint);
     renderDisplayAndAdvance(dest, imAbsDisplay, penPoint);
     QString imaginaryUnit("i");
     imaginaryUnit.prepend(MathGlyphs::thinSpace());
-    renderText(dest, imaginaryUnit, 0, penPoint);
+    renderText(rc, dest, imaginaryUnit, 0, penPoint);
     dest.setPriority(QGen::AdditionPriority);
 }
 
-void QGen::renderIdentifier(Display &dest, const QGen &g, QPointF where)
+void QGen::renderIdentifier(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     Q_ASSERT(g.isIdentifier());
     QString text, symbol, index;
@@ -954,7 +1757,7 @@ void QGen::renderIdentifier(Display &dest, const QGen &g, QPointF where)
     else if (g.isUndefIdentifier())
         symbol = "undefined";
     else if ((text = g.toString()).startsWith("_"))
-        renderLeadingUnderscoreIdentifier(dest, g, where);
+        renderLeadingUnderscoreIdentifier(rc, dest, g, where);
     else
     {
         bool italic = !(g.isPi() || g.isEulerNumber() || g.isEulerMascheroniConstant() || g.isImaginaryUnit());
@@ -979,10 +1782,10 @@ void QGen::renderIdentifier(Display &dest, const QGen &g, QPointF where)
         if (index.length() > 0)
             symbol.append(MathGlyphs::digitsToSubscript(index));
     }
-    renderText(dest, symbol, 0, where);
+    renderText(rc, dest, symbol, 0, where);
 }
 
-void QGen::renderLeadingUnderscoreIdentifier(Display &dest, const QGen &g, QPointF where)
+void QGen::renderLeadingUnderscoreIdentifier(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     QString text = g.toString(), subscript;
     bool italic = true;
@@ -1004,7 +1807,7 @@ void QGen::renderLeadingUnderscoreIdentifier(Display &dest, const QGen &g, QPoin
         else if (text == "hbar")
         {
             text = MathGlyphs::smallLetterHWithStroke();
-            setRenderingItalic(true);
+            rc.setItalic(true);
         }
         else if (text == "me")
             text = QString("m") + MathGlyphs::subscriptSmallLetterE();
@@ -1085,66 +1888,50 @@ void QGen::renderLeadingUnderscoreIdentifier(Display &dest, const QGen &g, QPoin
     }
     QPointF penPoint(where);
     QString symbol = identifierStringToUnicode(text, false, italic);
-    renderTextAndAdvance(dest, symbol, penPoint);
-    setRenderingItalic(false);
+    renderTextAndAdvance(rc, dest, symbol, penPoint);
+    rc.setItalic(false);
     if (subscript.length() > 0)
     {
-        movePenPointY(penPoint, fontXHeight(-1));
-        renderText(dest, subscript, -1, penPoint);
+        movePenPointY(penPoint, fontXHeight(rc, -1));
+        renderText(rc, dest, subscript, -1, penPoint);
     }
 }
 
-void QGen::renderModular(Display &dest, const QGen &g, QPointF where)
+void QGen::renderModular(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     QGen value, modulus;
     Q_ASSERT(g.isModular(value, modulus));
-    Display valueDisplay = renderNormal(value), modulusDisplay = renderNormal(modulus), display;
+    Display valueDisplay = renderNormal(rc, value), modulusDisplay = renderNormal(rc, modulus), display;
     QPointF penPoint(0, 0);
-    renderTextAndAdvance(display, "mod ", penPoint);
+    renderTextAndAdvance(rc, display, "mod ", penPoint);
     renderDisplayAndAdvance(display, modulusDisplay, penPoint);
     penPoint = where;
     int priority = QGen::ModularPriority;
-    qreal advance = renderDisplayWithPriority(dest, valueDisplay, priority, penPoint) + textWidth(" ");
+    qreal advance = renderDisplayWithPriority(rc, dest, valueDisplay, priority, penPoint) + textWidth(rc, " ");
     movePenPointX(penPoint, advance);
-    renderDisplayWithParentheses(dest, display, penPoint);
+    renderDisplayWithParentheses(rc, dest, display, penPoint);
     dest.setPriority(priority);
 }
 
-void QGen::renderUnary(Display &dest, const QGen &g, QPointF where)
+void QGen::renderUnary(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     QPointF penPoint(where);
-    QString prefix;
     QGen argument = g.unaryFunctionArgument();
     Display argumentDisplay;
-    int priority = g.operatorPriority();
+    OperatorInfo info;
+    g.findOperatorInfo(info);
+    int priority = info.priority;
     if (priority == QGen::UnaryPriority || priority == QGen::AdditionPriority)
     {
-        if (g.isMinusOperator())
-            prefix = MathGlyphs::minus();
-        else if (g.isNegationOperator())
-            prefix = MathGlyphs::notSign();
-        else if (g.isIncrementOperator())
-            prefix = "++";
-        else if (g.isDecrementOperator())
-            prefix = "--";
-        else
-        {
-            if (g.isRealPartOperator())
-                prefix = MathGlyphs::letterToMath('R', MathGlyphs::Fraktur, false, false);
-            else if (g.isImaginaryPartOperator())
-                prefix = MathGlyphs::letterToMath('I', MathGlyphs::Fraktur, false, false);
-            else if (g.isTraceOperator())
-                prefix = "tr";
-            else Q_ASSERT(false); // unreachanble
-            prefix.append(MathGlyphs::functionApplicationSpace());
-        }
-        renderTextAndAdvance(dest, prefix, penPoint);
-        argumentDisplay = renderNormal(argument);
-        renderDisplayWithPriority(dest, argumentDisplay, priority, penPoint);
+        renderTextAndAdvance(rc, dest, info.glyph, penPoint);
+        argumentDisplay = renderNormal(rc, argument);
+        renderDisplayWithPriority(rc, dest, argumentDisplay, priority, penPoint);
     }
     else if (g.isReciprocalOperator())
     {
-
+        renderFraction(rc, dest, QGen(1, rc.giacContext()), argument, penPoint);
+        dest.setPriority(QGen::DivisionPriority);
+        dest.setGrouped(true);
     }
     else if (g.isDerivativeOperator(true))
     {
@@ -1152,10 +1939,10 @@ void QGen::renderUnary(Display &dest, const QGen &g, QPointF where)
         while (argument.isDerivativeOperator(true))
         {
             ++degree;
-            argument = g.unaryFunctionArgument();
+            argument = argument.unaryFunctionArgument();
         }
-        argumentDisplay = renderNormal(argument);
-        movePenPointX(penPoint, renderDisplayWithPriority(dest, argumentDisplay, priority, penPoint));
+        argumentDisplay = renderNormal(rc, argument);
+        movePenPointX(penPoint, renderDisplayWithPriority(rc, dest, argumentDisplay, priority, penPoint));
         QString suffix;
         switch (degree)
         {
@@ -1173,266 +1960,527 @@ void QGen::renderUnary(Display &dest, const QGen &g, QPointF where)
             suffix.prepend(MathGlyphs::superscriptLeftParenthesis());
             suffix.append(MathGlyphs::superscriptRightParenthesis());
         }
-        qreal yOffset = qMax(0.0, argumentDisplay.ascent() - fontAscent());
+        qreal yOffset = qMax(0.0, argumentDisplay.ascent() - fontAscent(rc));
         movePenPointY(penPoint, -yOffset);
-        renderText(dest, suffix, 0, penPoint);
+        renderText(rc, dest, suffix, 0, penPoint);
     }
     else if (priority == QGen::ExponentiationPriority)
     {
-        argumentDisplay = renderNormal(argument);
+        argumentDisplay = renderNormal(rc, argument);
         Display operatorDisplay;
         if (g.isTranspositionOperator() || g.isFactorialOperator())
         {
-            movePenPointX(penPoint, renderDisplayWithPriority(dest, argumentDisplay, priority, penPoint));
+            movePenPointX(penPoint, renderDisplayWithPriority(rc, dest, argumentDisplay, priority, penPoint));
             if (g.isTranspositionOperator())
             {
-                renderText(operatorDisplay, "T", -1, penPoint);
-                qreal yOffset = fontXHeight() + qMax(0.0, argumentDisplay.ascent() - fontAscent());
+                renderText(rc, operatorDisplay, "T", -1, penPoint);
+                qreal yOffset = fontXHeight(rc) + qMax(0.0, argumentDisplay.ascent() - fontAscent(rc));
                 movePenPointY(penPoint, -yOffset);
                 renderDisplay(dest, operatorDisplay, penPoint);
             }
             else if (g.isFactorialOperator())
-                renderText(dest, "!", 0, penPoint);
+                renderText(rc, dest, "!", 0, penPoint);
         }
         else if (g.isComplexConjugateOperator())
-            renderDisplayWithAccent(dest, argumentDisplay, AccentType::Bar, penPoint);
+            renderDisplayWithAccent(rc, dest, argumentDisplay, AccentType::Bar, penPoint);
         else Q_ASSERT(false); // unreachanble
     }
     dest.setPriority(priority);
 }
 
-void QGen::renderBinary(Display &dest, const QGen &g, QPointF where)
+void QGen::renderBinary(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     QPointF penPoint(where);
-    int priority = g.operatorPriority(), rightVerticalPosition = 0;
+    OperatorInfo info;
+    g.findOperatorInfo(info);
+    int priority = info.priority, rightVerticalPosition = 0;
     QGen left = g.firstOperand();
     QGen right = g.secondOperand();
-    QChar op;
-    bool hasConstant, withCircle;
-    if (g.isPowerOperator() || (withCircle = g.isHadamardPowerOperator() || g.isFunctionalPowerOperator()))
+    QString op = info.glyph;
+    bool hasConstant = false, withCircle = g.isHadamardPowerOperator() || g.isFunctionalPowerOperator();
+    if (g.isPowerOperator() || withCircle)
         rightVerticalPosition = 1;
-    else if (g.isEquation())
-        op = '=';
-    else if (g.isEqualOperator())
-        op = MathGlyphs::questionedEqualTo();
-    else if (g.isElementOperator())
-        op = MathGlyphs::elementOf();
-    else if (g.isNotEqualOperator())
-        op = MathGlyphs::notEqualTo();
-    else if (g.isLessThanOperator())
-        op = '<';
-    else if (g.isGreaterThanOperator())
-        op = '>';
-    else if (g.isLessThanOrEqualOperator())
-        op = MathGlyphs::lessThanOrEqualTo();
-    else if (g.isGreaterThanOrEqualOperator())
-        op = MathGlyphs::greaterThanOrEqualTo();
-    else if (g.isAssignmentOperator())
-        op = MathGlyphs::equalToByDefinition();
-    else if (g.isArrayAssignmentOperator())
-        op = MathGlyphs::leftwardsArrow();
-    else if (g.isCrossProductOperator())
-        op = MathGlyphs::vectorOrCrossProduct();
-    else if (g.isSetDifferenceOperator())
-        op = MathGlyphs::setMinus();
-    else if (g.isHadamardDivisionOperator())
-        op = MathGlyphs::circledDivisionSlash();
-    else if (g.isHadamardDifferenceOperator())
-        op = MathGlyphs::minus();
-    else if (g.isUnitApplicationOperator(hasConstant))
-        op = hasConstant ? MathGlyphs::multiplicationDot() : MathGlyphs::thickSpace();
-    else if (g.isIntervalOperator())
-        op = MathGlyphs::twoDotLeader();
-    else if (g.isFunctionApplicationOperator())
-        op = MathGlyphs::functionApplicationSpace();
     else if (g.isAtOperator())
-    {
-        right = g.unaryFunctionArgument();
-        left = right.vectorPopFront();
         rightVerticalPosition = -1;
-    }
     else if (g.isMappingOperator())
-    {
-        int n = 0;
-        while (n < g.operandCount() && !g.nthOperand(n).isZero())
-            n++;
-        left = g.unaryFunctionArgument();
-        left.resizeVector(n);
-        if (left.length() == 1)
-            left = g.firstOperand();
         right = g.lastOperand();
-    }
-    else
-        Q_ASSERT(false); // unreachable
+    else if (g.isUnitApplicationOperator(hasConstant) && hasConstant)
+        op = MathGlyphs::multiplicationDot();
     switch (rightVerticalPosition)
     {
     case 0:
-        movePenPointX(penPoint, renderDisplayWithPriority(dest, renderNormal(left), priority, penPoint));
-        renderTextAndAdvance(dest, paddedText(op), penPoint);
-        renderDisplayWithPriority(dest, renderNormal(right), priority, penPoint);
+        movePenPointX(penPoint, renderDisplayWithPriority(rc, dest, renderNormal(rc, left), priority, penPoint));
+        renderTextAndAdvance(rc, dest, paddedText(op), penPoint);
+        renderDisplayWithPriority(rc, dest, renderNormal(rc, right), priority, penPoint);
         break;
     case -1:
-        renderSubscript(dest, left, right, priority, penPoint);
+        renderSubscript(rc, dest, left, right, priority, penPoint);
         break;
     case 1:
-        renderSuperscript(dest, left, right, priority, penPoint, withCircle);
+        renderSuperscript(rc, dest, left, right, priority, penPoint, withCircle);
         break;
     }
     dest.setPriority(priority);
 }
 
-void QGen::renderAssociative(Display &dest, const QGen &g, const QVector<QGen> &operands, QPointF where)
+void QGen::renderAssociative(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
-    QString op;
-    int priority = g.operatorPriority();
-    if (g.isSumOperator() || g.isHadamardSumOperator())
-        op = "+";
-    else if (g.isProductOperator() || g.isAmpersandProductOperator())
-        op = MathGlyphs::multiplicationDot();
-    else if (g.isComposeOperator() || g.isHadamardProductOperator())
-        op = MathGlyphs::ringOperator();
-    else if (g.isUnionOperator())
-        op = MathGlyphs::setUnion();
-    else if (g.isIntersectionOperator())
-        op = MathGlyphs::setIntersection();
-    else if (g.isConjunctionOperator())
-        op = MathGlyphs::logicalAnd();
-    else if (g.isDisjunctionOperator())
-        op = MathGlyphs::logicalOr();
-    else if (g.isExclusiveOrOperator())
-        op = MathGlyphs::logicalXor();
-    else if (g.isBitwiseAndOperator())
-        op = "&";
-    else if (g.isBitwiseOrOperator())
-        op = "|";
-    else if (g.isBitwiseXorOperator())
-        op = "XOR";
-    else
-        Q_ASSERT(false); // unreachable
-    QVector<QGen>::const_iterator it;
-    QList<Display> renderedOperands, renderedIdentifiers, renderedNumbers;
+    OperatorInfo info;
+    g.findOperatorInfo(info);
+    int priority = info.priority;
+    QString op = info.glyph;
+    // giac stores x/y as x*inv(y), such products are laid out as fractions
+    QGen numerator, denominator;
+    if (g.isProductOperator() && g.isRationalExpression(numerator, denominator))
+    {
+        renderFraction(rc, dest, numerator, denominator, where);
+        dest.setPriority(QGen::DivisionPriority);
+        dest.setGrouped(true);
+        return;
+    }
+    QVector<QGenView> operands;
+    flattenOperands(g.view(), operands);
+    // operands are ordered first (positive terms before negative ones, numbers and identifiers
+    // before other factors) and rendered afterwards, so that in lazy mode only the terms which
+    // fit into the viewport are laid out
+    QVector<QGenView>::const_iterator it;
+    QVector<QGenView> orderedOperands, identifiers, numbers, negatives;
     for (it = operands.begin(); it != operands.end(); ++it)
     {
-        const QGen &operand = *it;
-        Display display;
-        if (g.isSumOperator())
+        QGen operand(*it);
+        if (g.isSumOperator() && operand.isPrecededByMinus())
+            negatives.append(*it);
+        else if (g.isProductOperator() && operand.isRealConstant())
+            numbers.append(*it);
+        else if (g.isProductOperator() && operand.isIdentifier())
+            identifiers.append(*it);
+        else
+            orderedOperands.append(*it);
+    }
+    orderedOperands = numbers + identifiers + orderedOperands + negatives;
+    int count = orderedOperands.size(), materialized = 0;
+    bool lazy = rc.isLazy(count);
+    // at the root, each term is laid out on its own (an operand with the operator preceding it)
+    // and the terms are packed into lines afterwards
+    qreal lineWidth = rc.nestingDepth() == 1 ? rc.maximumLineWidth() : 0.0;
+    bool breaking = lineWidth > 0.0, filled = false;
+    LinePacker packer(lineWidth, 2.0 * textWidth(rc, MathGlyphs::emQuadSpace()), fontLeading(rc) + linePadding(rc));
+    QVector<Display> terms;
+    QPointF penPoint(where);
+    QString padded = paddedText(op), minus = paddedText(MathGlyphs::minus());
+    while (materialized < count && !filled)
+    {
+        Display term;
+        QPointF termPenPoint(0.0, 0.0);
+        Display &target = breaking ? term : dest;
+        QPointF &pen = breaking ? termPenPoint : penPoint;
+        QGen operand(orderedOperands.at(materialized));
+        if (g.isSumOperator() && operand.isPrecededByMinus())
         {
-            //display = renderNormal(operand.isPrecededByMinus() ? -operand : operand);
-            if (operand.isPrecededByMinus())
-            {
-                display.requireMinusSign(true);
-                renderedOperands.append(display);
-            }
-            else renderedOperands.prepend(display);
+            QGen negated = operand.isMinusOperator() ? operand.unaryFunctionArgument() : QGen(negatedConstant(operand.expression()), rc.giacContext());
+            renderTextAndAdvance(rc, target, materialized > 0 ? minus : QString(MathGlyphs::minus()), pen);
+            movePenPointX(pen, renderDisplayWithPriority(rc, target, renderNormal(rc, negated), priority, pen));
         }
-        else if (g.isProductOperator())
+        else
         {
-            display = renderNormal(operand);
-            if (operand.isRealConstant())
-                renderedNumbers.append(display);
-            else if (operand.isIdentifier())
-            {
-                display.linkWithExpression(operand);
-                renderedIdentifiers.append(display);
-            }
-            else
-                renderedOperands.append(display);
+            if (materialized > 0)
+                renderTextAndAdvance(rc, target, padded, pen);
+            movePenPointX(pen, renderDisplayWithPriority(rc, target, renderNormal(rc, operand), priority, pen));
+        }
+        if (breaking)
+        {
+            packer.add(term);
+            terms.append(term);
         }
-        else renderedOperands.append(renderNormal(operand));
+        ++materialized;
+        if (lazy)
+            filled = breaking ? packer.height() > rc.viewport().height() : penPoint.x() - where.x() > rc.viewport().width();
     }
-    QPointF penPoint(where);
-    op = paddedText(op);
-
+    if (materialized < count)
+    {
+        Display term;
+        QPointF termPenPoint(0.0, 0.0);
+        Display &target = breaking ? term : dest;
+        QPointF &pen = breaking ? termPenPoint : penPoint;
+        renderTextAndAdvance(rc, target, padded, pen);
+        renderElisionMarker(rc, target, MathGlyphs::midlineHorizontalEllipsis(), count - materialized, pen);
+        if (breaking)
+            terms.append(term);
+    }
+    if (breaking)
+        renderLines(rc, dest, terms, lineWidth, where);
     dest.setPriority(priority);
 }
 
-void QGen::renderFraction(Display &dest, const QGen &numerator, const QGen &denominator, QPointF where)
+void QGen::renderFraction(RenderContext &rc, Display &dest, const QGen &numerator, const QGen &denominator, QPointF where)
 {
     QPointF penPoint(where);
-    Display numeratorDisplay = renderNormal(numerator);
-    Display denominatorDisplay = renderNormal(denominator);
+    Display numeratorDisplay = renderNormal(rc, numerator);
+    Display denominatorDisplay = renderNormal(rc, denominator);
     qreal width = qMax(numeratorDisplay.width(), denominatorDisplay.width());
-    qreal padding = fontLeading() + 0.5;
-    movePenPointY(penPoint, -fontMidLine() + 0.5);
-    renderHorizontalLine(dest, penPoint, width);
+    qreal padding = fontLeading(rc) + 0.5;
+    movePenPointY(penPoint, -fontMidLine(rc) + 0.5);
+    renderHorizontalLine(rc, dest, penPoint, width);
     QPointF numeratorPenPoint(penPoint), denominatorPenPoint(penPoint);
     movePenPointX(numeratorPenPoint, numeratorDisplay.leftBearing() + (width - numeratorDisplay.width()) / 2.0);
     movePenPointY(numeratorPenPoint, -(padding + numeratorDisplay.descent()));
-    renderDisplay(dest, numeratorDisplay, penPoint);
+    renderDisplay(dest, numeratorDisplay, numeratorPenPoint);
     movePenPointX(denominatorPenPoint, denominatorDisplay.leftBearing() + (width - denominatorDisplay.width()) / 2.0);
     movePenPointY(denominatorPenPoint, padding + denominatorDisplay.ascent());
-    renderDisplay(dest, denominatorDisplay, penPoint);
+    renderDisplay(dest, denominatorDisplay, denominatorPenPoint);
 }
 
-void QGen::renderSuperscript(Display &dest, const QGen &base, const QGen &exponent,
-                                     int priority, QPointF where, bool withCircle)
+void QGen::renderSuperscript(RenderContext &rc, Display &dest, const QGen &base, const QGen &exponent,
+                             int priority, QPointF where, bool withCircle)
 {
     QPointF penPoint(where);
     Display baseDisplay, exponentDisplay;
-    baseDisplay = renderNormal(base);
-    exponentDisplay = renderSmaller(exponent);
-    movePenPointX(penPoint, renderDisplayWithPriority(dest, baseDisplay, priority, penPoint));
-    qreal verticalOffset = qMax(0.0, baseDisplay.ascent() - fontAscent());
-    movePenPointXY(penPoint, exponentDisplay.leftBearing(), -(fontXHeight() + verticalOffset));
+    baseDisplay = renderNormal(rc, base);
+    exponentDisplay = renderSmaller(rc, exponent);
+    movePenPointX(penPoint, renderDisplayWithPriority(rc, dest, baseDisplay, priority, penPoint));
+    qreal verticalOffset = qMax(0.0, baseDisplay.ascent() - fontAscent(rc));
+    movePenPointXY(penPoint, exponentDisplay.leftBearing(), -(fontXHeight(rc) + verticalOffset));
     if (withCircle)
-        movePenPointX(penPoint, renderText(dest, MathGlyphs::ringOperator(), -1, penPoint));
+        movePenPointX(penPoint, renderText(rc, dest, MathGlyphs::ringOperator(), -1, penPoint));
     renderDisplay(dest, exponentDisplay, penPoint);
 }
 
-void QGen::renderSubscript(Display &dest, const QGen &base, const QGen &subscript, int priority, QPointF where)
+void QGen::renderSubscript(RenderContext &rc, Display &dest, const QGen &base, const QGen &subscript, int priority, QPointF where)
 {
     QPointF penPoint(where);
     Display baseDisplay, subscriptDisplay;
-    baseDisplay = renderNormal(base);
-    subscriptDisplay = renderSmaller(subscript);
-    movePenPointX(penPoint, renderDisplayWithPriority(dest, baseDisplay, priority, penPoint));
-    qreal verticalOffset = qMax(0.0, baseDisplay.descent() - fontDescent());
-    movePenPointXY(penPoint, subscriptDisplay.leftBearing(), fontXHeight(-1) + verticalOffset);
+    baseDisplay = renderNormal(rc, base);
+    subscriptDisplay = renderSmaller(rc, subscript);
+    movePenPointX(penPoint, renderDisplayWithPriority(rc, dest, baseDisplay, priority, penPoint));
+    qreal verticalOffset = qMax(0.0, baseDisplay.descent() - fontDescent(rc));
+    movePenPointXY(penPoint, subscriptDisplay.leftBearing(), fontXHeight(rc, -1) + verticalOffset);
     renderDisplay(dest, subscriptDisplay, penPoint);
 }
 
-void QGen::renderDisplayWithRadical(Display &dest, const Display &source, QPointF where)
+void QGen::renderDisplayWithRadical(RenderContext &rc, Display &dest, const Display &source, QPointF where)
 {
-    QRectF rect = textTightBoundingRect(MathGlyphs::squareRoot());
+    QRectF rect = textTightBoundingRect(rc, MathGlyphs::squareRoot());
     qreal rWidth = rect.width(), rHeight = rect.height(), rDescent = rect.y() + rHeight, rBearing = -rect.x();
-    qreal radicandWidth = source.totalWidth() + linePadding();
-    qreal radicandHeight = qMax(source.height() + linePadding(), rHeight);
-    qreal fY = qMax(1.0, (radicandHeight + lineWidth() / 3) / rHeight), fX = 1.0;
-    renderDisplay(dest, source, QPointF(where.x() + rWidth * fX + source.leftBearing() + linePadding(), where.y()));
-    QPainter painter(&dest);
-    painter.setFont(getFont(fontSizeLevel()));
-    renderHorizontalLine(painter, rWidth * fX - lineWidth() / 3, radicandHeight - source.descent(), radicandWidth);
+    qreal radicandWidth = source.totalWidth() + linePadding(rc);
+    qreal radicandHeight = qMax(source.height() + linePadding(rc), rHeight);
+    qreal fY = qMax(1.0, (radicandHeight + lineWidth(rc) / 3) / rHeight), fX = 1.0;
+    renderDisplay(dest, source, QPointF(where.x() + rWidth * fX + source.leftBearing() + linePadding(rc), where.y()));
+    LayoutPainter painter(&dest);
+    painter.setFont(rc.fontMetrics());
+    renderHorizontalLine(rc, painter, rWidth * fX - lineWidth(rc) / 3, radicandHeight - source.descent(), radicandWidth);
     painter.translate(where.x(), where.y() + source.descent());
     painter.scale(fX, fY);
     painter.drawText(QPointF(rBearing, -rDescent), MathGlyphs::squareRoot());
 }
 
-void QGen::renderMap(Display &dest, const QGen &g, QPointF where)
+void QGen::renderMap(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
     Q_ASSERT(g.isMap());
-    gen_map &map = *g.expression()._MAPptr;
-    vecteur sequence;
-    gen_map::const_iterator it;
-    for (it = map.begin(); it != map.end(); ++it)
-        sequence.push_back(symbolic(at_equal, it->first, it->second));
-    renderVector(dest, QGen(sequence, ct).toSequenceVector(), where);
+    // entries are visited once, in batches, and laid out as a sequence of equations; maps with
+    // more than mapEntryLimit() entries, or which overflow the viewport in lazy mode, are elided
+    int count = g.mapEntriesCount(), materialized = 0;
+    int limit = rc.mapEntryLimit() > 0 ? qMin(count, rc.mapEntryLimit()) : count;
+    bool lazy = rc.isLazy(count);
+    Display display;
+    QPointF penPoint(0, 0);
+    QString separator = paddedText(",", Medium, false, true), equals = paddedText("=");
+    MapEntryIterator it(g);
+    while (materialized < limit && !(lazy && penPoint.x() > rc.viewport().width()))
+    {
+        int batchSize = lazy ? qMin(lazyRenderingBatchSize, limit - materialized) : limit - materialized;
+        QVector<gen*> entries;
+        entries.reserve(2 * batchSize);
+        for (int i = 0; i < batchSize; ++i)
+        {
+            it.next();
+            entries.append(const_cast<gen*>(&it.key().expression()));
+            entries.append(const_cast<gen*>(&it.value().expression()));
+        }
+        QVector<Display> displays = renderEntries(rc, entries);
+        for (int i = 0; i + 1 < displays.size() && !(lazy && penPoint.x() > rc.viewport().width()); i += 2)
+        {
+            if (materialized++ > 0)
+                renderTextAndAdvance(rc, display, separator, penPoint);
+            movePenPointX(penPoint, renderDisplayWithPriority(rc, display, displays.at(i), EquationPriority, penPoint));
+            renderTextAndAdvance(rc, display, equals, penPoint);
+            movePenPointX(penPoint, renderDisplayWithPriority(rc, display, displays.at(i + 1), EquationPriority, penPoint));
+        }
+    }
+    if (materialized < count)
+    {
+        if (materialized > 0)
+            renderTextAndAdvance(rc, display, separator, penPoint);
+        renderElisionMarker(rc, display, MathGlyphs::midlineHorizontalEllipsis(), count - materialized, penPoint);
+    }
+    renderDisplay(dest, display, where);
+    dest.setPriority(CommaPriority);
+}
+
+// Entries of vectors, matrices and maps are laid out independently of each other, so long
+// vectors are split into chunks which are rendered on the global thread pool. Each chunk gets
+// its own copy of the render context, which shares the font tables with the original. The
+// chunks only read the render cache; what they lay out is cached here, once they are joined.
+QVector<QGen::Display> QGen::renderEntries(RenderContext &rc, const QVector<gen*> &entries)
+{
+    int count = entries.size();
+    int threadCount = QThreadPool::globalInstance()->maxThreadCount();
+    QVector<Display> displays(count);
+    if (count < parallelRenderingThreshold || threadCount < 2)
+    {
+        for (int i = 0; i < count; ++i)
+            displays[i] = renderNormal(rc, QGen(entries.at(i), rc.giacContext()));
+        return displays;
+    }
+    int chunkSize = qMax(16, count / (4 * threadCount));
+    QVector<RenderChunk> chunks;
+    for (int begin = 0; begin < count; begin += chunkSize)
+    {
+        RenderChunk chunk;
+        chunk.context = &rc;
+        chunk.entries = entries.constData();
+        chunk.displays = displays.data();
+        chunk.begin = begin;
+        chunk.end = qMin(begin + chunkSize, count);
+        chunks.append(chunk);
+    }
+    QtConcurrent::blockingMap(chunks, renderChunk);
+    QVector<const gen*> roots;
+    roots.reserve(count);
+    for (int i = 0; i < count; ++i)
+        roots.append(entries.at(i));
+    for (int i = 0; i < chunks.size(); ++i)
+        chunks[i].pendingCache.commit(roots);
+    return displays;
+}
+
+void QGen::renderChunk(RenderChunk &chunk)
+{
+    RenderContext rc(*chunk.context);
+    chunk.pendingCache.beginCollecting();
+    for (int i = chunk.begin; i < chunk.end; ++i)
+        chunk.displays[i] = renderNormal(rc, QGen(chunk.entries[i], rc.giacContext()));
+    chunk.pendingCache.endCollecting();
 }
 
-void QGen::renderVector(Display &dest, const QGen &g, QPointF where)
+void QGen::renderVector(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
 {
+    Q_ASSERT(g.isVector());
+    vecteur &elements = *g.expression()._VECTptr;
+    if (!elements.empty() && g.isMatrix())
+    {
+        renderMatrix(rc, dest, g, where);
+        return;
+    }
+    if (elements.empty() && g.isSetVector())
+    {
+        renderText(rc, dest, MathGlyphs::emptySet(), 0, where);
+        return;
+    }
+    // in lazy mode, entries are laid out in small batches until the viewport width is filled
+    int count = int(elements.size()), materialized = 0;
+    bool lazy = rc.isLazy(count);
+    // sequences at the root are broken into lines after a separator, each entry is a term
+    qreal lineWidth = g.isSequenceVector() && rc.nestingDepth() == 1 ? rc.maximumLineWidth() : 0.0;
+    LinePacker packer(lineWidth, 2.0 * textWidth(rc, MathGlyphs::emQuadSpace()), fontLeading(rc) + linePadding(rc));
+    QVector<Display> terms;
+    Display display;
+    QPointF penPoint(0, 0);
+    QString separator = paddedText(",", Medium, false, true);
+    iterateur it = elements.begin();
+    bool filled = false;
+    while (materialized < count && !filled)
+    {
+        int batchSize = lazy ? qMin(lazyRenderingBatchSize, count - materialized) : count;
+        QVector<gen*> entries;
+        entries.reserve(batchSize);
+        for (int i = 0; i < batchSize; ++i, ++it)
+            entries.append(&(*it));
+        QVector<Display> displays = renderEntries(rc, entries);
+        for (int i = 0; i < displays.size() && !filled; ++i)
+        {
+            if (lineWidth > 0.0)
+            {
+                Display term;
+                QPointF termPenPoint(0, 0);
+                renderDisplayAndAdvance(term, displays.at(i), termPenPoint);
+                if (materialized + 1 < count)
+                    renderTextAndAdvance(rc, term, separator, termPenPoint);
+                packer.add(term);
+                terms.append(term);
+                ++materialized;
+                filled = lazy && packer.height() > rc.viewport().height();
+                continue;
+            }
+            if (materialized++ > 0)
+                renderTextAndAdvance(rc, display, separator, penPoint);
+            renderDisplayAndAdvance(display, displays.at(i), penPoint);
+            filled = lazy && penPoint.x() > rc.viewport().width();
+        }
+    }
+    if (materialized < count)
+    {
+        if (lineWidth > 0.0)
+        {
+            Display term;
+            QPointF termPenPoint(0, 0);
+            renderElisionMarker(rc, term, MathGlyphs::midlineHorizontalEllipsis(), count - materialized, termPenPoint);
+            terms.append(term);
+        }
+        else
+        {
+            renderTextAndAdvance(rc, display, separator, penPoint);
+            renderElisionMarker(rc, display, MathGlyphs::midlineHorizontalEllipsis(), count - materialized, penPoint);
+        }
+    }
+    if (lineWidth > 0.0)
+    {
+        renderLines(rc, dest, terms, lineWidth, where);
+        dest.setPriority(QGen::CommaPriority);
+    }
+    else if (g.isSequenceVector())
+    {
+        renderDisplay(dest, display, where);
+        dest.setPriority(QGen::CommaPriority);
+    }
+    else if (g.isSetVector())
+        renderDisplayWithCurlyBrackets(rc, dest, display, where);
+    else
+        renderDisplayWithSquareBrackets(rc, dest, display, where);
+}
 
+void QGen::renderMatrix(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
+{
+    vecteur &rows = *g.expression()._VECTptr;
+    int rowCount = int(rows.size()), columnCount = int(rows.front()._VECTptr->size());
+    qreal columnSpacing = textWidth(rc, MathGlyphs::emQuadSpace()), rowSpacing = fontLeading(rc) + linePadding(rc);
+    QVector<Display> displays;
+    int elidedCount = 0;
+    if (!rc.isLazy(rowCount * columnCount))
+    {
+        QVector<gen*> entries;
+        entries.reserve(rowCount * columnCount);
+        for (iterateur it = rows.begin(); it != rows.end(); ++it)
+        {
+            vecteur &row = *it->_VECTptr;
+            for (iterateur jt = row.begin(); jt != row.end(); ++jt)
+                entries.append(&(*jt));
+        }
+        displays = renderEntries(rc, entries);
+    }
+    else
+    {
+        // the first row decides how many columns fit into the viewport, then rows are added
+        // until the viewport height is filled; elided rows and columns are marked by ellipses
+        vecteur &firstRow = *rows.front()._VECTptr;
+        int visibleColumns = 0, visibleRows = 1;
+        qreal width = 0.0, height = 0.0;
+        while (visibleColumns < columnCount && width <= rc.viewport().width())
+        {
+            Display entry = renderNormal(rc, QGen(&firstRow[visibleColumns], rc.giacContext()));
+            width += entry.totalWidth() + columnSpacing;
+            height = qMax(height, entry.height());
+            displays.append(entry);
+            ++visibleColumns;
+        }
+        while (visibleRows < rowCount && height <= rc.viewport().height())
+        {
+            vecteur &row = *rows[visibleRows]._VECTptr;
+            QVector<gen*> entries;
+            entries.reserve(visibleColumns);
+            for (int j = 0; j < visibleColumns; ++j)
+                entries.append(&row[j]);
+            QVector<Display> rowDisplays = renderEntries(rc, entries);
+            qreal rowHeight = 0.0;
+            for (int j = 0; j < visibleColumns; ++j)
+            {
+                displays.append(rowDisplays.at(j));
+                rowHeight = qMax(rowHeight, rowDisplays.at(j).height());
+            }
+            height += rowHeight + rowSpacing;
+            ++visibleRows;
+        }
+        elidedCount = rowCount * columnCount - visibleRows * visibleColumns;
+        bool columnsElided = visibleColumns < columnCount, rowsElided = visibleRows < rowCount;
+        Display horizontalEllipsis, verticalEllipsis, diagonalEllipsis;
+        renderText(rc, horizontalEllipsis, MathGlyphs::midlineHorizontalEllipsis());
+        renderText(rc, verticalEllipsis, MathGlyphs::verticalEllipsis());
+        renderText(rc, diagonalEllipsis, MathGlyphs::downRightDiagonalEllipsis());
+        QVector<Display> grid;
+        for (int i = 0; i < visibleRows; ++i)
+        {
+            grid += displays.mid(i * visibleColumns, visibleColumns);
+            if (columnsElided)
+                grid.append(horizontalEllipsis);
+        }
+        for (int j = 0; rowsElided && j < visibleColumns; ++j)
+            grid.append(verticalEllipsis);
+        if (rowsElided && columnsElided)
+            grid.append(diagonalEllipsis);
+        displays = grid;
+        rowCount = visibleRows + (rowsElided ? 1 : 0);
+        columnCount = visibleColumns + (columnsElided ? 1 : 0);
+    }
+    QVector<qreal> columnWidths(columnCount, 0.0), rowAscents(rowCount, fontAscent(rc)), rowDescents(rowCount, fontDescent(rc));
+    for (int i = 0; i < rowCount; ++i)
+    {
+        for (int j = 0; j < columnCount; ++j)
+        {
+            const Display &entry = displays.at(i * columnCount + j);
+            columnWidths[j] = qMax(columnWidths.at(j), entry.totalWidth());
+            rowAscents[i] = qMax(rowAscents.at(i), entry.ascent());
+            rowDescents[i] = qMax(rowDescents.at(i), entry.descent());
+        }
+    }
+    qreal height = (rowCount - 1) * rowSpacing;
+    for (int i = 0; i < rowCount; ++i)
+        height += rowAscents.at(i) + rowDescents.at(i);
+    Display body;
+    qreal y = -fontMidLine(rc) - height / 2.0;
+    for (int i = 0; i < rowCount; ++i)
+    {
+        y += rowAscents.at(i);
+        qreal x = 0.0;
+        for (int j = 0; j < columnCount; ++j)
+        {
+            const Display &entry = displays.at(i * columnCount + j);
+            renderDisplay(body, entry, QPointF(x + entry.leftBearing() + (columnWidths.at(j) - entry.totalWidth()) / 2.0, y));
+            x += columnWidths.at(j) + columnSpacing;
+        }
+        y += rowDescents.at(i) + rowSpacing;
+    }
+    if (elidedCount == 0)
+    {
+        renderDisplayWithSquareBrackets(rc, dest, body, where);
+        return;
+    }
+    QPointF penPoint(where);
+    movePenPointX(penPoint, renderDisplayWithSquareBrackets(rc, dest, body, penPoint));
+    renderElisionMarker(rc, dest, QString(), elidedCount, penPoint);
 }
 
-void QGen::renderSymbolic(Display &dest, const QGen &g, QPointF where)
+void QGen::renderElisionMarker(RenderContext &rc, Display &dest, const QString &ellipsis, int elidedCount, QPointF &penPoint)
 {
+    if (!ellipsis.isEmpty())
+        renderTextAndAdvance(rc, dest, ellipsis, penPoint);
+    QString count = paddedText(QString("%1 more").arg(QLocale().toString(elidedCount)), Thin, true, false);
+    movePenPointX(penPoint, renderText(rc, dest, count, -1, penPoint));
+    dest.addElidedCount(elidedCount);
+}
 
+void QGen::renderSymbolic(RenderContext &rc, Display &dest, const QGen &g, QPointF where)
+{
+    OperatorInfo info;
+    if (g.findOperatorInfo(info) && info.handler != Q_NULLPTR)
+        info.handler(rc, dest, g, where);
+    else
+        renderText(rc, dest, g.toString(), 0, where);
 }
 
-void QGen::renderBracketExtensionFill(QPainter &painter, const QChar &extension,
-                                              qreal x, qreal yLower, qreal yUpper)
+void QGen::renderBracketExtensionFill(RenderContext &rc, LayoutPainter &painter, const QChar &extension,
+                                      qreal x, qreal yLower, qreal yUpper)
 {
     painter.save();
-    QRectF rect = textTightBoundingRect(extension);
+    QRectF rect = textTightBoundingRect(rc, extension);
     qreal offset = rect.y() + rect.height(), y = yLower, skip = rect.height() - 2;
     int n = qFloor(qAbs(yUpper - yLower) / skip);
     for (int i = 0; i < n; ++i)
@@ -1449,38 +2497,38 @@ void QGen::renderBracketExtensionFill(QPainter &painter, const QChar &extension,
     painter.restore();
 }
 
-qreal QGen::renderSingleBracket(QPainter &painter, qreal x, qreal halfHeight, QChar bracket, bool scaleX)
+qreal QGen::renderSingleBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, QChar bracket, bool scaleX)
 {
-    QRectF rect = textTightBoundingRect(bracket);
-    qreal f = qMax(1.0, halfHeight / -(1 + fontMidLine() + rect.y()));
+    QRectF rect = textTightBoundingRect(rc, bracket);
+    qreal f = qMax(1.0, halfHeight / -(1 + fontMidLine(rc) + rect.y()));
     if (f > 0)
     {
         painter.save();
         painter.scale(scaleX ? qPow(f, 0.2) : 1.0, f);
-        painter.drawText(QPointF(x, fontMidLine() * (f - 1) / f), bracket);
+        painter.drawText(QPointF(x, fontMidLine(rc) * (f - 1) / f), bracket);
         painter.restore();
     }
-    return textWidth(bracket);
+    return textWidth(rc, bracket);
 }
 
-qreal QGen::renderSingleFillBracket(QPainter &painter, qreal x, qreal halfHeight,
-                                            QChar upperPart, QChar lowerPart, QChar extension, QChar singleBracket)
+qreal QGen::renderSingleFillBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight,
+                                    QChar upperPart, QChar lowerPart, QChar extension, QChar singleBracket)
 {
-    QRectF rect = textTightBoundingRect(upperPart);
+    QRectF rect = textTightBoundingRect(rc, upperPart);
     qreal upperPartHeight = rect.height() - 2, upperPartDescent = rect.y() + rect.height();
     if (halfHeight < upperPartHeight)
-        return renderSingleBracket(painter, x, halfHeight, singleBracket);
-    qreal yLower = 0.5 - fontMidLine() + halfHeight;
-    qreal yUpper = 0.5 - fontMidLine() - halfHeight;
-    rect = textTightBoundingRect(lowerPart);
+        return renderSingleBracket(rc, painter, x, halfHeight, singleBracket);
+    qreal yLower = 0.5 - fontMidLine(rc) + halfHeight;
+    qreal yUpper = 0.5 - fontMidLine(rc) - halfHeight;
+    rect = textTightBoundingRect(rc, lowerPart);
     qreal lowerPartHeight = rect.height() - 2, lowerPartDescent = rect.y() + rect.height();
     painter.drawText(QPointF(x, yUpper + upperPartHeight - upperPartDescent), upperPart);
     painter.drawText(QPointF(x, yLower - lowerPartDescent), lowerPart);
-    renderBracketExtensionFill(painter, extension, x, yLower - lowerPartHeight, yUpper + upperPartHeight);
-    return textWidth(upperPart);
+    renderBracketExtensionFill(rc, painter, extension, x, yLower - lowerPartHeight, yUpper + upperPartHeight);
+    return textWidth(rc, upperPart);
 }
 
-qreal QGen::renderCurlyBracket(QPainter &painter, qreal x, qreal halfHeight, bool left)
+qreal QGen::renderCurlyBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, bool left)
 {
     QChar upperPart = left ? MathGlyphs::leftCurlyBracketUpperHook() : MathGlyphs::rightCurlyBracketUpperHook();
     QChar middlePiece = left ? MathGlyphs::leftCurlyBracketMiddlePiece() : MathGlyphs::rightCurlyBracketMiddlePiece();
@@ -1489,165 +2537,154 @@ qreal QGen::renderCurlyBracket(QPainter &painter, qreal x, qreal halfHeight, boo
     QChar upperHalf = left ? MathGlyphs::upperLeftCurlyBracketSection() : MathGlyphs::lowerLeftCurlyBracketSection();
     QChar lowerHalf = left ? MathGlyphs::lowerLeftCurlyBracketSection() : MathGlyphs::upperLeftCurlyBracketSection();
     QChar singleBracket = left ? '{' : '}';
-    QRectF rect = textTightBoundingRect(upperPart);
+    QRectF rect = textTightBoundingRect(rc, upperPart);
     qreal upperPartHeight = rect.height() - 2, upperPartDescent = rect.y() + rect.height();
-    rect = textTightBoundingRect(lowerPart);
+    rect = textTightBoundingRect(rc, lowerPart);
     qreal lowerPartHeight = rect.height() - 2, lowerPartDescent = rect.y() + rect.height();
-    rect = textTightBoundingRect(middlePiece);
+    rect = textTightBoundingRect(rc, middlePiece);
     qreal middlePieceHeight = rect.height() - 2, middlePieceDescent = rect.y() + rect.height();
-    rect = textTightBoundingRect(upperHalf);
+    rect = textTightBoundingRect(rc, upperHalf);
     qreal halfBraceHeight = rect.height() - 2, halfBraceDescent = rect.y() + rect.height();
-    qreal offset = fontXHeight() - fontMidLine();
-    if (halfHeight >= fontXHeight() + middlePieceDescent + lowerPartHeight)
+    qreal offset = fontXHeight(rc) - fontMidLine(rc);
+    if (halfHeight >= fontXHeight(rc) + middlePieceDescent + lowerPartHeight)
     {
-        qreal upperPartY = 0.5 - halfHeight + upperPartHeight - fontMidLine();
-        qreal lowerPartY = 0.5 + halfHeight - lowerPartHeight - fontMidLine();
+        qreal upperPartY = 0.5 - halfHeight + upperPartHeight - fontMidLine(rc);
+        qreal lowerPartY = 0.5 + halfHeight - lowerPartHeight - fontMidLine(rc);
         qreal y = 2 * offset;
         painter.drawText(QPointF(x, y - middlePieceDescent), middlePiece);
         painter.drawText(QPointF(x, upperPartY - upperPartDescent - 0.5), upperPart);
         painter.drawText(QPointF(x, lowerPartY + lowerPartHeight - lowerPartDescent), lowerPart);
-        renderBracketExtensionFill(painter, extension, x, y - middlePieceHeight + 1, upperPartY);
-        renderBracketExtensionFill(painter, extension, x, lowerPartY + 1, y);
-        return textWidth(upperPart);
+        renderBracketExtensionFill(rc, painter, extension, x, y - middlePieceHeight + 1, upperPartY);
+        renderBracketExtensionFill(rc, painter, extension, x, lowerPartY + 1, y);
+        return textWidth(rc, upperPart);
     }
     if (halfHeight >= halfBraceHeight)
     {
         qreal f = halfHeight / halfBraceHeight;
-        painter.translate(x, 0.5 - fontMidLine());
+        painter.translate(x, 0.5 - fontMidLine(rc));
         painter.scale(1.0, f);
         painter.drawText(QPointF(0.0, -halfBraceDescent - 0.5), upperHalf);
         painter.drawText(QPointF(0.0, halfBraceHeight - halfBraceDescent), lowerHalf);
-        return textWidth(upperHalf);
+        return textWidth(rc, upperHalf);
     }
-    return renderSingleBracket(painter, x, halfHeight, singleBracket);
+    return renderSingleBracket(rc, painter, x, halfHeight, singleBracket);
 }
 
-qreal QGen::renderDisplayWithBrackets(Display &dest, const Display &source,
-                                              BracketType leftBracketType, BracketType rightBracketType, QPointF where)
+qreal QGen::renderDisplayWithBrackets(RenderContext &rc, Display &dest, const Display &source,
+                                      BracketType leftBracketType, BracketType rightBracketType, QPointF where)
 {
-    qreal x = 0.0, halfHeight = qMax(source.ascent() - fontMidLine(), source.descent() + fontMidLine());
-    QPainter painter(&dest);
-    painter.setFont(getFont(fontSizeLevel()));
+    qreal x = 0.0, halfHeight = qMax(source.ascent() - fontMidLine(rc), source.descent() + fontMidLine(rc));
+    LayoutPainter painter(&dest);
+    painter.setFont(rc.fontMetrics());
     painter.translate(where);
-    switch (leftBracketType)
+    x += renderBracket(rc, painter, x, halfHeight, leftBracketType, true);
+    painter.drawDisplay(QPointF(x, 0.0), source);
+    x += source.advance();
+    x += renderBracket(rc, painter, x, halfHeight, rightBracketType, false);
+    return x;
+}
+
+// Tall brackets are assembled from many glyphs. The assembled bracket is stored as a single
+// path, which is cached and painted with one fill wherever a bracket of the same shape, size
+// and font is needed.
+qreal QGen::renderBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, BracketType type, bool left)
+{
+    if (type == None)
+        return 0.0;
+    StretchyDelimiterKey key = stretchyDelimiterKey(rc, 2 * int(type) + (left ? 1 : 0), halfHeight);
+    StretchyDelimiter delimiter;
+    if (!findStretchyDelimiter(key, delimiter))
     {
-    case Parenthesis:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::leftParenthesisUpperHook(),
-                                     MathGlyphs::leftParenthesisLowerHook(),
-                                     MathGlyphs::leftParenthesisExtension(),
-                                     '(');
-        break;
-    case WhiteParenthesis:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::leftWhiteParenthesis(), true);
-        break;
-    case SquareBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::leftSquareBracketUpperCorner(),
-                                     MathGlyphs::leftSquareBracketLowerCorner(),
-                                     MathGlyphs::leftSquareBracketExtension(),
-                                     '[');
-        break;
-    case WhiteSquareBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::leftWhiteSquareBracket());
-        break;
-    case CurlyBracket:
-        x += renderCurlyBracket(painter, x, halfHeight, true);
-        break;
-    case WhiteCurlyBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::leftWhiteCurlyBracket(), true);
-        break;
-    case FloorBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::leftSquareBracketExtension(),
-                                     MathGlyphs::leftSquareBracketLowerCorner(),
-                                     MathGlyphs::leftSquareBracketExtension(),
-                                     MathGlyphs::leftFloorBracket());
-        break;
-    case CeilingBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::leftSquareBracketUpperCorner(),
-                                     MathGlyphs::leftSquareBracketExtension(),
-                                     MathGlyphs::leftSquareBracketExtension(),
-                                     MathGlyphs::leftCeilingBracket());
-        break;
-    case AngleBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::leftAngleBracket(), true);
-        break;
-    case StraightBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::straightBracket());
-        break;
-    case DoubleStraightBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::doubleStraightBracket());
-        break;
-    default:
-        break;
+        QPainterPath path;
+        path.setFillRule(Qt::WindingFill);
+        LayoutPainter pathPainter(&path);
+        pathPainter.setFont(rc.fontMetrics());
+        delimiter.advance = renderBracketGlyphs(rc, pathPainter, key.bucket / 2.0, type, left);
+        delimiter.path = QSharedPointer<const QPainterPath>(new QPainterPath(path));
+        delimiter.rect = pathPainter.pathRect();
+        insertStretchyDelimiter(key, delimiter);
     }
-    renderDisplay(dest, source, QPointF(x, 0.0));
-    x += source.advance();
-    switch (rightBracketType)
+    painter.drawPath(QPointF(x, 0.0), delimiter.path, delimiter.rect);
+    return delimiter.advance;
+}
+
+qreal QGen::renderBracketGlyphs(RenderContext &rc, LayoutPainter &painter, qreal halfHeight, BracketType type, bool left)
+{
+    switch (type)
     {
     case Parenthesis:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::rightParenthesisUpperHook(),
-                                     MathGlyphs::rightParenthesisLowerHook(),
-                                     MathGlyphs::rightParenthesisExtension(),
-                                     ')');
-        break;
+        return left ? renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::leftParenthesisUpperHook(),
+                                              MathGlyphs::leftParenthesisLowerHook(),
+                                              MathGlyphs::leftParenthesisExtension(),
+                                              '(')
+                    : renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::rightParenthesisUpperHook(),
+                                              MathGlyphs::rightParenthesisLowerHook(),
+                                              MathGlyphs::rightParenthesisExtension(),
+                                              ')');
     case WhiteParenthesis:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::rightWhiteParenthesis(), true);
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight,
+                                   left ? MathGlyphs::leftWhiteParenthesis() : MathGlyphs::rightWhiteParenthesis(), true);
     case SquareBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::rightSquareBracketUpperCorner(),
-                                     MathGlyphs::rightSquareBracketLowerCorner(),
-                                     MathGlyphs::rightSquareBracketExtension(),
-                                     ']');
-        break;
+        return left ? renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::leftSquareBracketUpperCorner(),
+                                              MathGlyphs::leftSquareBracketLowerCorner(),
+                                              MathGlyphs::leftSquareBracketExtension(),
+                                              '[')
+                    : renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::rightSquareBracketUpperCorner(),
+                                              MathGlyphs::rightSquareBracketLowerCorner(),
+                                              MathGlyphs::rightSquareBracketExtension(),
+                                              ']');
     case WhiteSquareBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::rightWhiteSquareBracket());
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight,
+                                   left ? MathGlyphs::leftWhiteSquareBracket() : MathGlyphs::rightWhiteSquareBracket());
     case CurlyBracket:
-        x += renderCurlyBracket(painter, x, halfHeight, false);
-        break;
+        return renderCurlyBracket(rc, painter, 0.0, halfHeight, left);
     case WhiteCurlyBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::rightWhiteCurlyBracket(), true);
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight,
+                                   left ? MathGlyphs::leftWhiteCurlyBracket() : MathGlyphs::rightWhiteCurlyBracket(), true);
     case FloorBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::rightSquareBracketExtension(),
-                                     MathGlyphs::rightSquareBracketLowerCorner(),
-                                     MathGlyphs::rightSquareBracketExtension(),
-                                     MathGlyphs::rightFloorBracket());
-        break;
+        return left ? renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::leftSquareBracketExtension(),
+                                              MathGlyphs::leftSquareBracketLowerCorner(),
+                                              MathGlyphs::leftSquareBracketExtension(),
+                                              MathGlyphs::leftFloorBracket())
+                    : renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::rightSquareBracketExtension(),
+                                              MathGlyphs::rightSquareBracketLowerCorner(),
+                                              MathGlyphs::rightSquareBracketExtension(),
+                                              MathGlyphs::rightFloorBracket());
     case CeilingBracket:
-        x += renderSingleFillBracket(painter, x, halfHeight,
-                                     MathGlyphs::rightSquareBracketUpperCorner(),
-                                     MathGlyphs::rightSquareBracketExtension(),
-                                     MathGlyphs::rightSquareBracketExtension(),
-                                     MathGlyphs::rightCeilingBracket());
-        break;
+        return left ? renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::leftSquareBracketUpperCorner(),
+                                              MathGlyphs::leftSquareBracketExtension(),
+                                              MathGlyphs::leftSquareBracketExtension(),
+                                              MathGlyphs::leftCeilingBracket())
+                    : renderSingleFillBracket(rc, painter, 0.0, halfHeight,
+                                              MathGlyphs::rightSquareBracketUpperCorner(),
+                                              MathGlyphs::rightSquareBracketExtension(),
+                                              MathGlyphs::rightSquareBracketExtension(),
+                                              MathGlyphs::rightCeilingBracket());
     case AngleBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::rightAngleBracket(), true);
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight,
+                                   left ? MathGlyphs::leftAngleBracket() : MathGlyphs::rightAngleBracket(), true);
     case StraightBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::straightBracket());
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight, MathGlyphs::straightBracket());
     case DoubleStraightBracket:
-        x += renderSingleBracket(painter, x, halfHeight, MathGlyphs::doubleStraightBracket());
-        break;
+        return renderSingleBracket(rc, painter, 0.0, halfHeight, MathGlyphs::doubleStraightBracket());
     default:
-        break;
+        return 0.0;
     }
-    return x;
 }
 
-qreal QGen::renderDisplayWithParentheses(Display &dest, const Display &source, QPointF where)
+qreal QGen::renderDisplayWithParentheses(RenderContext &rc, Display &dest, const Display &source, QPointF where)
 {
-    return renderDisplayWithBrackets(dest, source, BracketType::Parenthesis, BracketType::Parenthesis, where);
+    return renderDisplayWithBrackets(rc, dest, source, BracketType::Parenthesis, BracketType::Parenthesis, where);
 }
 
-qreal QGen::renderDisplayWithPriority(Display &dest, const Display &source, int priority, QPointF where)
+qreal QGen::renderDisplayWithPriority(RenderContext &rc, Display &dest, const Display &source, int priority, QPointF where)
 {
     QPointF penPoint(where);
     if (source.priority() < priority)
@@ -1655,51 +2692,70 @@ qreal QGen::renderDisplayWithPriority(Display &dest, const Display &source, int
         renderDisplayAndAdvance(dest, source, penPoint);
         return penPoint.x() - where.x();
     }
-    return renderDisplayWithParentheses(dest, source, penPoint);
+    return renderDisplayWithParentheses(rc, dest, source, penPoint);
 }
 
-qreal QGen::renderDisplayWithSquareBrackets(Display &dest, const Display &source, QPointF where)
+qreal QGen::renderDisplayWithSquareBrackets(RenderContext &rc, Display &dest, const Display &source, QPointF where)
 {
-    return renderDisplayWithBrackets(dest, source, BracketType::SquareBracket, BracketType::SquareBracket, where);
+    return renderDisplayWithBrackets(rc, dest, source, BracketType::SquareBracket, BracketType::SquareBracket, where);
 }
 
-qreal QGen::renderDisplayWithCurlyBrackets(Display &dest, const Display &source, QPointF where)
+qreal QGen::renderDisplayWithCurlyBrackets(RenderContext &rc, Display &dest, const Display &source, QPointF where)
 {
-    return renderDisplayWithBrackets(dest, source, BracketType::CurlyBracket, BracketType::CurlyBracket, where);
+    return renderDisplayWithBrackets(rc, dest, source, BracketType::CurlyBracket, BracketType::CurlyBracket, where);
+}
+
+void QGen::renderHorizontalLine(RenderContext &rc, LayoutPainter &painter, qreal x, qreal y, qreal length, qreal widthFactor)
+{
+    StretchyDelimiterKey key = stretchyDelimiterKey(rc, -qRound(widthFactor * 100), length);
+    StretchyDelimiter delimiter;
+    if (!findStretchyDelimiter(key, delimiter))
+    {
+        QPainterPath path;
+        path.setFillRule(Qt::WindingFill);
+        LayoutPainter pathPainter(&path);
+        pathPainter.setFont(rc.fontMetrics());
+        renderHorizontalLineGlyphs(rc, pathPainter, key.bucket / 2.0, widthFactor);
+        delimiter.path = QSharedPointer<const QPainterPath>(new QPainterPath(path));
+        delimiter.rect = pathPainter.pathRect();
+        delimiter.advance = key.bucket / 2.0;
+        insertStretchyDelimiter(key, delimiter);
+    }
+    painter.drawPath(QPointF(x, y), delimiter.path, delimiter.rect);
 }
 
-void QGen::renderHorizontalLine(QPainter &painter, qreal x, qreal y, qreal length, qreal widthFactor)
+void QGen::renderHorizontalLineGlyphs(RenderContext &rc, LayoutPainter &painter, qreal length, qreal widthFactor)
 {
-    QRectF rect = textTightBoundingRect(MathGlyphs::horizontalLineExtension());
+    QRectF rect = textTightBoundingRect(rc, MathGlyphs::horizontalLineExtension());
     qreal xOffset = rect.x() + 0.5, yOffset = rect.y() + rect.height() / 2, baseWidth = rect.width() - 1;
     int n = qRound(length / baseWidth);
     for (int i = 0; i < n; ++i)
-        painter.drawText(QPointF(x + i * baseWidth - xOffset, y - yOffset), MathGlyphs::horizontalLineExtension());
+        painter.drawText(QPointF(i * baseWidth - xOffset, -yOffset), MathGlyphs::horizontalLineExtension());
     qreal f = length / baseWidth - n;
     if (f > 0)
     {
         painter.save();
-        painter.translate(x + n * baseWidth, y);
+        painter.translate(n * baseWidth, 0.0);
         painter.scale(f, widthFactor);
         painter.drawText(QPointF(-xOffset, -yOffset), MathGlyphs::horizontalLineExtension());
         painter.restore();
     }
 }
 
-void QGen::renderHorizontalLine(Display &dest, QPointF where, qreal length, qreal widthFactor)
+void QGen::renderHorizontalLine(RenderContext &rc, Display &dest, QPointF where, qreal length, qreal widthFactor)
 {
-    QPainter painter(&dest);
-    painter.setFont(getFont(fontSizeLevel()));
-    renderHorizontalLine(painter, where.x(), where.y(), length, widthFactor);
+    LayoutPainter painter(&dest);
+    painter.setFont(rc.fontMetrics());
+    renderHorizontalLine(rc, painter, where.x(), where.y(), length, widthFactor);
 }
 
-qreal QGen::linePadding(int relativeSizeLevel)
+qreal QGen::linePadding(RenderContext &rc, int relativeSizeLevel)
 {
-    return textWidth(MathGlyphs::thinSpace(), relativeSizeLevel);
+    return rc.fontMetrics(relativeSizeLevel).linePadding();
 }
 
-void QGen::renderDisplayWithAccent(Display &dest, const Display &source,
-                                           AccentType accentType, QPointF where)
+void QGen::renderDisplayWithAccent(RenderContext &rc, Display &dest, const Display &source,
+                                   AccentType accentType, QPointF where)
 {
     renderDisplay(dest, source, QPointF(where.x() + source.leftBearing(), where.y()));
     QChar accent;
@@ -1742,11 +2798,11 @@ void QGen::renderDisplayWithAccent(Display &dest, const Display &source,
         accent = MathGlyphs::tripleDotAccent();
         break;
     }
-    QRectF rect = textTightBoundingRect(accent);
+    QRectF rect = textTightBoundingRect(rc, accent);
     qreal xOffset = rect.x() + 0.5, yOffset = rect.y() + rect.height(), accentWidth = rect.width() - 1;
-    QPainter painter(&dest);
-    painter.setFont(getFont(fontSizeLevel()));
-    painter.translate(where.x(), where.y() - source.ascent() - linePadding());
+    LayoutPainter painter(&dest);
+    painter.setFont(rc.fontMetrics());
+    painter.translate(where.x(), where.y() - source.ascent() - linePadding(rc));
     if (stretchable)
     {
         qreal f = source.totalWidth() / accentWidth;
@@ -1778,10 +2834,24 @@ void QGen::translateBoundingRect(gen &g, int dx, int dy)
     }
 }
 
-QPicture QGen::render(int alignment)
+QPicture QGen::render(int alignment, SubexpressionIndex *index) const
+{
+    RenderContext rc = renderingContext();
+    return render(rc, alignment, index);
+}
+
+QGen::Display QGen::layout(RenderContext &rc) const
 {
     Display display;
-    render(display, *this);
+    rc.reset();
+    rc.setGiacContext(ct);
+    render(rc, display, *this);
+    rc.structuralHashes().clear();
+    return display;
+}
+
+QPointF QGen::alignedOrigin(const Display &display, int alignment)
+{
     qreal x = display.leftBearing(), y = 0.0;
     if ((alignment & AlignHCenter) != 0)
         x -= display.totalWidth() / 2.0;
@@ -1793,8 +2863,135 @@ QPicture QGen::render(int alignment)
         y -= display.descent();
     else if ((alignment & AlignVCenter) != 0)
         y -= display.height() / 2.0 - display.descent();
+    return QPointF(x, y);
+}
+
+QPicture QGen::render(RenderContext &rc, int alignment, SubexpressionIndex *index) const
+{
+    rc.setIndexing(index != Q_NULLPTR);
+    Display display = layout(rc);
+    QPointF origin = alignedOrigin(display, alignment);
+    qreal x = origin.x(), y = origin.y();
+    if (index != Q_NULLPTR)
+    {
+        // temporaries of the layout are gone by now, only links into this expression are followed
+        QSet<const void*> nodes;
+        QSet<const gen*> gens;
+        collectSubexpressions(*expr, nodes, gens);
+        QVector<QRectF> rects;
+        index->clear();
+        indexDisplay(display, QTransform::fromTranslate(x, y), 0, gens, rects, *index);
+        index->m_index.build(rects);
+    }
     QPicture picture;
     QPainter painter(&picture);
-    painter.drawPicture(QPointF(x, y), display);
+    display.paint(painter, QPointF(x, y));
     return picture;
 }
+
+// Composes the transformations in the same order as Display::paint.
+void QGen::indexDisplay(const Display &display, const QTransform &transform, int depth, const QSet<const gen*> &gens,
+                        QVector<QRectF> &rects, SubexpressionIndex &index) const
+{
+    if (display.expression() != NULL && gens.contains(display.expression()))
+    {
+        rects.append(transform.mapRect(display.boundingRect()));
+        index.m_expressions.append(QGen(*display.expression(), ct));
+        index.m_depths.append(depth++);
+    }
+    QVector<Display::Item>::const_iterator it;
+    for (it = display.items().begin(); it != display.items().end(); ++it)
+    {
+        if (!it->display.isNull())
+            indexDisplay(*it->display, QTransform::fromTranslate(it->position.x(), it->position.y()) * it->transform * transform,
+                         depth, gens, rects, index);
+    }
+}
+
+void SubexpressionIndex::clear()
+{
+    m_index.clear();
+    m_expressions.clear();
+    m_depths.clear();
+}
+
+int SubexpressionIndex::indexAt(const QPointF &point) const
+{
+    QVector<int> hits = m_index.itemsAt(point);
+    int best = -1;
+    foreach (int i, hits)
+    {
+        if (best < 0 || m_depths.at(i) > m_depths.at(best))
+            best = i;
+    }
+    return best;
+}
+
+// The worker only holds a pointer to the expression, so it neither copies nor releases giac data.
+QGen::BackgroundRender QGen::renderDetached(const QGen *g, RenderContext rc, int alignment)
+{
+    BackgroundRender result;
+    rc.setIndexing(false);
+    result.pendingCache.beginCollecting();
+    Display display = g->layout(rc);
+    result.pendingCache.endCollecting();
+    result.elidedCount = display.elidedCount();
+    QPainter painter(&result.picture);
+    display.paint(painter, alignedOrigin(display, alignment));
+    painter.end();
+    return result;
+}
+
+QFuture<QGen::BackgroundRender> QGen::renderInBackground(int alignment, const QSizeF &viewport, qreal lineWidth) const
+{
+    RenderContext rc = renderingContext();
+    rc.setViewport(viewport);
+    rc.setMaximumLineWidth(lineWidth);
+    return QtConcurrent::run(renderDetached, this, rc, alignment);
+}
+
+// Font metrics of the layout are taken at the logical resolution of the screen.
+qreal QGen::layoutResolution()
+{
+    QScreen *screen = QGuiApplication::primaryScreen();
+    return screen != Q_NULLPTR ? screen->logicalDotsPerInchY() : 96.0;
+}
+
+bool QGen::toSvg(QIODevice *device, int margin) const
+{
+    RenderContext rc = renderingContext();
+    Display display = layout(rc);
+    QRectF rect = display.boundingRect().adjusted(-margin, -margin, margin, margin);
+    QString width = svgNumber(rect.width()), height = svgNumber(rect.height());
+    QXmlStreamWriter xml(device);
+    xml.setAutoFormatting(true);
+    xml.writeStartDocument();
+    xml.writeStartElement("svg");
+    xml.writeDefaultNamespace("http://www.w3.org/2000/svg");
+    xml.writeAttribute("version", "1.1");
+    xml.writeAttribute("width", width);
+    xml.writeAttribute("height", height);
+    xml.writeAttribute("viewBox", QString("0 0 %1 %2").arg(width, height));
+    xml.writeAttribute("xml:space", "preserve");
+    display.writeSvg(xml, -rect.topLeft(), layoutResolution());
+    xml.writeEndElement();
+    xml.writeEndDocument();
+    return !xml.hasError();
+}
+
+bool QGen::toPdf(QIODevice *device, int margin) const
+{
+    RenderContext rc = renderingContext();
+    Display display = layout(rc);
+    QRectF rect = display.boundingRect().adjusted(-margin, -margin, margin, margin);
+    qreal dpi = layoutResolution();
+    QPdfWriter writer(device);
+    writer.setResolution(qRound(dpi));
+    writer.setPageSize(QPageSize(rect.size() * 72.0 / dpi, QPageSize::Point, QString(), QPageSize::ExactMatch));
+    writer.setPageMargins(QMarginsF(0, 0, 0, 0));
+    QPainter painter;
+    if (!painter.begin(&writer))
+        return false;
+    display.paint(painter, -rect.topLeft());
+    return painter.end();
+}
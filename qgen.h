@@ -23,24 +23,86 @@
 #include <QPicture>
 #include <QStringList>
 #include <QMap>
+#include <QHash>
+#include <QPair>
+#include <QByteArray>
+#include <QCache>
+#include <QMutex>
 #include <QStack>
 #include <QVector>
+#include <QSet>
 #include <QFont>
+#include <QGlyphRun>
 #include <QPainter>
+#include <QPainterPath>
+#include <QTransform>
+#include <QSharedPointer>
+#include <QAtomicInt>
+#include <QScopedPointer>
+#include <QFuture>
+#include <QIODevice>
+#include <QXmlStreamWriter>
 #include <QFlags>
 #include <QRegularExpression>
 #include <qmath.h>
 #include <giac/config.h>
 #include <giac/giac.h>
 #include "mathglyphs.h"
+#include "fontmetricstable.h"
+#include "rendercontext.h"
+#include "hittestindex.h"
 
 using namespace giac;
 
+/* QGenView is a non-owning, trivially copyable reference to a subexpression. It is meant for
+ * walking expressions during rendering: obtaining operands through a view neither allocates
+ * nor modifies the underlying expression. The referenced gen must outlive the view. */
+class QGenView
+{
+    const gen *m_expr;
+    const context *m_ct;
+
+public:
+    QGenView() : m_expr(Q_NULLPTR), m_ct(Q_NULLPTR) { }
+    QGenView(const gen &e, const context *contextptr) : m_expr(&e), m_ct(contextptr) { }
+
+    bool isNull() const { return m_expr == Q_NULLPTR; }
+    const gen &expression() const { return *m_expr; }
+    const context *contextPtr() const { return m_ct; }
+    int type() const { return m_expr->type; }
+    bool isSymbolic() const { return type() == _SYMB; }
+    bool isVector() const { return type() == _VECT; }
+    bool isUnaryFunction(const unary_function_ptr *f) const { return m_expr->is_symb_of_sommet(f); }
+    bool isTheSameOperatorAs(const QGenView &other) const
+    {
+        return isSymbolic() && other.isSymbolic() && m_expr->_SYMBptr->sommet == other.m_expr->_SYMBptr->sommet;
+    }
+    QGenView argument() const { return isSymbolic() ? QGenView(m_expr->_SYMBptr->feuille, m_ct) : QGenView(); }
+    int operandCount() const
+    {
+        return isSymbolic() && m_expr->_SYMBptr->feuille.type == _VECT ? int(m_expr->_SYMBptr->feuille._VECTptr->size()) : -1;
+    }
+    QGenView operand(int n) const
+    {
+        int count = operandCount();
+        if (n < 0)
+            n += count;
+        return n >= 0 && n < count ? QGenView(m_expr->_SYMBptr->feuille._VECTptr->at(n), m_ct) : QGenView();
+    }
+};
+
+Q_DECLARE_TYPEINFO(QGenView, Q_PRIMITIVE_TYPE);
+
+class SubexpressionIndex;
+
 class QGen
 {
+    gen value;
     gen *expr;
     const context *ct;
-    bool owns;
+
+    static QAtomicInt expressionCopyCount;
+    static QAtomicInt layoutNodeCount;
 
     enum OperatorPriority
     {
@@ -70,56 +132,243 @@ class QGen
     enum AccentType { Hat, Check, Tilde, Acute, Grave, Dot, DoubleDot, TripleDot, Bar, Vec };
     enum MathPadding { Hair, Thin, Medium, Thick };
 
-    class Display : public QPicture
+    class Display
     {
+    public:
+        struct Item
+        {
+            QTransform transform;
+            QPointF position;
+            QFont font;
+            QString text;
+            QSharedPointer<FontMetricsTable> metrics;
+            QSharedPointer<const Display> display;
+            QSharedPointer<const QPainterPath> path;
+        };
+
+    private:
+        // a view of the expression shown, set only while a subexpression index is built
         const gen *m_expression;
         bool m_grouped;
         bool m_requiresMinusSign;
         int m_priority;
+        int m_elidedCount;
+        QRectF m_boundingRect;
+        QVector<Item> m_items;
 
     public:
         Display()
-            : QPicture()
-            , m_expression(NULL)
-            , m_grouped(false)
-            , m_requiresMinusSign(false)
-            , m_priority(0) { }
-
-        Display(const QGen &expr)
-            : QPicture()
-            , m_expression(&expr.expression())
-            , m_grouped(false)
-            , m_requiresMinusSign(false)
-            , m_priority(0) { }
-
-        Display(const QPicture &picture)
-            : QPicture(picture)
-            , m_expression(NULL)
+            : m_expression(Q_NULLPTR)
             , m_grouped(false)
             , m_requiresMinusSign(false)
-            , m_priority(0) { }
+            , m_priority(0)
+            , m_elidedCount(0) { }
 
         Display(const Display &display)
-            : QPicture(display)
-            , m_expression(display.expression())
+            : m_expression(display.m_expression)
             , m_grouped(display.isGrouped())
             , m_requiresMinusSign(display.isMinusSignRequired())
-            , m_priority(display.priority()) { }
+            , m_priority(display.priority())
+            , m_elidedCount(display.elidedCount())
+            , m_boundingRect(display.boundingRect())
+            , m_items(display.items()) { }
 
         int priority() const { return m_priority; }
+        int elidedCount() const { return m_elidedCount; }
         bool isGrouped() const { return m_grouped; }
         bool isMinusSignRequired() const { return m_requiresMinusSign; }
+        bool isEmpty() const { return m_items.isEmpty(); }
         const gen *expression() const { return m_expression; }
+        const QVector<Item> &items() const { return m_items; }
         void setPriority(int value) { m_priority = value; }
+        void addElidedCount(int count) { m_elidedCount += count; }
         void setGrouped(bool yes) { m_grouped = yes; }
         void requireMinusSign(bool yes) { m_requiresMinusSign = yes; }
         void linkWithExpression(const QGen &g) { m_expression = &g.expression(); }
-        int leftBearing() const { return -boundingRect().x(); }
-        int advance() const { return boundingRect().width() - leftBearing(); }
-        int ascent() const { return -boundingRect().y(); }
-        int descent() const { return boundingRect().height() - ascent(); }
-        int totalWidth() const { return boundingRect().width(); }
-        int totalHeight() const { return boundingRect().height(); }
+        void appendItem(const Item &item, const QRectF &itemRect);
+        void paint(QPainter &painter, const QPointF &where) const;
+        void writeSvg(QXmlStreamWriter &xml, const QPointF &where, qreal dpi) const;
+        QRectF boundingRect() const { return m_boundingRect; }
+        qreal leftBearing() const { return -m_boundingRect.x(); }
+        qreal advance() const { return m_boundingRect.width() - leftBearing(); }
+        qreal ascent() const { return -m_boundingRect.y(); }
+        qreal descent() const { return m_boundingRect.height() - ascent(); }
+        qreal width() const { return m_boundingRect.width(); }
+        qreal height() const { return m_boundingRect.height(); }
+        qreal totalWidth() const { return m_boundingRect.width(); }
+        qreal totalHeight() const { return m_boundingRect.height(); }
+    };
+
+    /* LayoutPainter mimics the part of the QPainter interface used by the renderer. Instead of
+     * painting, it records text items and subdisplays into a Display, placing them with the current
+     * transformation and growing the display's bounding box (measure pass). The glyphs are painted
+     * only once, when the finished layout tree is traversed by Display::paint (paint pass).
+     * A LayoutPainter constructed on a QPainterPath adds glyph outlines to the path instead,
+     * which is used to build stretchy delimiters. */
+    class LayoutPainter
+    {
+        struct State
+        {
+            QTransform transform;
+            FontMetricsTable *fontMetrics;
+        };
+
+        Display *m_display;
+        QPainterPath *m_path;
+        QRectF m_pathRect;
+        State m_state;
+        QStack<State> m_savedStates;
+
+    public:
+        LayoutPainter(Display *display) : m_display(display), m_path(Q_NULLPTR) { m_state.fontMetrics = Q_NULLPTR; }
+        LayoutPainter(QPainterPath *path) : m_display(Q_NULLPTR), m_path(path) { m_state.fontMetrics = Q_NULLPTR; }
+
+        void save() { m_savedStates.push(m_state); }
+        void restore() { if (!m_savedStates.isEmpty()) m_state = m_savedStates.pop(); }
+        const QFont &font() const { Q_ASSERT(m_state.fontMetrics != Q_NULLPTR); return m_state.fontMetrics->font(); }
+        void setFont(FontMetricsTable &fontMetrics) { m_state.fontMetrics = &fontMetrics; }
+        void translate(qreal dx, qreal dy) { m_state.transform.translate(dx, dy); }
+        void translate(const QPointF &offset) { translate(offset.x(), offset.y()); }
+        void scale(qreal sx, qreal sy) { m_state.transform.scale(sx, sy); }
+        void drawText(const QPointF &position, const QString &text);
+        void drawText(qreal x, qreal y, const QString &text) { drawText(QPointF(x, y), text); }
+        void drawDisplay(const QPointF &position, const Display &display);
+        void drawPath(const QPointF &position, const QSharedPointer<const QPainterPath> &path, const QRectF &rect);
+        const QRectF &pathRect() const { return m_pathRect; }
+    };
+
+    // The font and the elision settings are compared exactly; fontKey and elisionKey are their digests
+    // and enter only the hash, so two settings with the same digest never share a display.
+    struct RenderCacheKey
+    {
+        uint hash;
+        uint fontKey;
+        uint elisionKey;
+        int fontSizeLevel;
+        bool bold;
+        bool italic;
+        QString fontFamily;
+        int basePointSize;
+        QSizeF viewport;
+        qreal lineWidth;
+        int lazyRenderingThreshold;
+        int mapEntryLimit;
+        int numberDigitThreshold;
+
+        bool operator ==(const RenderCacheKey &other) const
+        {
+            return hash == other.hash && fontSizeLevel == other.fontSizeLevel &&
+                    bold == other.bold && italic == other.italic &&
+                    basePointSize == other.basePointSize && fontFamily == other.fontFamily &&
+                    viewport.width() == other.viewport.width() && viewport.height() == other.viewport.height() &&
+                    lineWidth == other.lineWidth && lazyRenderingThreshold == other.lazyRenderingThreshold &&
+                    mapEntryLimit == other.mapEntryLimit && numberDigitThreshold == other.numberDigitThreshold;
+        }
+
+        friend uint qHash(const RenderCacheKey &key, uint seed = 0)
+        {
+            return qHash(key.hash, seed) ^ key.fontKey ^ key.elisionKey ^ uint((key.fontSizeLevel + 8) << 2 | key.bold << 1 | key.italic);
+        }
+    };
+
+    struct RenderCacheEntry
+    {
+        gen expression;
+        Display display;
+    };
+
+public:
+    /* PendingRenderCache collects the displays laid out on a thread instead of inserting them into
+     * the render cache. Inserting copies the expression, and giac does not update reference counts
+     * atomically, so only the thread owning the expression may do it: commit() inserts the collected
+     * displays and must be called there while the expression exists. Displays of expressions which
+     * are not part of it, temporaries of the layout, are dropped. */
+    class PendingRenderCache
+    {
+        friend class QGen;
+
+        struct Entry
+        {
+            RenderCacheKey key;
+            const gen *expression;
+            Display display;
+        };
+
+        QVector<Entry> m_entries;
+        PendingRenderCache *m_previous;
+        static thread_local PendingRenderCache *collecting;
+
+        void commit(const QVector<const gen*> &roots);
+
+    public:
+        PendingRenderCache() : m_previous(Q_NULLPTR) { }
+
+        void beginCollecting();
+        void endCollecting();
+        bool isEmpty() const { return m_entries.isEmpty(); }
+        void commit(const QGen &root) { commit(QVector<const gen*>() << &root.expression()); }
+    };
+
+    // elidedCount is the number of entries left out of the picture by lazy rendering
+    struct BackgroundRender
+    {
+        QPicture picture;
+        PendingRenderCache pendingCache;
+        int elidedCount;
+
+        BackgroundRender() : elidedCount(0) { }
+    };
+
+private:
+
+    // Shape is 2 * BracketType (+ 1 for left brackets) for brackets and minus the width factor
+    // in percent for horizontal lines; the extent is quantized to buckets of half a pixel.
+    struct StretchyDelimiterKey
+    {
+        uint fontKey;
+        QString fontFamily;
+        int basePointSize;
+        int fontIndex;
+        int shape;
+        int bucket;
+
+        bool operator ==(const StretchyDelimiterKey &other) const
+        {
+            return fontIndex == other.fontIndex && shape == other.shape && bucket == other.bucket &&
+                    basePointSize == other.basePointSize && fontFamily == other.fontFamily;
+        }
+
+        friend uint qHash(const StretchyDelimiterKey &key, uint seed = 0)
+        {
+            return qHash(key.bucket, seed) ^ key.fontKey ^ uint(key.shape << 20 | key.fontIndex << 16);
+        }
+    };
+
+    struct StretchyDelimiter
+    {
+        QSharedPointer<const QPainterPath> path;
+        QRectF rect;
+        qreal advance;
+    };
+
+    struct RenderChunk
+    {
+        const RenderContext *context;
+        gen *const *entries;
+        Display *displays;
+        int begin;
+        int end;
+        PendingRenderCache pendingCache;
+    };
+
+    // The number is a deep copy, so that no reference to the rendered expression is kept.
+    struct IntegerDigits
+    {
+        mpz_t number;
+        QByteArray digits;
+
+        IntegerDigits(mpz_srcptr n) { mpz_init_set(number, n); }
+        ~IntegerDigits() { mpz_clear(number); }
     };
 
     struct UserOperator
@@ -132,7 +381,27 @@ class QGen
         bool isCommutative;
     };
 
+    typedef void (*RenderHandler)(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+
+    struct OperatorInfo
+    {
+        int type;
+        OperatorPriority priority;
+        QString glyph;
+        RenderHandler handler;
+        bool simpleArgumentOnly;
+    };
+
+    typedef QHash<const unary_function_abstract*, OperatorInfo> OperatorTable;
+
+    static const OperatorTable &operatorTable();
+    static OperatorTable buildOperatorTable();
+    static void insertOperator(OperatorTable &table, const unary_function_ptr *f, int type, OperatorPriority priority,
+                               const QString &glyph, RenderHandler handler, bool simpleArgumentOnly = false);
+    bool findOperatorInfo(OperatorInfo &info) const;
+
     static QMap<QString, UserOperator> userOperators;
+    static QMutex userOperatorsMutex;
 
     static gen seq(const gen &g1, const gen &g2);
     static gen seq(const gen &g1, const gen &g2, const gen &g3);
@@ -144,7 +413,7 @@ class QGen
     static gen vec(const gen &g1, const gen &g2, const gen &g3, const gen &g4);
 
     QGen makeSymb(const unary_function_ptr *p, const gen &args) const;
-    vecteur flattenOperands() const;
+    static void flattenOperands(const QGenView &g, QVector<QGenView> &operands);
 
     unary_function_ptr &sommet() const { return expr->_SYMBptr->sommet; }
     gen &feuille() const { return expr->_SYMBptr->feuille; }
@@ -152,21 +421,33 @@ class QGen
 
     // RENDERING
 
-    static QList<int> fontSizes;
-    static QList<QFont> fonts;
-    static QString fontFamily;
-
-    QStack<int> fontSizeLevelStack;
-    bool renderFontItalic;
-    bool renderFontBold;
-    int fractionDepth;
-
-    int fontSizeLevel() const { Q_ASSERT(!fontSizeLevelStack.empty()); return fontSizeLevelStack.top(); }
-    int smallerFontSizeLevel() const { return fontSizeLevel() - 1; }
-    int largerFontSizeLevel() const { return fontSizeLevel() + 1; }
-
-    void setRenderingItalic(bool yes) { renderFontItalic = yes; }
-    void setRenderingBold(bool yes) { renderFontBold = yes; }
+    static QScopedPointer<RenderContext> defaultRenderContext;
+    static QMutex defaultRenderContextMutex;
+    static QCache<RenderCacheKey, RenderCacheEntry> renderCache;
+    static QMutex renderCacheMutex;
+    static int renderCacheHitCount;
+    static int renderCacheMissCount;
+    static int parallelRenderingThreshold;
+    static const int lazyRenderingBatchSize;
+    static QCache<StretchyDelimiterKey, StretchyDelimiter> stretchyDelimiterCache;
+    static QMutex stretchyDelimiterCacheMutex;
+    static QHash<QPair<QString, int>, QString> identifierSymbols;
+    static QMutex identifierSymbolsMutex;
+    static QCache<const void*, IntegerDigits> integerDigitsCache;
+    static QMutex integerDigitsCacheMutex;
+    static const int parallelDigitConversionThreshold;
+    static const qreal defaultNumberLineWidth;
+
+    static uint structuralHash(const gen &g, QHash<const void*, uint> &memo, GIAC_CONTEXT);
+    static uint structuralHash(RenderContext &rc, const gen &g);
+    static bool findCachedDisplay(const RenderCacheKey &key, const gen &g, Display &display);
+    static void insertCachedDisplay(const RenderCacheKey &key, const gen &g, const Display &display);
+    static void cacheDisplay(const RenderCacheKey &key, const QGen &g, const Display &display);
+    static void collectSubexpressions(const gen &g, QSet<const void*> &nodes, QSet<const gen*> &gens);
+    static gen negatedConstant(const gen &g);
+    static StretchyDelimiterKey stretchyDelimiterKey(RenderContext &rc, int shape, qreal extent);
+    static bool findStretchyDelimiter(const StretchyDelimiterKey &key, StretchyDelimiter &delimiter);
+    static void insertStretchyDelimiter(const StretchyDelimiterKey &key, const StretchyDelimiter &delimiter);
 
     static QString paddedText(const QString &text, MathPadding padding = Medium, bool padLeft = true, bool padRight = true);
     static QString quotedText(const QString &text);
@@ -174,50 +455,67 @@ class QGen
     static QString numberToSubscriptText(int integer, bool parens = false);
     static QString identifierStringToUnicode(const QString &text, bool bold, bool italic);
 
-    void render(Display &dest, const QGen &g, int sizeLevel = 0);
-    Display renderNormal(const QGen &g);
-    Display renderSmaller(const QGen &g);
-    Display renderLarger(const QGen &g);
-
-    void renderHorizontalLine(QPainter &painter, qreal x, qreal y, qreal length, qreal widthFactor = 1.0);
-    void renderHorizontalLine(Display &dest, QPointF where, qreal length, qreal widthFactor = 1.0);
-    qreal renderText(Display &dest, const QString &text, int relativeFontSizeLevel = 0,
-                     QPointF where = QPointF(0, 0), QRectF *boundingRect = Q_NULLPTR);
-    void renderTextAndAdvance(Display &dest, const QString &text, QPointF &penPoint);
-    void renderBracketExtensionFill(QPainter &painter, const QChar &extension, qreal x, qreal yLower, qreal yUpper);
-    qreal renderSingleBracket(QPainter &painter, qreal x, qreal halfHeight, QChar bracket, bool scaleX = false);
-    qreal renderSingleFillBracket(QPainter &painter, qreal x, qreal halfHeight,
-                                  QChar upperPart, QChar lowerPart, QChar extension, QChar singleBracket);
-    qreal renderCurlyBracket(QPainter &painter, qreal x, qreal halfHeight, bool left);
-    void renderDisplay(Display &dest, const Display &source, QPointF where);
-    void renderDisplayWithRadical(Display &dest, const Display &source, QPointF where);
-    void renderDisplayWithAccent(Display &dest, const Display &source, AccentType accentType, QPointF where);
-    qreal renderDisplayWithBrackets(Display &dest, const Display &source,
-                                    BracketType leftBracketType, BracketType rightBracketType, QPointF where);
-    qreal renderDisplayWithParentheses(Display &dest, const Display &source, QPointF where);
-    qreal renderDisplayWithPriority(Display &dest, const Display &source, int priority, QPointF where);
-    qreal renderDisplayWithSquareBrackets(Display &dest, const Display &source, QPointF where);
-    qreal renderDisplayWithCurlyBrackets(Display &dest, const Display &source, QPointF where);
-    void renderDisplayAndAdvance(Display &dest, const Display &source, QPointF &penPoint);
-    void renderRealNumber(Display &dest, const QGen &g, QPointF where);
-    void renderComplexNumber(Display &dest, const QGen &realPart, const QGen &imaginaryPart, QPointF where);
-    void renderIdentifier(Display &dest, const QGen &g, QPointF where);
-    void renderLeadingUnderscoreIdentifier(Display &dest, const QGen &g, QPointF where);
-    void renderVector(Display &dest, const QGen &g, QPointF where);
-    void renderModular(Display &dest, const QGen &g, QPointF where);
-    void renderMap(Display &dest, const QGen &g, QPointF where);
-    void renderSymbolic(Display &dest, const QGen &g, QPointF where);
-    void renderUnary(Display &dest, const QGen &g, QPointF where);
-    void renderBinary(Display &dest, const QGen &g, QPointF where);
-    void renderAssociative(Display &dest, const QGen &g, const QVector<QGen> &operands, QPointF where);
-    void renderFraction(Display &dest, const QGen &numerator, const QGen &denominator, QPointF where);
-    void renderSuperscript(Display &dest, const QGen &base, const QGen &exponent, int priority,
-                           QPointF where, bool withCircle = false);
-    void renderSubscript(Display &dest, const QGen &base, const QGen &subscript, int priority, QPointF where);
-
-    void movePenPointX(QPointF &penPoint, qreal offset) { penPoint.setX(penPoint.x() + offset); }
-    void movePenPointY(QPointF &penPoint, qreal offset) { penPoint.setY(penPoint.y() + offset); }
-    void movePenPointXY(QPointF &penPoint, qreal offsetX, qreal offsetY)
+    static void render(RenderContext &rc, Display &dest, const QGen &g, int sizeLevel = 0);
+    static Display renderNormal(RenderContext &rc, const QGen &g);
+    static Display renderSmaller(RenderContext &rc, const QGen &g);
+    static Display renderLarger(RenderContext &rc, const QGen &g);
+
+    static void renderHorizontalLine(RenderContext &rc, LayoutPainter &painter, qreal x, qreal y, qreal length, qreal widthFactor = 1.0);
+    static void renderHorizontalLineGlyphs(RenderContext &rc, LayoutPainter &painter, qreal length, qreal widthFactor);
+    static void renderHorizontalLine(RenderContext &rc, Display &dest, QPointF where, qreal length, qreal widthFactor = 1.0);
+    static qreal renderText(RenderContext &rc, Display &dest, const QString &text, int relativeFontSizeLevel = 0,
+                            QPointF where = QPointF(0, 0), QRectF *boundingRect = Q_NULLPTR);
+    static void renderTextAndAdvance(RenderContext &rc, Display &dest, const QString &text, QPointF &penPoint);
+    static void renderBracketExtensionFill(RenderContext &rc, LayoutPainter &painter, const QChar &extension, qreal x, qreal yLower, qreal yUpper);
+    static qreal renderSingleBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, QChar bracket, bool scaleX = false);
+    static qreal renderSingleFillBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight,
+                                         QChar upperPart, QChar lowerPart, QChar extension, QChar singleBracket);
+    static qreal renderCurlyBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, bool left);
+    static qreal renderBracket(RenderContext &rc, LayoutPainter &painter, qreal x, qreal halfHeight, BracketType type, bool left);
+    static qreal renderBracketGlyphs(RenderContext &rc, LayoutPainter &painter, qreal halfHeight, BracketType type, bool left);
+    static void renderDisplay(Display &dest, const Display &source, QPointF where);
+    static void renderDisplayWithRadical(RenderContext &rc, Display &dest, const Display &source, QPointF where);
+    static void renderDisplayWithAccent(RenderContext &rc, Display &dest, const Display &source, AccentType accentType, QPointF where);
+    static qreal renderDisplayWithBrackets(RenderContext &rc, Display &dest, const Display &source,
+                                           BracketType leftBracketType, BracketType rightBracketType, QPointF where);
+    static qreal renderDisplayWithParentheses(RenderContext &rc, Display &dest, const Display &source, QPointF where);
+    static qreal renderDisplayWithPriority(RenderContext &rc, Display &dest, const Display &source, int priority, QPointF where);
+    static qreal renderDisplayWithSquareBrackets(RenderContext &rc, Display &dest, const Display &source, QPointF where);
+    static qreal renderDisplayWithCurlyBrackets(RenderContext &rc, Display &dest, const Display &source, QPointF where);
+    static void renderDisplayAndAdvance(Display &dest, const Display &source, QPointF &penPoint);
+    static void renderLines(RenderContext &rc, Display &dest, const QVector<Display> &terms, qreal lineWidth, QPointF where);
+    static QByteArray convertIntegerDigits(mpz_srcptr n, int depth);
+    static QByteArray integerDigits(const gen &g);
+    static void renderDigitLines(RenderContext &rc, Display &dest, const QString &digits, QPointF &penPoint);
+    static void renderRealNumber(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderComplexNumber(RenderContext &rc, Display &dest, const QGen &realPart, const QGen &imaginaryPart, QPointF where);
+    static void renderIdentifier(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderLeadingUnderscoreIdentifier(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static QVector<Display> renderEntries(RenderContext &rc, const QVector<gen*> &entries);
+    static void renderChunk(RenderChunk &chunk);
+    static void renderElisionMarker(RenderContext &rc, Display &dest, const QString &ellipsis, int elidedCount, QPointF &penPoint);
+    static BackgroundRender renderDetached(const QGen *g, RenderContext rc, int alignment);
+    static qreal layoutResolution();
+    Display layout(RenderContext &rc) const;
+    static QPointF alignedOrigin(const Display &display, int alignment);
+    void indexDisplay(const Display &display, const QTransform &transform, int depth, const QSet<const gen*> &gens,
+                      QVector<QRectF> &rects, SubexpressionIndex &index) const;
+    static void renderVector(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderMatrix(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderModular(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderMap(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderSymbolic(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderUnary(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderBinary(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderAssociative(RenderContext &rc, Display &dest, const QGen &g, QPointF where);
+    static void renderFraction(RenderContext &rc, Display &dest, const QGen &numerator, const QGen &denominator, QPointF where);
+    static void renderSuperscript(RenderContext &rc, Display &dest, const QGen &base, const QGen &exponent, int priority,
+                                  QPointF where, bool withCircle = false);
+    static void renderSubscript(RenderContext &rc, Display &dest, const QGen &base, const QGen &subscript, int priority, QPointF where);
+
+    static void movePenPointX(QPointF &penPoint, qreal offset) { penPoint.setX(penPoint.x() + offset); }
+    static void movePenPointY(QPointF &penPoint, qreal offset) { penPoint.setY(penPoint.y() + offset); }
+    static void movePenPointXY(QPointF &penPoint, qreal offsetX, qreal offsetY)
     {
         movePenPointX(penPoint, offsetX);
         movePenPointY(penPoint, offsetY);
@@ -227,17 +525,16 @@ class QGen
     void translateBoundingRect(gen &g, int dx, int dy);
     void setSelected(gen &g, bool yes) { g._EQWptr->selected = yes; }
 
-    const QFont &getFont(int fontSizeLevel);
-    qreal textWidth(const QString &text, int relativeFontSizeLevel = 0);
-    QRectF textTightBoundingRect(const QString &text, int relativeFontSizeLevel = 0);
-    qreal fontHeight(int relativeFontSizeLevel = 0);
-    qreal fontAscent(int relativeFontSizeLevel = 0);
-    qreal fontDescent(int relativeFontSizeLevel = 0);
-    qreal fontXHeight(int relativeFontSizeLevel = 0);
-    qreal fontMidLine(int relativeFontSizeLevel = 0);
-    qreal fontLeading(int relativeFontSizeLevel = 0);
-    qreal lineWidth(int relativeFontSizeLevel = 0);
-    qreal linePadding(int relativeSizeLevel = 0);
+    static qreal textWidth(RenderContext &rc, const QString &text, int relativeFontSizeLevel = 0);
+    static QRectF textTightBoundingRect(RenderContext &rc, const QString &text, int relativeFontSizeLevel = 0);
+    static qreal fontHeight(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal fontAscent(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal fontDescent(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal fontXHeight(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal fontMidLine(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal fontLeading(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal lineWidth(RenderContext &rc, int relativeFontSizeLevel = 0);
+    static qreal linePadding(RenderContext &rc, int relativeSizeLevel = 0);
 
 public:
     enum InequalityType { LessThan = -2, GreaterThan = 2, LessThanOrEqualTo = -1, GreaterThanOrEqualTo = 1 };
@@ -249,12 +546,26 @@ public:
     QGen(const gen &e, GIAC_CONTEXT = context0);
     QGen(gen *e, GIAC_CONTEXT = context0);
     QGen(const QGen &e);
+    QGen(QGen &&e);
+    QGen(const QGenView &view);
     QGen(GIAC_CONTEXT = context0);
     QGen(const QString &text, GIAC_CONTEXT = context0);
     QGen(int value, GIAC_CONTEXT = context0);
     QGen(qreal value, GIAC_CONTEXT = context0);
 
-    ~QGen();
+    ~QGen() { }
+
+    QGen &operator =(const QGen &other);
+    QGen &operator =(QGen &&other);
+
+    // An owning QGen holds its expression by value, a non-owning one refers to a subexpression
+    // of another QGen (see QGenView); copying the latter yields an owning QGen.
+    bool ownsExpression() const { return expr == &value; }
+    QGenView view() const { return QGenView(*expr, ct); }
+
+    static int expressionCopies() { return expressionCopyCount.load(); }
+    static int layoutNodes() { return layoutNodeCount.load(); }
+    static void resetAllocationCounters() { expressionCopyCount.store(0); layoutNodeCount.store(0); }
 
     static QGen identifier(const QString &name, GIAC_CONTEXT = context0);
     static QGen string(const QString &text, GIAC_CONTEXT = context0);
@@ -271,11 +582,19 @@ public:
                                      const QGen &booleanFunction, GIAC_CONTEXT = context0);
     static bool findUserOperator(const QString &name, UserOperator &properties);
     static void setRenderingFont(const QString &family = "FreeSerif", int basePointSize = 12);
+    static RenderContext renderingContext();
+    static void setRenderCacheCapacity(int maximumItemCount);
+    static void clearRenderCache();
+    static int renderCacheHits();
+    static int renderCacheMisses();
+    static uint structuralHash(const gen &g, GIAC_CONTEXT = context0);
+    static void setParallelRenderingThreshold(int entryCount) { parallelRenderingThreshold = entryCount; }
 
     gen &expression() const { return *expr; }
     const context *contextPtr() const { return ct; }
 
     QString toString() const { return QString(expr->print(ct).data()); }
+    QString toFullString() const;
     QString toLaTeX() const;
     QString toMathML() const;
     QPicture toPicture(const QString &family, int size) const;
@@ -347,6 +666,11 @@ public:
 
     bool containsApproximateValue() const { return expr->is_approx(); }
     bool containsImaginaryUnit() const { return has_i(*expr); }
+    bool containsAssignment() const
+    {
+        return has_op(*expr, *at_sto) || has_op(*expr, *at_array_sto) ||
+               has_op(*expr, *at_increment) || has_op(*expr, *at_decrement);
+    }
 
     // operators
     bool isAssignmentOperator() const { return isUnaryFunction(at_sto); }
@@ -410,7 +734,7 @@ public:
     int operatorPriority() const;
     bool isOperator(int &type) const;
     bool isOperator() const;
-    bool isAssociativeOperator(vecteur &operands) const;
+    bool isAssociativeOperator(QVector<QGenView> &operands) const;
     bool isBinaryOperator(QGen &left, QGen &right) const;
     bool isUnaryOperator(QGen &operand) const;
     bool isTheSameOperatorAs(const QGen &g) const;
@@ -444,6 +768,24 @@ public:
     QGen valueForKey(const QGen &key) const;
     bool nthMapEntry(int n, QGen &key, QGen &value) const;
 
+    // Single-pass, Java-style iterator over the entries of a map, in key order.
+    class MapEntryIterator
+    {
+        gen_map::const_iterator m_current;
+        gen_map::const_iterator m_next;
+        gen_map::const_iterator m_end;
+        const context *m_ct;
+        bool m_started;
+
+    public:
+        MapEntryIterator(const QGen &g);
+
+        bool hasNext() const { return m_next != m_end; }
+        void next();
+        QGenView key() const { Q_ASSERT(m_started); return QGenView(m_current->first, m_ct); }
+        QGenView value() const { Q_ASSERT(m_started); return QGenView(m_current->second, m_ct); }
+    };
+
     QGen evaluate() const { return QGen(_eval(*expr, ct), ct); }
     QGen simplify() const { return QGen(_simplify(*expr, ct), ct); }
 
@@ -457,9 +799,42 @@ public:
     bool resizeVector(int n);
     QGen vectorPopFront();
 
-    QPicture render(int alignment = AlignLeft | AlignBaseline);
+    QPicture render(int alignment = AlignLeft | AlignBaseline, SubexpressionIndex *index = Q_NULLPTR) const;
+    QPicture render(RenderContext &rc, int alignment = AlignLeft | AlignBaseline, SubexpressionIndex *index = Q_NULLPTR) const;
+    // The expression must exist until the future has finished; the displays laid out are committed
+    // to the render cache with result().pendingCache.commit(*this) on the calling thread.
+    QFuture<BackgroundRender> renderInBackground(int alignment = AlignLeft | AlignBaseline, const QSizeF &viewport = QSizeF(),
+                                                 qreal lineWidth = 0.0) const;
+
+    // Vector export paints the layout tree directly on the output device, without an intermediate QPicture.
+    bool toSvg(QIODevice *device, int margin = 2) const;
+    bool toPdf(QIODevice *device, int margin = 2) const;
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(QGen::Alignment)
 
+/* SubexpressionIndex locates the subexpressions of a rendered expression, for hover highlighting
+ * and selection. QGen::render fills it with the bounding box of every layout node linked to a
+ * subexpression, in picture coordinates, and the boxes are kept in an R-tree. */
+class SubexpressionIndex
+{
+    friend class QGen;
+
+    HitTestIndex m_index;
+    QVector<QGen> m_expressions;
+    QVector<int> m_depths;
+
+public:
+    void clear();
+    bool isEmpty() const { return m_expressions.isEmpty(); }
+    int count() const { return m_expressions.size(); }
+    const QGen &expression(int i) const { return m_expressions.at(i); }
+    QRectF boundingRect(int i) const { return m_index.rect(i); }
+    int depth(int i) const { return m_depths.at(i); }
+
+    // Returns the innermost subexpression drawn at point, or -1.
+    int indexAt(const QPointF &point) const;
+    QVector<int> indicesIntersecting(const QRectF &rect) const { return m_index.itemsIntersecting(rect); }
+};
+
 #endif // QGEN_H
@@ -0,0 +1,215 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Headless batch renderer. Every nonempty input line is parsed as a giac expression with a
+ * shared context, rendered through the QGen engine on the global thread pool and written to
+ * <prefix><line number>.svg, .pdf or .png in the output directory. Vector formats are written
+ * straight from the layout by QGen::toSvg and QGen::toPdf. Parsing stays on the main thread
+ * because the giac parser is not reentrant; layout and image encoding run in parallel. The
+ * workers only read the expressions and the context, since giac reference counts are not atomic:
+ * the displays they lay out are collected per job and put into the render cache by the main thread
+ * once the pool is done.
+ *
+ * Usage: ample-render [--format svg|pdf|png] [--output-dir DIR] [--prefix NAME] [--scale S]
+ *                     [--font FAMILY] [--font-size PT] [--threads N] [FILE] */
+
+#include <QGuiApplication>
+#include <QCommandLineParser>
+#include <QFontDatabase>
+#include <QFile>
+#include <QDir>
+#include <QTextStream>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QImage>
+#include <QAtomicInt>
+#include <QtConcurrentMap>
+#include "qgen.h"
+
+struct RenderJob
+{
+    int line;
+    QGen expression;
+    QString fileName;
+    QGen::PendingRenderCache pendingCache;
+};
+
+struct RenderOptions
+{
+    QString format;
+    qreal scale;
+    int margin;
+};
+
+static RenderOptions options;
+static QAtomicInt failureCount;
+
+static bool writeVector(const QGen &g, const QString &fileName)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    return options.format == "svg" ? g.toSvg(&file, options.margin) : g.toPdf(&file, options.margin);
+}
+
+static bool writePng(const QPicture &picture, const QRect &rect, const QString &fileName)
+{
+    QImage image(rect.size() * options.scale, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    QPainter painter(&image);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setRenderHint(QPainter::TextAntialiasing);
+    painter.scale(options.scale, options.scale);
+    painter.drawPicture(-rect.topLeft(), picture);
+    painter.end();
+    return image.save(fileName, "PNG");
+}
+
+static void renderJob(RenderJob &job)
+{
+    bool ok;
+    job.pendingCache.beginCollecting();
+    if (options.format == "png")
+    {
+        QPicture picture = job.expression.render(QGen::AlignLeft | QGen::AlignBaseline);
+        QRect rect = picture.boundingRect().adjusted(-options.margin, -options.margin, options.margin, options.margin);
+        ok = writePng(picture, rect, job.fileName);
+    }
+    else
+        ok = writeVector(job.expression, job.fileName);
+    job.pendingCache.endCollecting();
+    if (!ok)
+    {
+        qWarning("Line %d: cannot write %s", job.line, qPrintable(job.fileName));
+        failureCount.ref();
+    }
+}
+
+static void loadFonts()
+{
+    QStringList fonts;
+    fonts << "FreeSerif.ttf" << "FreeSerifBold.ttf" << "FreeSerifBoldItalic.ttf" << "FreeSerifItalic.ttf";
+    foreach (const QString fontName, fonts)
+    {
+        QFile res(":/fonts/" + fontName);
+        if (!res.open(QIODevice::ReadOnly) || QFontDatabase::addApplicationFontFromData(res.readAll()) == -1)
+            qWarning("Failed to load font %s", qPrintable(fontName));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication a(argc, argv);
+    QCoreApplication::setApplicationName("ample-render");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders one giac expression per input line to an SVG, PDF or PNG image.");
+    parser.addHelpOption();
+    parser.addPositionalArgument("file", "Input file, standard input if omitted.", "[file]");
+    QCommandLineOption formatOption("format", "Output format, svg, pdf or png.", "format", "svg");
+    QCommandLineOption directoryOption("output-dir", "Directory for the images.", "dir", ".");
+    QCommandLineOption prefixOption("prefix", "File name prefix, followed by the line number.", "name", "expr-");
+    QCommandLineOption scaleOption("scale", "Pixel ratio of PNG images.", "factor", "2");
+    QCommandLineOption fontOption("font", "Font family.", "family", "FreeSerif");
+    QCommandLineOption fontSizeOption("font-size", "Base font size in points.", "size", "12");
+    QCommandLineOption threadsOption("threads", "Number of worker threads, all cores if omitted.", "count");
+    parser.addOption(formatOption);
+    parser.addOption(directoryOption);
+    parser.addOption(prefixOption);
+    parser.addOption(scaleOption);
+    parser.addOption(fontOption);
+    parser.addOption(fontSizeOption);
+    parser.addOption(threadsOption);
+    parser.process(a);
+
+    QString format = parser.value(formatOption).toLower();
+    if (format != "svg" && format != "pdf" && format != "png")
+    {
+        qCritical("Unknown format %s", qPrintable(format));
+        return 1;
+    }
+    options.format = format;
+    options.scale = qMax(0.1, parser.value(scaleOption).toDouble());
+    options.margin = 2;
+    if (parser.isSet(threadsOption))
+        QThreadPool::globalInstance()->setMaxThreadCount(qMax(1, parser.value(threadsOption).toInt()));
+
+    QDir directory(parser.value(directoryOption));
+    if (!directory.exists() && !directory.mkpath("."))
+    {
+        qCritical("Cannot create %s", qPrintable(directory.path()));
+        return 1;
+    }
+
+    QFile input;
+    QStringList arguments = parser.positionalArguments();
+    if (arguments.isEmpty())
+        input.open(stdin, QIODevice::ReadOnly | QIODevice::Text);
+    else
+    {
+        input.setFileName(arguments.first());
+        if (!input.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            qCritical("Cannot open %s", qPrintable(input.fileName()));
+            return 1;
+        }
+    }
+
+    loadFonts();
+    QGen::setRenderingFont(parser.value(fontOption), qMax(1, parser.value(fontSizeOption).toInt()));
+    context ct;
+
+    QElapsedTimer timer;
+    timer.start();
+    QVector<RenderJob> jobs;
+    QTextStream in(&input);
+    int line = 0, parseErrors = 0;
+    while (!in.atEnd())
+    {
+        QString text = in.readLine().trimmed();
+        ++line;
+        if (text.isEmpty())
+            continue;
+        first_error_line(&ct) = 0;
+        QGen g(text, &ct);
+        if (first_error_line(&ct) > 0)
+        {
+            qWarning("Line %d: parse error in \"%s\"", line, qPrintable(text));
+            ++parseErrors;
+            continue;
+        }
+        RenderJob job = { line, g, directory.filePath(QString("%1%2.%3").arg(parser.value(prefixOption)).arg(line).arg(format)) };
+        jobs.append(job);
+    }
+    qint64 parseTime = timer.nsecsElapsed();
+
+    QtConcurrent::blockingMap(jobs, renderJob);
+    for (QVector<RenderJob>::iterator it = jobs.begin(); it != jobs.end(); ++it)
+        it->pendingCache.commit(it->expression);
+    qint64 totalTime = timer.nsecsElapsed();
+
+    int written = jobs.size() - failureCount.load();
+    qreal seconds = qMax(qint64(1), totalTime) / 1e9;
+    QTextStream err(stderr);
+    err << written << " of " << jobs.size() + parseErrors << " expressions rendered in "
+        << QString::number(seconds, 'f', 3) << " s (parsing " << QString::number(parseTime / 1e9, 'f', 3) << " s, "
+        << QThreadPool::globalInstance()->maxThreadCount() << " threads), "
+        << QString::number(written / seconds, 'f', 1) << " expressions/s\n";
+    return written == jobs.size() + parseErrors ? 0 : 2;
+}
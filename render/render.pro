@@ -0,0 +1,37 @@
+#-------------------------------------------------
+#
+# Headless batch renderer: giac expressions in,
+# SVG, PDF or PNG images out.
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent
+LIBS     += -lgiac -lgmp
+
+TARGET = ample-render
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += ..
+DEPENDPATH += ..
+
+SOURCES += \
+        main.cpp \
+    ../qgen.cpp \
+    ../mathglyphs.cpp \
+    ../fontmetricstable.cpp \
+    ../rendercontext.cpp \
+    ../hittestindex.cpp
+
+HEADERS += \
+    ../qgen.h \
+    ../mathglyphs.h \
+    ../fontmetricstable.h \
+    ../rendercontext.h \
+    ../hittestindex.h
+
+RESOURCES += \
+    ../resources.qrc
@@ -0,0 +1,63 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <qmath.h>
+#include "rendercontext.h"
+
+RenderContext::RenderContext(const QString &family, int basePointSize, const giac::context *ct)
+    : m_giacContext(ct)
+    , m_bold(false)
+    , m_italic(false)
+    , m_lazyRenderingThreshold(1000)
+    , m_mapEntryLimit(0)
+    , m_numberDigitThreshold(200)
+    , m_maximumLineWidth(0.0)
+    , m_indexing(false)
+{
+    setFont(family, basePointSize);
+}
+
+void RenderContext::setFont(const QString &family, int basePointSize)
+{
+    m_fontFamily = family;
+    m_basePointSize = basePointSize;
+    m_fontKey = qHash(family) ^ uint(basePointSize);
+    m_fontSizes.clear();
+    m_fonts.clear();
+    m_fontMetricsTables.clear();
+    for (int i = -2; i < 2; ++i)
+    {
+        int pointSize = qRound(basePointSize * pow(2.0, (qreal)i / 2.0));
+        m_fontSizes << pointSize;
+        for (int style = 0; style < FontStyleCount; ++style)
+        {
+            QFont font(family, pointSize, (style & 2) != 0 ? QFont::Bold : QFont::Normal, (style & 1) != 0);
+            // text is measured by summing the advances of individual characters
+            font.setKerning(false);
+            m_fonts << font;
+            m_fontMetricsTables << QSharedPointer<FontMetricsTable>(new FontMetricsTable(font));
+        }
+    }
+    Q_ASSERT(m_fonts.size() == FontSizeLevelCount * FontStyleCount);
+}
+
+void RenderContext::reset()
+{
+    m_fontSizeLevelStack.clear();
+    m_bold = m_italic = false;
+    m_structuralHashes.clear();
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RENDERCONTEXT_H
+#define RENDERCONTEXT_H
+
+#include <QString>
+#include <QList>
+#include <QVector>
+#include <QStack>
+#include <QHash>
+#include <QFont>
+#include <QSizeF>
+#include <QSharedPointer>
+#include "fontmetricstable.h"
+
+namespace giac {
+class context;
+}
+
+class RenderContext
+{
+    QString m_fontFamily;
+    int m_basePointSize;
+    uint m_fontKey;
+    QList<int> m_fontSizes;
+    QVector<QFont> m_fonts;
+    QVector<QSharedPointer<FontMetricsTable> > m_fontMetricsTables;
+    const giac::context *m_giacContext;
+    QStack<int> m_fontSizeLevelStack;
+    bool m_bold;
+    bool m_italic;
+    QSizeF m_viewport;
+    int m_lazyRenderingThreshold;
+    int m_mapEntryLimit;
+    int m_numberDigitThreshold;
+    qreal m_maximumLineWidth;
+    bool m_indexing;
+    QHash<const void*, uint> m_structuralHashes;
+
+public:
+    enum { FontSizeLevelCount = 4, FontStyleCount = 4 };
+
+    RenderContext(const QString &family = "FreeSerif", int basePointSize = 12, const giac::context *ct = 0);
+
+    void setFont(const QString &family, int basePointSize);
+    void reset();
+
+    const QString &fontFamily() const { return m_fontFamily; }
+    int basePointSize() const { return m_basePointSize; }
+    uint fontKey() const { return m_fontKey; }
+    const giac::context *giacContext() const { return m_giacContext; }
+    void setGiacContext(const giac::context *ct) { m_giacContext = ct; }
+
+    int fontSizeLevel() const { Q_ASSERT(!m_fontSizeLevelStack.empty()); return m_fontSizeLevelStack.top(); }
+    int smallerFontSizeLevel() const { return fontSizeLevel() - 1; }
+    int largerFontSizeLevel() const { return fontSizeLevel() + 1; }
+    void pushFontSizeLevel(int level) { m_fontSizeLevelStack.push(level); }
+    void popFontSizeLevel() { m_fontSizeLevelStack.pop(); }
+    // the number of expressions being rendered, one while laying out the root expression
+    int nestingDepth() const { return m_fontSizeLevelStack.size(); }
+    bool isBold() const { return m_bold; }
+    bool isItalic() const { return m_italic; }
+    void setBold(bool yes) { m_bold = yes; }
+    void setItalic(bool yes) { m_italic = yes; }
+    QHash<const void*, uint> &structuralHashes() { return m_structuralHashes; }
+
+    // Vectors, matrices and associative operations with more than lazyRenderingThreshold()
+    // entries are laid out only until they fill the viewport, the rest is elided.
+    const QSizeF &viewport() const { return m_viewport; }
+    void setViewport(const QSizeF &size) { m_viewport = size; }
+    int lazyRenderingThreshold() const { return m_lazyRenderingThreshold; }
+    void setLazyRenderingThreshold(int entryCount) { m_lazyRenderingThreshold = entryCount; }
+    // Maps with more entries than mapEntryLimit() show only that many, zero means no limit.
+    int mapEntryLimit() const { return m_mapEntryLimit; }
+    void setMapEntryLimit(int entryCount) { m_mapEntryLimit = entryCount; }
+    // Numbers with more digits than numberDigitThreshold() are grouped and wrapped into lines as wide
+    // as the viewport; in lazy mode, lines which do not fit the viewport are elided from the middle.
+    int numberDigitThreshold() const { return m_numberDigitThreshold; }
+    void setNumberDigitThreshold(int digitCount) { m_numberDigitThreshold = digitCount; }
+    // Sums, products and sequences at the root are broken into lines not wider than maximumLineWidth()
+    // at operator boundaries, zero means no line breaking.
+    qreal maximumLineWidth() const { return m_maximumLineWidth; }
+    void setMaximumLineWidth(qreal width) { m_maximumLineWidth = width; }
+    // While a subexpression index is built, displays are linked with the expressions they show and
+    // the render cache is bypassed, since cached displays may come from expressions which are gone.
+    bool isIndexing() const { return m_indexing; }
+    void setIndexing(bool yes) { m_indexing = yes; }
+    bool isLazy(int entryCount) const { return m_viewport.isValid() && entryCount > m_lazyRenderingThreshold; }
+    // a digest of the settings which decide what is elided or broken into lines, for hashing render
+    // cache keys; only the root depends on the line width, so reflowing reuses the cached subexpressions
+    uint elisionKey() const
+    {
+        uint key = m_viewport.isValid() ? uint(qRound(m_viewport.width())) << 16 ^ uint(qRound(m_viewport.height())) : 0;
+        if (m_fontSizeLevelStack.isEmpty())
+            key ^= uint(qRound(m_maximumLineWidth)) * 8191;
+        return key ^ uint(m_mapEntryLimit) << 8 ^ uint(m_lazyRenderingThreshold) * 31 ^ uint(m_numberDigitThreshold) * 131;
+    }
+
+    int fontIndex(int fontSizeLevel) const
+    {
+        int level = 2 + qMin(qMax(fontSizeLevel, -2), 1);
+        return level * FontStyleCount + (m_bold ? 2 : 0) + (m_italic ? 1 : 0);
+    }
+    const QFont &font(int relativeFontSizeLevel = 0) const
+    {
+        return m_fonts.at(fontIndex(fontSizeLevel() + relativeFontSizeLevel));
+    }
+    FontMetricsTable &fontMetrics(int relativeFontSizeLevel = 0) const
+    {
+        return *m_fontMetricsTables.at(fontIndex(fontSizeLevel() + relativeFontSizeLevel));
+    }
+};
+
+#endif // RENDERCONTEXT_H
@@ -1,19 +1,10 @@
+#include <climits>
 #include "session.h"
+#include "sessionpool.h"
+#include "qgen.h"
 
 using namespace giac;
 
-MonitorThread::MonitorThread(context *ct) : contextptr(ct) { }
-
-void MonitorThread::run()
-{
-    while (true)
-    {
-        if (check_thread(contextptr) == 1)
-            QThread::msleep(50);
-        else break;
-    }
-}
-
 StopThread::StopThread(giac::context *ct) : contextptr(ct) { }
 
 void StopThread::run(){
@@ -88,13 +79,28 @@ void MessageBuffer::putBuffer()
 
 MessageStream::MessageStream(Session *s, int bsize) : std::ostream(new MessageBuffer(s, bsize)) { }
 
-gen Session::answer(undef);
+// Commands whose results differ between evaluations of the same input, or which act on the context
+// or the outside world; inputs calling them, directly or through a user function, bypass the memo.
+const QSet<QString> Session::nonDeterministicCommands = QSet<QString>()
+        << "rand" << "random" << "alea" << "hasard" << "randint" << "randvector" << "ranv" << "randmatrix"
+        << "ranm" << "randMat" << "randpoly" << "randPoly" << "randperm" << "shuffle" << "sample" << "randnorm"
+        << "randNorm" << "randexp" << "randbinomial" << "randpoisson" << "randgeometric" << "randchisquare"
+        << "randstudent" << "randfisher" << "randmultinomial" << "randseed" << "RandSeed" << "srand"
+        << "time" << "clock" << "read" << "write" << "input" << "textinput" << "purge" << "restart"
+        << "assume" << "additionally" << "unassume";
 
-Session::Session(QObject *parent) : QObject(parent)
+// Commands and identifiers referring to the history of evaluations, which the key does not hold.
+const QSet<QString> Session::historyReferences = QSet<QString>()
+        << "ans" << "Ans" << "quest" << "entry" << "Entry" << "_";
+
+Session::Session(QObject *parent)
+    : QObject(parent), pool(nullptr), answer(undef), running(false), nextJobId(1), killedJobId(0),
+      currentJobCancelled(false), memo(new EvaluationMemo), memoEnabled(true), memoHitCount(0), memoMissCount(0),
+      currentJobCached(false), currentJobMemoizable(false)
 {
     ct = new context;
-    monitor = new MonitorThread(ct);
     stopThread = new StopThread(ct);
+    connect(stopThread, SIGNAL(finished()), this, SLOT(stopThreadFinished()));
     messageStream = new MessageStream(this);
     signal(SIGINT, ctrl_c_signal_handler);
     logptr(messageStream, ct);
@@ -102,8 +108,8 @@ Session::Session(QObject *parent) : QObject(parent)
 
 Session::~Session()
 {
+    qDeleteAll(callbackTokens);
     delete ct;
-    delete monitor;
     delete stopThread;
     delete messageStream;
 }
@@ -133,38 +139,369 @@ QStringList& Session::getGiacMessages()
     return messages;
 }
 
-void Session::callback(const gen &g,void *newcontextptr)
+// Called by giac on the evaluation thread when the evaluation is complete. The result is handed
+// over to the thread of the session by a queued call, so no thread waits for the evaluation. The
+// token names the job, so a late result of an interrupted evaluation is not taken for the next one.
+void Session::callback(const gen &g, void *tokenptr)
 {
-    Q_UNUSED(newcontextptr)
+    CallbackToken *token = static_cast<CallbackToken*>(tokenptr);
+    token->answer = g;
+    QMetaObject::invokeMethod(token->session, "evaluationFinished", Qt::QueuedConnection, Q_ARG(void*, tokenptr));
+}
+
+void Session::evaluationFinished(void *tokenptr)
+{
+    CallbackToken *token = static_cast<CallbackToken*>(tokenptr);
+    callbackTokens.removeOne(token);
+    int jobId = token->jobId;
+    gen g = token->answer;
+    delete token;
+    if (!running || currentJob.id != jobId)
+        return;
     answer = g;
+    finishJob(jobId);
 }
 
 bool Session::evaluate(const gen &g)
 {
+    return submit(g) > 0;
+}
+
+// Jobs are kept in a single list ordered by priority; a job is inserted after the last job of
+// its own or a higher priority, so each priority is served first in, first out.
+void Session::enqueue(const Job &job)
+{
+    QList<Job>::iterator it = pendingJobs.end();
+    while (it != pendingJobs.begin() && (it - 1)->priority < job.priority)
+        --it;
+    pendingJobs.insert(it, job);
+}
+
+int Session::submit(const gen &g, JobPriority priority)
+{
+    Job job;
+    job.id = nextJobId++;
+    job.expression = g;
+    job.priority = priority;
+    enqueue(job);
+    if (!running)
+        startNextJob();
+    return job.id;
+}
+
+// The whole batch is queued at once; each job is started as soon as the previous one is finished,
+// without waiting for the receivers of the results.
+QList<int> Session::submit(const QList<gen> &batch, JobPriority priority)
+{
+    QList<int> jobIds;
+    foreach (const gen &g, batch)
+    {
+        Job job;
+        job.id = nextJobId++;
+        job.expression = g;
+        job.priority = priority;
+        enqueue(job);
+        jobIds.append(job.id);
+    }
+    if (!running)
+        startNextJob();
+    return jobIds;
+}
+
+bool Session::isPending(int jobId) const
+{
+    foreach (const Job &job, pendingJobs)
+    {
+        if (job.id == jobId)
+            return true;
+    }
+    return false;
+}
+
+// A pending job is removed from the queue, the running one is interrupted and its result discarded.
+bool Session::cancel(int jobId)
+{
+    for (int i = 0; i < pendingJobs.size(); ++i)
+    {
+        if (pendingJobs.at(i).id == jobId)
+        {
+            pendingJobs.removeAt(i);
+            if (pendingJobs.isEmpty() && !running && pool != nullptr)
+                pool->releaseSlot(this);
+            emit jobCancelled(jobId);
+            return true;
+        }
+    }
+    if (running && currentJob.id == jobId && !currentJobCancelled)
+    {
+        currentJobCancelled = true;
+        if (!currentJobCached)
+            killThread();
+        return true;
+    }
+    return finishedJobs.remove(jobId) > 0;
+}
+
+void Session::cancelAll()
+{
+    QList<Job> cancelled = pendingJobs;
+    pendingJobs.clear();
+    if (!running && pool != nullptr)
+        pool->releaseSlot(this);
+    foreach (const Job &job, cancelled)
+        emit jobCancelled(job.id);
+    if (running)
+        cancel(currentJob.id);
+}
+
+// Unlike cancelAll, the running evaluation is not interrupted, since interrupting giac interrupts
+// every context; its result is dropped when it arrives.
+void Session::discardAll()
+{
+    QList<Job> cancelled = pendingJobs;
+    pendingJobs.clear();
+    foreach (const Job &job, cancelled)
+        emit jobCancelled(job.id);
+    if (running)
+        currentJobCancelled = true;
+}
+
+bool Session::takeResult(int jobId, JobResult &result)
+{
+    if (!finishedJobs.contains(jobId))
+        return false;
+    result = finishedJobs.take(jobId);
+    return true;
+}
+
+bool Session::callsNonDeterministicCommand(const gen &g, GIAC_CONTEXT)
+{
+    switch (g.type)
+    {
+    case _SYMB:
+    {
+        QString name(g._SYMBptr->sommet.ptr()->print(contextptr));
+        return nonDeterministicCommands.contains(name) || historyReferences.contains(name) ||
+                callsNonDeterministicCommand(g._SYMBptr->feuille, contextptr);
+    }
+    case _VECT:
+    {
+        const_iterateur it;
+        for (it = g._VECTptr->begin(); it != g._VECTptr->end(); ++it)
+        {
+            if (callsNonDeterministicCommand(*it, contextptr))
+                return true;
+        }
+        return false;
+    }
+    case _FUNC:
+    {
+        QString name(g._FUNCptr->ptr()->print(contextptr));
+        return nonDeterministicCommands.contains(name) || historyReferences.contains(name);
+    }
+    case _IDNT:
+        return historyReferences.contains(QString(g._IDNTptr->id_name));
+    default:
+        return false;
+    }
+}
+
+// A rough estimate of the memory taken by a result, in kilobytes.
+int Session::memoCost(const gen &g, const QStringList &messages)
+{
+    qint64 bytes = 0;
+    QVector<const gen*> stack;
+    stack.append(&g);
+    while (!stack.isEmpty())
+    {
+        const gen *node = stack.takeLast();
+        bytes += sizeof(gen);
+        if (node->type == _SYMB)
+        {
+            bytes += sizeof(symbolic);
+            stack.append(&node->_SYMBptr->feuille);
+        }
+        else if (node->type == _VECT)
+        {
+            const_iterateur it;
+            for (it = node->_VECTptr->begin(); it != node->_VECTptr->end(); ++it)
+                stack.append(&(*it));
+        }
+        else if (node->type == _ZINT)
+            bytes += qint64(mpz_size(*node->_ZINTptr)) * sizeof(mp_limb_t);
+        else if (node->type == _FRAC)
+            stack << &node->_FRACptr->num << &node->_FRACptr->den;
+        else if (node->type == _CPLX)
+            stack << node->_CPLXptr << node->_CPLXptr + 1;
+        else if (node->type == _STRNG)
+            bytes += qint64(node->_STRNGptr->size());
+    }
+    foreach (const QString &message, messages)
+        bytes += message.size() * 2;
+    return int(qMin<qint64>(INT_MAX, bytes / 1024 + 1));
+}
+
+// The key holds the input together with the current value and the assumptions of every identifier
+// it depends on: the free identifiers of the input and, transitively, those of their values, so that
+// a change anywhere in a chain of definitions or in the body of a user function changes the key.
+// It is computed while no evaluation runs in the context.
+bool Session::memoKey(const gen &g, gen &key) const
+{
+    if (!memoEnabled || QGen(g, ct).containsAssignment() || callsNonDeterministicCommand(g, ct))
+        return false;
+    vecteur bindings;
+    QSet<QString> bound;
+    QList<gen> unbound;
+    unbound.append(g);
+    while (!unbound.isEmpty())
+    {
+        gen identifiers = _lname(unbound.takeFirst(), ct);
+        if (identifiers.type != _VECT)
+            continue;
+        const_iterateur it;
+        for (it = identifiers._VECTptr->begin(); it != identifiers._VECTptr->end(); ++it)
+        {
+            if (it->type != _IDNT || bound.contains(QString(it->_IDNTptr->id_name)))
+                continue;
+            bound.insert(QString(it->_IDNTptr->id_name));
+            gen value = it->eval(1, ct);
+            if (callsNonDeterministicCommand(value, ct))
+                return false;
+            bindings.push_back(makevecteur(*it, value, _about(*it, ct)));
+            if (value != *it)
+                unbound.append(value);
+        }
+    }
+    vecteur settings = makevecteur(decimal_digits(ct), angle_radian(ct), approx_mode(ct), complex_mode(ct));
+    key = makevecteur(g, gen(bindings), gen(settings));
+    return true;
+}
+
+// Disabling the memo only stops this session from using it, other sessions may share it.
+void Session::setMemoEnabled(bool enabled)
+{
+    memoEnabled = enabled;
+}
+
+// In a pool, a job is started only when the pool grants a slot; otherwise the pool starts it later.
+// A memoized result is delivered through the event loop like a computed one, so the receivers see
+// the same order of signals and already know the id of the job.
+void Session::startNextJob()
+{
+    if (running)
+        return;
+    if (pendingJobs.isEmpty())
+    {
+        if (pool != nullptr)
+            pool->releaseSlot(this);
+        return;
+    }
+    const Job &job = pendingJobs.first();
+    gen key;
+    currentJobMemoizable = memoKey(job.expression, key);
+    if (currentJobMemoizable)
+    {
+        EvaluationMemo::Entry *entry = memo->entries.object(QGen::structuralHash(key, ct));
+        if (entry != nullptr && entry->key == key)
+        {
+            ++memoHitCount;
+            currentJob = pendingJobs.takeFirst();
+            currentJobCancelled = false;
+            currentJobCached = true;
+            running = true;
+            answer = entry->result;
+            printCache = "";
+            messages = entry->messages;
+            processingStarted();
+            history_in(ct).push_back(currentJob.expression);
+            QMetaObject::invokeMethod(this, "finishJob", Qt::QueuedConnection, Q_ARG(int, currentJob.id));
+            return;
+        }
+    }
+    if (pool != nullptr && !pool->reserveSlot(this))
+        return;
     if (stopThread->isRunning())
         stopThread->wait(2000);
     printCache = "";
-    if (make_thread(g,eval_level(ct), callback, (void*)ct, ct))
+    messages.clear();
+    // the callback of the previous evaluation runs just before its thread releases the context,
+    // so a job started right after a result may have to wait for that thread to exit
+    CallbackToken *token = new CallbackToken;
+    token->session = this;
+    token->jobId = job.id;
+    QElapsedTimer timer;
+    timer.start();
+    while (!make_thread(job.expression, eval_level(ct), callback, (void*)token, ct))
     {
-        disconnect(monitor,SIGNAL(finished()),this,SLOT(resultReady()));
-        monitor->start();
-        connect(monitor,SIGNAL(finished()),this,SLOT(resultReady()));
-        processingStarted();
+        if (check_thread(ct) == 1 || timer.elapsed() > 100)
+        {
+            delete token;
+            QTimer::singleShot(20, this, SLOT(startNextJob()));
+            return;
+        }
+        QThread::yieldCurrentThread();
     }
-    else return false;
-    history_in(ct).push_back(g);
-    return true;
+    callbackTokens.append(token);
+    if (currentJobMemoizable)
+        ++memoMissCount;
+    currentMemoKey = key;
+    currentJob = pendingJobs.takeFirst();
+    currentJobCancelled = false;
+    currentJobCached = false;
+    running = true;
+    processingStarted();
+    history_in(ct).push_back(currentJob.expression);
 }
 
-void Session::resultReady()
+void Session::finishJob(int jobId)
 {
+    if (!running || currentJob.id != jobId)
+        return;
+    running = false;
+    if (pool != nullptr)
+        pool->releaseSlot(this);
     history_out(ct).push_back(answer);
-    processingFinished(answer, getGiacMessages());
+    if (currentJobCancelled)
+        emit jobCancelled(currentJob.id);
+    else
+    {
+        JobResult result;
+        result.result = answer;
+        result.messages = getGiacMessages();
+        result.cached = currentJobCached;
+        if (currentJobMemoizable && !currentJobCached && !is_undef(answer))
+        {
+            EvaluationMemo::Entry *entry = new EvaluationMemo::Entry;
+            entry->key = currentMemoKey;
+            entry->result = answer;
+            entry->messages = result.messages;
+            memo->entries.insert(QGen::structuralHash(currentMemoKey, ct), entry, memoCost(answer, result.messages));
+        }
+        finishedJobs.insert(currentJob.id, result);
+        emit jobFinished(currentJob.id);
+        processingFinished(answer, result.messages);
+    }
+    if (pendingJobs.isEmpty())
+        emit queueEmpty();
+    else
+        startNextJob();
+}
+
+// A killed evaluation thread never calls back, the evaluation is finished here instead; its token
+// stays with the session until then, as the thread may have called back just before it was killed.
+void Session::stopThreadFinished()
+{
+    if (running && currentJob.id == killedJobId && check_thread(ct) != 1)
+    {
+        answer = undef;
+        finishJob(killedJobId);
+    }
 }
 
 void Session::killThread()
 {
     if (!stopThread->isRunning()) {
+        killedJobId = currentJobId();
         emit(killingThread());
         stopThread->start();
     }
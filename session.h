@@ -4,10 +4,17 @@
 
 #include <QObject>
 #include <QThread>
+#include <QElapsedTimer>
 #include <QDebug>
 #include <QPicture>
 #include <QStringList>
 #include <QMap>
+#include <QHash>
+#include <QList>
+#include <QTimer>
+#include <QCache>
+#include <QSharedPointer>
+#include <QSet>
 #include <QStack>
 #include <QVector>
 #include <QFont>
@@ -23,19 +30,6 @@
 
 using namespace giac;
 
-class MonitorThread : public QThread
-{
-    Q_OBJECT
-public:
-    MonitorThread(context *ct);
-
-protected:
-    void run();
-
-private:
-    context* contextptr;
-};
-
 class StopThread : public QThread
 {
     Q_OBJECT
@@ -57,6 +51,22 @@ signals:
 };
 
 class Session;
+class SessionPool;
+
+// Results memoized by sessions, keyed by the structural hash of the memo key. The sessions of a pool
+// share the memo of the pool, so results outlive the sessions which computed them.
+struct EvaluationMemo
+{
+    struct Entry
+    {
+        gen key;
+        gen result;
+        QStringList messages;
+    };
+    QCache<uint, Entry> entries;
+
+    EvaluationMemo() : entries(64 * 1024) { }
+};
 
 class MessageBuffer : public std::streambuf
 {
@@ -81,34 +91,116 @@ public:
 class Session : public QObject
 {
     Q_OBJECT
+
+public:
+    // Interactive jobs are started before background jobs, jobs of equal priority in submission order.
+    enum JobPriority { BackgroundPriority, InteractivePriority };
+
+    struct JobResult
+    {
+        gen result;
+        QStringList messages;
+        bool cached;
+    };
+
+private:
+    struct Job
+    {
+        int id;
+        gen expression;
+        JobPriority priority;
+    };
+
+    // Handed to giac with each evaluation and back to the session with its result.
+    struct CallbackToken
+    {
+        Session *session;
+        int jobId;
+        gen answer;
+    };
+
     context *ct;
-    MonitorThread *monitor;
+    SessionPool *pool;
     StopThread *stopThread;
     MessageStream *messageStream;
     QString printCache;
     QStringList messages;
-    static gen answer;
-    static void callback(const gen &g, void *newcontextptr);
+    gen answer;
+    bool running;
+    int nextJobId;
+    int killedJobId;
+    QList<CallbackToken*> callbackTokens;
+    Job currentJob;
+    bool currentJobCancelled;
+    QList<Job> pendingJobs;
+    QHash<int, JobResult> finishedJobs;
+
+    QSharedPointer<EvaluationMemo> memo;
+    bool memoEnabled;
+    int memoHitCount;
+    int memoMissCount;
+    bool currentJobCached;
+    bool currentJobMemoizable;
+    gen currentMemoKey;
+    static const QSet<QString> nonDeterministicCommands;
+    static const QSet<QString> historyReferences;
+
+    static void callback(const gen &g, void *tokenptr);
+    void enqueue(const Job &job);
+    static bool callsNonDeterministicCommand(const gen &g, GIAC_CONTEXT);
+    static int memoCost(const gen &g, const QStringList &messages);
+    bool memoKey(const gen &g, gen &key) const;
 
 public:
     explicit Session(QObject *parent = nullptr);
     ~Session();
     const context *getContext() const { return ct; }
+    SessionPool *getPool() const { return pool; }
+    void setPool(SessionPool *p) { pool = p; }
     gen getAnswer() const { return answer; }
     QStringList &getGiacMessages();
     void appendPrintCache(const QChar &c);
     void clearGiacMessages() { messages.clear(); }
     bool evaluate(const gen &g);
+    int submit(const gen &g, JobPriority priority = InteractivePriority);
+    QList<int> submit(const QList<gen> &batch, JobPriority priority = BackgroundPriority);
+    bool cancel(int jobId);
+    void cancelAll();
+    void discardAll();
+    bool isPending(int jobId) const;
+    bool hasResult(int jobId) const { return finishedJobs.contains(jobId); }
+    bool takeResult(int jobId, JobResult &result);
+    int pendingJobCount() const { return pendingJobs.size(); }
+    int currentJobId() const { return running ? currentJob.id : 0; }
     void killThread();
-    bool isRunning() const { return monitor->isRunning(); }
+    bool isRunning() const { return running; }
+
+    // Results of deterministic inputs without assignments are memoized, keyed by the input, the values
+    // of its free identifiers and the evaluation settings. The capacity is given in kilobytes; a memo
+    // shared with other sessions is resized and cleared for all of them.
+    bool isMemoEnabled() const { return memoEnabled; }
+    void setMemoEnabled(bool enabled);
+    void setSharedMemo(const QSharedPointer<EvaluationMemo> &shared) { memo = shared; }
+    int memoCapacity() const { return memo->entries.maxCost(); }
+    void setMemoCapacity(int kilobytes) { memo->entries.setMaxCost(kilobytes); }
+    void clearMemo() { memo->entries.clear(); }
+    int memoHits() const { return memoHitCount; }
+    int memoMisses() const { return memoMissCount; }
+    void resetMemoCounters() { memoHitCount = memoMissCount = 0; }
 
 signals:
     void processingStarted();
     void processingFinished(const gen &result, const QStringList &messages);
+    void jobFinished(int jobId);
+    void jobCancelled(int jobId);
+    void queueEmpty();
     void killingThread();
 
-public slots:
-    void resultReady();
+private slots:
+    void evaluationFinished(void *tokenptr);
+    void finishJob(int jobId);
+    void startNextJob();
+    void stopThreadFinished();
 
 };
 
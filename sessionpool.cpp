@@ -0,0 +1,147 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QThread>
+#include <QMetaObject>
+#include "sessionpool.h"
+#include "session.h"
+
+SessionPool::SessionPool(QObject *parent) : QObject(parent), memo(new EvaluationMemo)
+{
+    m_maximumConcurrency = qMax(1, QThread::idealThreadCount());
+}
+
+SessionPool::~SessionPool()
+{
+    QMap<QObject*, Session*>::const_iterator it;
+    for (it = sessions.constBegin(); it != sessions.constEnd(); ++it)
+        disconnect(it.key(), SIGNAL(destroyed(QObject*)), this, SLOT(ownerDestroyed(QObject*)));
+}
+
+Session *SessionPool::session(QObject *owner)
+{
+    Session *session = sessions.value(owner);
+    if (session == nullptr)
+    {
+        session = new Session(this);
+        session->setPool(this);
+        session->setSharedMemo(memo);
+        sessions.insert(owner, session);
+        connect(owner, SIGNAL(destroyed(QObject*)), this, SLOT(ownerDestroyed(QObject*)));
+        emit busyCountChanged(busyCount(), sessionCount());
+    }
+    return session;
+}
+
+QObject *SessionPool::owner(const Session *session) const
+{
+    return sessions.key(const_cast<Session*>(session));
+}
+
+bool SessionPool::isBusy(QObject *owner) const
+{
+    Session *session = sessions.value(owner);
+    return session != nullptr && busySessions.contains(session);
+}
+
+void SessionPool::setMaximumConcurrency(int count)
+{
+    m_maximumConcurrency = qMax(1, count);
+    while (slotHolders.size() < m_maximumConcurrency && !waitingSessions.isEmpty())
+    {
+        Session *next = waitingSessions.takeFirst();
+        slotHolders.insert(next);
+        QMetaObject::invokeMethod(next, "startNextJob", Qt::QueuedConnection);
+    }
+}
+
+// Interrupting giac interrupts every context, so the running evaluation of a released session is
+// left to finish, still holding its slot, and its result is dropped; then the session is deleted.
+void SessionPool::release(QObject *owner)
+{
+    Session *session = sessions.take(owner);
+    if (session == nullptr)
+        return;
+    disconnect(owner, SIGNAL(destroyed(QObject*)), this, SLOT(ownerDestroyed(QObject*)));
+    if (session->isRunning())
+    {
+        connect(session, SIGNAL(queueEmpty()), session, SLOT(deleteLater()));
+        session->discardAll();
+    }
+    else
+    {
+        session->discardAll();
+        releaseSlot(session);
+        session->setPool(nullptr);
+        session->deleteLater();
+    }
+    emit busyCountChanged(busyCount(), sessionCount());
+}
+
+void SessionPool::ownerDestroyed(QObject *owner)
+{
+    release(owner);
+}
+
+void SessionPool::setBusy(Session *session, bool busy)
+{
+    if (busySessions.contains(session) == busy)
+        return;
+    if (busy)
+        busySessions.insert(session);
+    else
+        busySessions.remove(session);
+    QObject *owner = this->owner(session);
+    if (owner != nullptr)
+        emit busyChanged(owner, busy);
+    emit busyCountChanged(busyCount(), sessionCount());
+}
+
+// Called by a session before it starts a job; a session which is refused a slot is started again
+// when another session hands its slot over.
+bool SessionPool::reserveSlot(Session *session)
+{
+    setBusy(session, true);
+    if (slotHolders.contains(session))
+        return true;
+    if (slotHolders.size() < m_maximumConcurrency)
+    {
+        slotHolders.insert(session);
+        return true;
+    }
+    if (!waitingSessions.contains(session))
+        waitingSessions.append(session);
+    return false;
+}
+
+// Called by a session when its job is finished; the slot goes to the session which has waited
+// longest, so a session with a long queue cannot keep it from the others.
+void SessionPool::releaseSlot(Session *session)
+{
+    waitingSessions.removeAll(session);
+    bool released = slotHolders.remove(session);
+    if (released && !waitingSessions.isEmpty() && slotHolders.size() < m_maximumConcurrency)
+    {
+        Session *next = waitingSessions.takeFirst();
+        slotHolders.insert(next);
+        QMetaObject::invokeMethod(next, "startNextJob", Qt::QueuedConnection);
+    }
+    if (session->pendingJobCount() == 0 && !session->isRunning())
+        setBusy(session, false);
+    if (released && slotHolders.isEmpty())
+        emit idle();
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSIONPOOL_H
+#define SESSIONPOOL_H
+
+#include <QObject>
+#include <QMap>
+#include <QSet>
+#include <QList>
+#include <QSharedPointer>
+
+class Session;
+struct EvaluationMemo;
+
+// Each owner (a worksheet or an isolated group of cells) evaluates in its own Session, with its
+// own giac context and evaluation thread. At most maximumConcurrency() sessions evaluate at the
+// same time, the others wait for a slot in the order in which they asked for it. The sessions share
+// one memo, which lives as long as the pool.
+class SessionPool : public QObject
+{
+    Q_OBJECT
+    QMap<QObject*, Session*> sessions;
+    QSet<Session*> slotHolders;
+    QList<Session*> waitingSessions;
+    QSet<Session*> busySessions;
+    int m_maximumConcurrency;
+    QSharedPointer<EvaluationMemo> memo;
+
+    void setBusy(Session *session, bool busy);
+
+private slots:
+    void ownerDestroyed(QObject *owner);
+
+public:
+    explicit SessionPool(QObject *parent = nullptr);
+    ~SessionPool();
+
+    Session *session(QObject *owner);
+    QObject *owner(const Session *session) const;
+    void release(QObject *owner);
+    int sessionCount() const { return sessions.size(); }
+    int busyCount() const { return busySessions.size(); }
+    int runningCount() const { return slotHolders.size(); }
+    bool isBusy(QObject *owner) const;
+    int maximumConcurrency() const { return m_maximumConcurrency; }
+    void setMaximumConcurrency(int count);
+
+    bool reserveSlot(Session *session);
+    void releaseSlot(Session *session);
+
+signals:
+    void busyChanged(QObject *owner, bool busy);
+    void busyCountChanged(int busyCount, int sessionCount);
+    // no session is evaluating
+    void idle();
+};
+
+#endif // SESSIONPOOL_H
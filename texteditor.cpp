@@ -22,6 +22,10 @@
 #include <QString>
 #include <QFileInfo>
 #include <QTextDocumentFragment>
+#include <QContextMenuEvent>
+#include <QMenu>
+#include <QPointer>
+#include <QAbstractTextDocumentLayout>
 #include "texteditor.h"
 
 int TextEditor::unnamedCount = 0;
@@ -31,8 +35,10 @@ TextEditor::TextEditor(Worksheet *worksheet, QWidget *parent)
 {
     setDocument(worksheet);
     m_worksheet = worksheet;
+    lastScrollPosition = 0;
     //setAcceptRichText(false);
     connect(this, SIGNAL(cursorPositionChanged()), this, SLOT(cursorMoved()));
+    connect(verticalScrollBar(), SIGNAL(valueChanged(int)), this, SLOT(scrolled(int)));
 }
 
 TextEditor::~TextEditor()
@@ -105,6 +111,41 @@ void TextEditor::keyPressEvent(QKeyEvent *event)
     QTextEdit::keyPressEvent(event);
 }
 
+void TextEditor::resizeEvent(QResizeEvent *event)
+{
+    QTextEdit::resizeEvent(event);
+    worksheet()->setCasOutputLineWidth(viewport()->width() - 2.0 * worksheet()->documentMargin());
+}
+
+// Outputs of CAS cells offer the complete value, of which huge results show only the beginning.
+void TextEditor::contextMenuEvent(QContextMenuEvent *event)
+{
+    QMenu *menu = createStandardContextMenu(event->pos());
+    QPointer<QTextFrame> inputFrame = worksheet()->casInputFrameAt(cursorForPosition(event->pos()).position());
+    QAction *showMoreAction = nullptr, *showAllAction = nullptr, *copyAction = nullptr;
+    if (!inputFrame.isNull() && worksheet()->hasCasResult(inputFrame))
+    {
+        bool elided = worksheet()->isCasOutputElided(inputFrame);
+        menu->addSeparator();
+        showMoreAction = menu->addAction(tr("Show &More Output"));
+        showMoreAction->setEnabled(elided);
+        showAllAction = menu->addAction(tr("Show &Entire Output"));
+        showAllAction->setEnabled(elided);
+        copyAction = menu->addAction(tr("Copy &Full Value"));
+    }
+    QAction *action = menu->exec(event->globalPos());
+    if (action != nullptr && !inputFrame.isNull())
+    {
+        if (action == showMoreAction)
+            worksheet()->expandCasOutput(inputFrame);
+        else if (action == showAllAction)
+            worksheet()->showAllCasOutput(inputFrame);
+        else if (action == copyAction)
+            worksheet()->copyCasOutput(inputFrame);
+    }
+    delete menu;
+}
+
 void TextEditor::mergeFormatOnWordOrSelection(const QTextCharFormat &format)
 {
     QTextCursor cursor = textCursor();
@@ -118,6 +159,30 @@ void TextEditor::cursorMoved()
 {
 }
 
+// An elided output is expanded when scrolling down brings its end, where the elision marker is, into view.
+void TextEditor::scrolled(int position)
+{
+    int previousPosition = lastScrollPosition;
+    lastScrollPosition = position;
+    if (position <= previousPosition)
+        return;
+    int height = viewport()->height();
+    QAbstractTextDocumentLayout *layout = worksheet()->documentLayout();
+    QTextFrame::iterator it;
+    for (it = worksheet()->rootFrame()->begin(); !it.atEnd(); ++it)
+    {
+        QTextFrame *frame = it.currentFrame();
+        if (frame == 0 || !worksheet()->isCasOutputFrame(frame))
+            continue;
+        QTextFrame *inputFrame = (QTextFrame*)frame->frameFormat().property(Worksheet::AssociatedFrame).value<void*>();
+        if (!worksheet()->isCasOutputElided(inputFrame))
+            continue;
+        qreal bottom = layout->frameBoundingRect(frame).bottom();
+        if (bottom > previousPosition + height && bottom <= position + height)
+            worksheet()->expandCasOutput(inputFrame);
+    }
+}
+
 bool TextEditor::cursorAtEndOfWord()
 {
     QTextCursor cursor = textCursor();
@@ -41,16 +41,20 @@ signals:
 protected:
     void paintEvent(QPaintEvent *event) override;
     void keyPressEvent(QKeyEvent *event) override;
+    void resizeEvent(QResizeEvent *event) override;
+    void contextMenuEvent(QContextMenuEvent *event) override;
 
 private:
     Worksheet *m_worksheet;
     QAction *menuAction;
     QActionGroup *activeDocuments;
+    int lastScrollPosition;
     static int unnamedCount;
 
 private slots:
     void menuActionTriggered(bool active);
     void cursorMoved();
+    void scrolled(int position);
 
 };
 
@@ -0,0 +1,88 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <QPainter>
+#include <qmath.h>
+#include "tilecache.h"
+
+TileCache::TileCache(qint64 budget, EvictionPolicy policy)
+    : m_budget(budget)
+    , m_totalCost(0)
+    , m_useCounter(0)
+    , m_policy(policy) { }
+
+void TileCache::setBudget(qint64 bytes)
+{
+    m_budget = bytes;
+    evict(0);
+}
+
+void TileCache::clear()
+{
+    m_tiles.clear();
+    m_totalCost = 0;
+}
+
+void TileCache::evict(qint64 requiredCost)
+{
+    while (!m_tiles.isEmpty() && m_totalCost + requiredCost > m_budget)
+    {
+        QHash<TileKey, Tile>::iterator victim = m_tiles.begin(), it;
+        for (it = m_tiles.begin(); it != m_tiles.end(); ++it)
+        {
+            if (m_policy == LargestFirst ? it->cost > victim->cost : it->lastUse < victim->lastUse)
+                victim = it;
+        }
+        m_totalCost -= victim->cost;
+        m_tiles.erase(victim);
+    }
+}
+
+// Returns a null pixmap if the tile does not fit into the budget; the caller should then
+// paint the picture directly.
+QPixmap TileCache::tile(qint64 key, const QPicture &picture, qreal scale)
+{
+    TileKey tileKey;
+    tileKey.key = key;
+    tileKey.scale = qRound(scale * 100);
+    QHash<TileKey, Tile>::iterator it = m_tiles.find(tileKey);
+    if (it != m_tiles.end())
+    {
+        it->lastUse = ++m_useCounter;
+        return it->pixmap;
+    }
+    QRectF rect = picture.boundingRect();
+    QSize size(qCeil(rect.width() * scale), qCeil(rect.height() * scale));
+    qint64 cost = qint64(size.width()) * size.height() * 4;
+    if (size.isEmpty() || cost > m_budget)
+        return QPixmap();
+    evict(cost);
+    Tile tile;
+    tile.pixmap = QPixmap(size);
+    tile.pixmap.setDevicePixelRatio(scale);
+    tile.pixmap.fill(Qt::transparent);
+    QPainter painter(&tile.pixmap);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setRenderHint(QPainter::TextAntialiasing);
+    painter.drawPicture(-rect.topLeft(), picture);
+    painter.end();
+    tile.cost = cost;
+    tile.lastUse = ++m_useCounter;
+    m_tiles.insert(tileKey, tile);
+    m_totalCost += cost;
+    return tile.pixmap;
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of Ample.
+ *
+ * Ample is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ample is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ample.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <QPixmap>
+#include <QPicture>
+#include <QHash>
+
+// TileCache keeps rasterized copies of rendered outputs, so that repainting the worksheet
+// blits pixmaps instead of replaying picture commands. A tile is identified by the output's
+// key and the scale it was rasterized at (device pixel ratio times zoom factor).
+class TileCache
+{
+public:
+    enum EvictionPolicy { LeastRecentlyUsed, LargestFirst };
+
+private:
+    struct TileKey
+    {
+        qint64 key;
+        int scale;
+
+        bool operator ==(const TileKey &other) const { return key == other.key && scale == other.scale; }
+        friend uint qHash(const TileKey &tileKey, uint seed = 0) { return qHash(tileKey.key, seed) ^ uint(tileKey.scale); }
+    };
+
+    struct Tile
+    {
+        QPixmap pixmap;
+        qint64 cost;
+        quint64 lastUse;
+    };
+
+    QHash<TileKey, Tile> m_tiles;
+    qint64 m_budget;
+    qint64 m_totalCost;
+    quint64 m_useCounter;
+    EvictionPolicy m_policy;
+
+    void evict(qint64 requiredCost);
+
+public:
+    TileCache(qint64 budget = 64 * 1024 * 1024, EvictionPolicy policy = LeastRecentlyUsed);
+
+    qint64 budget() const { return m_budget; }
+    void setBudget(qint64 bytes);
+    EvictionPolicy evictionPolicy() const { return m_policy; }
+    void setEvictionPolicy(EvictionPolicy policy) { m_policy = policy; }
+    qint64 totalCost() const { return m_totalCost; }
+    int count() const { return m_tiles.size(); }
+    void clear();
+
+    QPixmap tile(qint64 key, const QPicture &picture, qreal scale);
+};
+
+#endif // TILECACHE_H
@@ -19,16 +19,42 @@
 #include <QTextTableFormat>
 #include <QTextLength>
 #include <QDebug>
+#include <QAbstractTextDocumentLayout>
+#include <QFutureWatcher>
+#include <QGuiApplication>
+#include <QClipboard>
 #include "worksheet.h"
 #include "mathglyphs.h"
+#include "mathtextobject.h"
+#include "qgen.h"
+#include "session.h"
+#include "sessionpool.h"
+#include "dependencygraph.h"
 
 Worksheet::Worksheet(QObject *parent) : QTextDocument(parent)
 {
     ghighlighter = new GiacHighlighter(this);
+    casOutputLineWidth = 0.0;
+    m_sessionPool = nullptr;
+    recomputeEvaluatedCount = recomputeMemoizedCount = 0;
+    recomputeDeferred = false;
+    casOutputReflowTimer = new QTimer(this);
+    casOutputReflowTimer->setSingleShot(true);
+    casOutputReflowTimer->setInterval(150);
+    connect(casOutputReflowTimer, SIGNAL(timeout()), this, SLOT(reflowCasOutputs()));
+    documentLayout()->registerHandler(MathTextObject::Id, new MathTextObject(this));
     setModified(false);
     connect(this, SIGNAL(modificationChanged(bool)), this, SLOT(on_modificationChanged(bool)));
 }
 
+// Running renders refer to the results kept in pendingCasOutputs, so they are waited for.
+Worksheet::~Worksheet()
+{
+    QMap<QObject*, PendingCasOutput>::const_iterator it;
+    for (it = pendingCasOutputs.constBegin(); it != pendingCasOutputs.constEnd(); ++it)
+        static_cast<QFutureWatcher<QGen::BackgroundRender>*>(it.key())->waitForFinished();
+}
+
 QString Worksheet::frameText(QTextFrame *frame)
 {
     QStringList lines;
@@ -98,6 +124,8 @@ QTextFrame* Worksheet::insertCasOutputFrame(QTextFrame *inputFrame)
     format.setFontPointSize(10);
     cursor.setCharFormat(format);
     cursor.setBlockCharFormat(format);
+    inputFrameFormat.setProperty(AssociatedFrame, qVariantFromValue((void*)outputFrame));
+    inputFrame->setFrameFormat(inputFrameFormat);
     connect(outputFrame, SIGNAL(destroyed(QObject*)), this, SLOT(casOutputDestroyed(QObject*)));
     return outputFrame;
 }
@@ -113,9 +141,16 @@ void Worksheet::casInputDestroyed(QObject *casInput)
     QTextFrameFormat frameFormat = frame->frameFormat();
     QString text = frameText(frame);
     qDebug() << text;
+    casResults.remove(casInput);
+    casOutputViewports.remove(casInput);
+    casOutputGenerations.remove(casInput);
+    renderingCasOutputs.remove(casInput);
+    elidedCasOutputs.remove(casInput);
+    casEvaluatedTexts.remove(casInput);
+    casEvaluatedDependencies.remove(casInput);
     if (frameFormat.hasProperty(AssociatedFrame))
     {
-        QTextFrame *outputFrame = (QTextFrame*)(frameFormat.property(AssociatedFrame).data());
+        QTextFrame *outputFrame = (QTextFrame*)frameFormat.property(AssociatedFrame).value<void*>();
         removeFrame(outputFrame);
     }
 }
@@ -124,7 +159,7 @@ void Worksheet::casOutputDestroyed(QObject *casOutput)
 {
     QTextFrame *frame = (QTextFrame*)casOutput;
     QTextFrameFormat frameFormat = frame->frameFormat();
-    QTextFrame *inputFrame = (QTextFrame*)(frameFormat.property(AssociatedFrame).data());
+    QTextFrame *inputFrame = (QTextFrame*)frameFormat.property(AssociatedFrame).value<void*>();
     frameFormat = inputFrame->frameFormat();
     frameFormat.clearProperty(AssociatedFrame);
     inputFrame->setFrameFormat(frameFormat);
@@ -217,6 +252,21 @@ bool Worksheet::isCasOutputFrame(QTextFrame *frame)
     return format.hasProperty(Subtype) && format.intProperty(Subtype) == CasOutput;
 }
 
+// The input frame of the cell at the position, which may be in the input or in the output of the cell.
+QTextFrame *Worksheet::casInputFrameAt(int position)
+{
+    QTextCursor cursor(this);
+    cursor.setPosition(position);
+    for (QTextFrame *frame = cursor.currentFrame(); frame != nullptr; frame = frame->parentFrame())
+    {
+        if (isCasInputFrame(frame))
+            return frame;
+        if (isCasOutputFrame(frame))
+            return (QTextFrame*)frame->frameFormat().property(AssociatedFrame).value<void*>();
+    }
+    return nullptr;
+}
+
 bool Worksheet::isTable(QTextFrame *frame, int &flags)
 {
     bool yes = frame->format().isTableFormat();
@@ -225,6 +275,249 @@ bool Worksheet::isTable(QTextFrame *frame, int &flags)
     return yes;
 }
 
+// The result is laid out on the thread pool with a snapshot of the rendering context, so the
+// worksheet stays responsive while large outputs are being rendered. Huge results are laid
+// out only as far as the viewport reaches; the result is kept, so that the output can be
+// expanded later.
+void Worksheet::renderCasOutput(QTextFrame *inputFrame, const QGen &result)
+{
+    casResults.insert(inputFrame, QSharedPointer<QGen>(new QGen(result)));
+    casOutputViewports.insert(inputFrame, QSizeF(textWidth() > 0 ? textWidth() : 1000.0, 1000.0));
+    startCasOutputRendering(inputFrame);
+}
+
+// Lays the kept result out for a viewport twice as large, showing more of what was elided.
+void Worksheet::expandCasOutput(QTextFrame *inputFrame)
+{
+    if (!casResults.contains(inputFrame))
+        return;
+    casOutputViewports[inputFrame] *= 2.0;
+    startCasOutputRendering(inputFrame);
+}
+
+// Lays the kept result out again without a viewport, which turns lazy rendering off, so nothing is
+// elided; the result is not recomputed and the digits of huge integers come from the conversion cache.
+void Worksheet::showAllCasOutput(QTextFrame *inputFrame)
+{
+    if (!casResults.contains(inputFrame))
+        return;
+    casOutputViewports[inputFrame] = QSizeF();
+    startCasOutputRendering(inputFrame);
+}
+
+// Copies the complete value, including the parts elided from the output.
+void Worksheet::copyCasOutput(QTextFrame *inputFrame)
+{
+    if (casResults.contains(inputFrame))
+        QGuiApplication::clipboard()->setText(casResults.value(inputFrame)->toFullString());
+}
+
+// Long sums, products and sequences in the outputs are broken into lines as wide as the worksheet.
+// While the worksheet is being resized, the outputs are laid out again only after the width settles;
+// the subexpressions come from the render cache, so only the line breaking is repeated.
+void Worksheet::setCasOutputLineWidth(qreal width)
+{
+    if (qAbs(width - casOutputLineWidth) < 1.0)
+        return;
+    casOutputLineWidth = width;
+    casOutputReflowTimer->start();
+}
+
+void Worksheet::reflowCasOutputs()
+{
+    QMap<QObject*, QSharedPointer<QGen> >::const_iterator it;
+    for (it = casResults.constBegin(); it != casResults.constEnd(); ++it)
+        startCasOutputRendering(static_cast<QTextFrame*>(it.key()));
+}
+
+// Only the cells whose text or dependencies changed since their last evaluation are evaluated again,
+// together with the cells depending on them. The context of a group keeps the assignments of every
+// cell evaluated in it, in the order of evaluation, so stale cells are never evaluated in an old
+// context: every group with stale cells starts in a new context, into which the cells whose
+// definitions reach the stale ones are evaluated first. Cells which share no identifiers with each
+// other form independent groups, which are evaluated in parallel when the pool allows it. The memo
+// belongs to the pool rather than to the sessions of the groups, so a stale cell whose input and
+// free identifiers did not change takes its result from an earlier recompute; assignments are never
+// memoized, so the definitions reaching the stale cells are evaluated again in the new contexts.
+void Worksheet::recompute()
+{
+    if (m_sessionPool == nullptr)
+        return;
+    cancelCasJobs();
+    // the giac parser is not reentrant, so the cells are parsed only while nothing is being evaluated
+    if (m_sessionPool->runningCount() > 0)
+    {
+        if (!recomputeDeferred)
+            connect(m_sessionPool, SIGNAL(idle()), this, SLOT(recompute()));
+        recomputeDeferred = true;
+        return;
+    }
+    if (recomputeDeferred)
+        disconnect(m_sessionPool, SIGNAL(idle()), this, SLOT(recompute()));
+    recomputeDeferred = false;
+    recomputeEvaluatedCount = recomputeMemoizedCount = 0;
+    QVector<QTextFrame*> frames;
+    QVector<QGen> inputs;
+    QStringList texts;
+    DependencyGraph graph;
+    QTextFrame::iterator it;
+    for (it = rootFrame()->begin(); !it.atEnd(); ++it)
+    {
+        QTextFrame *frame = it.currentFrame();
+        if (frame == nullptr || !isCasInputFrame(frame))
+            continue;
+        QString text = frameText(frame);
+        QGen input(text);
+        frames.append(frame);
+        texts.append(text);
+        inputs.append(input);
+        graph.addCell(input);
+    }
+    graph.build();
+    QVector<bool> modified(frames.size());
+    QVector<QSet<QObject*> > dependencies(frames.size());
+    for (int i = 0; i < frames.size(); ++i)
+    {
+        QObject *frame = frames.at(i);
+        foreach (int dependency, graph.dependencies(i))
+            dependencies[i].insert(frames.at(dependency));
+        modified[i] = !casEvaluatedTexts.contains(frame) || casEvaluatedTexts.value(frame) != texts.at(i) ||
+                casEvaluatedDependencies.value(frame) != dependencies.at(i);
+    }
+    int componentCount;
+    QVector<int> components = graph.components(componentCount);
+    QVector<QList<gen> > batches(componentCount);
+    QVector<QVector<int> > batchCells(componentCount);
+    foreach (int i, graph.requiredCells(graph.staleCells(modified)))
+    {
+        batches[components.at(i)].append(inputs.at(i).expression());
+        batchCells[components.at(i)].append(i);
+    }
+    // the previous contexts are not needed any more, their sessions are released with the groups,
+    // while their memoized results stay with the pool
+    foreach (QObject *group, casGroups)
+        group->deleteLater();
+    casGroups.clear();
+    for (int c = 0; c < componentCount; ++c)
+    {
+        if (batches.at(c).isEmpty())
+            continue;
+        QObject *group = new QObject(this);
+        casGroups.append(group);
+        Session *session = m_sessionPool->session(group);
+        connect(session, SIGNAL(jobFinished(int)), this, SLOT(casJobFinished(int)));
+        QList<int> jobIds = session->submit(batches.at(c), Session::BackgroundPriority);
+        for (int j = 0; j < jobIds.size(); ++j)
+        {
+            int i = batchCells.at(c).at(j);
+            CasJob job;
+            job.inputFrame = frames.at(i);
+            job.text = texts.at(i);
+            job.dependencies = dependencies.at(i);
+            casJobs.insert(qMakePair<QObject*, int>(session, jobIds.at(j)), job);
+        }
+    }
+    if (casJobs.isEmpty())
+        emit recomputeFinished(0, 0);
+}
+
+// Pending jobs are withdrawn; a running job is left to finish, since interrupting giac interrupts
+// every context, and its result is dropped.
+void Worksheet::cancelCasJobs()
+{
+    QHash<QPair<QObject*, int>, CasJob>::const_iterator it;
+    for (it = casJobs.constBegin(); it != casJobs.constEnd(); ++it)
+    {
+        Session *session = static_cast<Session*>(it.key().first);
+        if (session->isPending(it.key().second))
+            session->cancel(it.key().second);
+    }
+    casJobs.clear();
+}
+
+void Worksheet::casJobFinished(int jobId)
+{
+    Session *session = qobject_cast<Session*>(sender());
+    Session::JobResult result;
+    if (session == nullptr || !session->takeResult(jobId, result))
+        return;
+    QPair<QObject*, int> key(session, jobId);
+    if (!casJobs.contains(key))
+        return;
+    CasJob job = casJobs.take(key);
+    if (result.cached)
+        ++recomputeMemoizedCount;
+    else
+        ++recomputeEvaluatedCount;
+    if (!job.inputFrame.isNull())
+    {
+        casEvaluatedTexts.insert(job.inputFrame, job.text);
+        casEvaluatedDependencies.insert(job.inputFrame, job.dependencies);
+        renderCasOutput(job.inputFrame, QGen(result.result));
+    }
+    if (casJobs.isEmpty())
+        emit recomputeFinished(recomputeEvaluatedCount, recomputeMemoizedCount);
+}
+
+// While a render of the frame is running, only the generation is advanced; the render is started
+// again with the current result and settings once the running one finishes.
+void Worksheet::startCasOutputRendering(QTextFrame *inputFrame)
+{
+    int generation = ++casOutputGenerations[inputFrame];
+    if (renderingCasOutputs.contains(inputFrame))
+        return;
+    renderingCasOutputs.insert(inputFrame);
+    PendingCasOutput pending;
+    pending.inputFrame = inputFrame;
+    pending.generation = generation;
+    pending.result = casResults.value(inputFrame);
+    QFutureWatcher<QGen::BackgroundRender> *watcher = new QFutureWatcher<QGen::BackgroundRender>(this);
+    pendingCasOutputs.insert(watcher, pending);
+    connect(watcher, SIGNAL(finished()), this, SLOT(casOutputRendered()));
+    watcher->setFuture(pending.result->renderInBackground(QGen::AlignLeft | QGen::AlignTop,
+                                                          casOutputViewports.value(inputFrame),
+                                                          casOutputLineWidth));
+}
+
+void Worksheet::casOutputRendered()
+{
+    QFutureWatcher<QGen::BackgroundRender> *watcher = static_cast<QFutureWatcher<QGen::BackgroundRender>*>(sender());
+    PendingCasOutput pending = pendingCasOutputs.take(watcher);
+    QGen::BackgroundRender render = watcher->result();
+    render.pendingCache.commit(*pending.result);
+    QTextFrame *inputFrame = pending.inputFrame;
+    if (inputFrame != nullptr)
+    {
+        renderingCasOutputs.remove(inputFrame);
+        if (pending.generation == casOutputGenerations.value(inputFrame))
+        {
+            if (render.elidedCount > 0)
+                elidedCasOutputs.insert(inputFrame);
+            else
+                elidedCasOutputs.remove(inputFrame);
+            setCasOutput(inputFrame, render.picture);
+        }
+        else if (casResults.contains(inputFrame))
+            startCasOutputRendering(inputFrame);
+    }
+    watcher->deleteLater();
+}
+
+void Worksheet::setCasOutput(QTextFrame *inputFrame, const QPicture &picture)
+{
+    QTextFrameFormat inputFrameFormat = inputFrame->frameFormat();
+    QTextFrame *outputFrame = inputFrameFormat.hasProperty(AssociatedFrame) ?
+                (QTextFrame*)inputFrameFormat.property(AssociatedFrame).value<void*>() :
+                insertCasOutputFrame(inputFrame);
+    QTextCursor cursor(outputFrame->firstCursorPosition());
+    cursor.setPosition(outputFrame->lastPosition(), QTextCursor::KeepAnchor);
+    QTextCharFormat format;
+    format.setObjectType(MathTextObject::Id);
+    format.setProperty(MathTextObject::Data, QVariant::fromValue(picture));
+    format.setProperty(MathTextObject::Key, MathTextObject::nextKey());
+    cursor.insertText(QString(QChar::ObjectReplacementCharacter), format);
+}
+
 void Worksheet::on_modificationChanged(bool changed)
 {
 }
@@ -27,11 +27,22 @@
 #include <QTextFrame>
 #include <QTextTable>
 #include <QList>
+#include <QMap>
+#include <QPointer>
+#include <QPicture>
+#include <QSharedPointer>
+#include <QSizeF>
+#include <QTimer>
+#include <QHash>
+#include <QSet>
+#include <QPair>
 #include <qmath.h>
 #include "giachighlighter.h"
 
 class GiacHighlighter;
 class DocumentCounter;
+class QGen;
+class SessionPool;
 
 class Worksheet : public QTextDocument
 {
@@ -41,15 +52,52 @@ private:
     GiacHighlighter *ghighlighter;
     QString m_fileName;
     QString m_language;
+    // each input frame has at most one render in flight; renders started for an older generation
+    // of its output are superseded and their results dropped. The rendered result is kept until
+    // the render finishes, as the worker only refers to it.
+    struct PendingCasOutput
+    {
+        QPointer<QTextFrame> inputFrame;
+        int generation;
+        QSharedPointer<QGen> result;
+    };
+    QMap<QObject*, PendingCasOutput> pendingCasOutputs;
+    QMap<QObject*, int> casOutputGenerations;
+    QSet<QObject*> renderingCasOutputs;
+    QSet<QObject*> elidedCasOutputs;
+    QMap<QObject*, QSharedPointer<QGen> > casResults;
+    QMap<QObject*, QSizeF> casOutputViewports;
+    qreal casOutputLineWidth;
+    QTimer *casOutputReflowTimer;
+    SessionPool *m_sessionPool;
+
+    struct CasJob
+    {
+        QPointer<QTextFrame> inputFrame;
+        QString text;
+        QSet<QObject*> dependencies;
+    };
+    QHash<QPair<QObject*, int>, CasJob> casJobs;
+    QMap<QObject*, QString> casEvaluatedTexts;
+    QMap<QObject*, QSet<QObject*> > casEvaluatedDependencies;
+    QList<QObject*> casGroups;
+    bool recomputeDeferred;
+    int recomputeEvaluatedCount;
+    int recomputeMemoizedCount;
 
     QString frameText(QTextFrame *frame);
     QTextFrame *insertCasOutputFrame(QTextFrame *inputFrame);
+    void startCasOutputRendering(QTextFrame *inputFrame);
+    void cancelCasJobs();
 
 private slots:
     void casInputDestroyed(QObject *casInput);
     void casOutputDestroyed(QObject *casOutput);
     void on_modificationChanged(bool changed);
     void updateEnumeration(QObject *deletedObject = nullptr);
+    void casOutputRendered();
+    void reflowCasOutputs();
+    void casJobFinished(int jobId);
 
 public:
     enum PropertyId {
@@ -70,6 +118,7 @@ public:
     enum FrameSubtype { CasInput, CasOutput, Heading };
 
     Worksheet(QObject *parent = 0);
+    ~Worksheet();
 
     void insertHeadingFrame(QTextCursor &cursor, int level);
     void insertCasInputFrame(QTextCursor &cursor);
@@ -79,13 +128,32 @@ public:
     bool isHeadingFrame(QTextFrame *frame, int &level);
     bool isCasInputFrame(QTextFrame *frame);
     bool isCasOutputFrame(QTextFrame *frame);
+    QTextFrame *casInputFrameAt(int position);
+    bool hasCasResult(QTextFrame *inputFrame) const { return casResults.contains(inputFrame); }
+    // whether the shown output leaves entries out and is not being rendered again
+    bool isCasOutputElided(QTextFrame *inputFrame) const
+    {
+        return elidedCasOutputs.contains(inputFrame) && !renderingCasOutputs.contains(inputFrame);
+    }
     bool isTable(QTextFrame *frame, int &flags);
+    void renderCasOutput(QTextFrame *inputFrame, const QGen &result);
+    void expandCasOutput(QTextFrame *inputFrame);
+    void showAllCasOutput(QTextFrame *inputFrame);
+    void copyCasOutput(QTextFrame *inputFrame);
+    void setCasOutputLineWidth(qreal width);
+    SessionPool *sessionPool() const { return m_sessionPool; }
+    void setSessionPool(SessionPool *pool) { m_sessionPool = pool; }
+    void setCasOutput(QTextFrame *inputFrame, const QPicture &picture);
 
     inline bool isUnnamed() { return m_fileName.length() == 0; }
     inline const QString fileName() { return m_fileName; }
     inline void setFileName(QString fname) { m_fileName = fname; }
 
+public slots:
+    void recompute();
+
 signals:
+    void recomputeFinished(int evaluatedCount, int memoizedCount);
     void stylingEnableChanged(bool enabled);
     void alignEnableChanged(bool enabled);
 